@@ -0,0 +1,495 @@
+#if defined(__linux__)
+    #define _POSIX_C_SOURCE 200809L
+    #include <pthread.h>
+#endif
+
+#include "batch.h"
+#include "overlay.h"
+#include "patch.h"
+#include "util.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+    #define BATCH_LOCK(M) pthread_mutex_lock(M)
+    #define BATCH_UNLOCK(M) pthread_mutex_unlock(M)
+#else
+    /* jobs run on the calling thread, so nothing needs locking */
+    #define BATCH_LOCK(M) ((void)(M))
+    #define BATCH_UNLOCK(M) ((void)(M))
+#endif
+
+#define BATCH_FIELDS_MAX 4
+
+/* a patient shared between jobs; mapped on first use */
+struct batch_patient {
+    char* path;
+    struct file_map map;
+    int state;        /* 0 = not mapped yet, 1 = mapped, -1 = failed */
+    size_t users;     /* jobs yet to finish with this patient */
+};
+
+struct batch_job {
+    size_t line;
+    char* patch_path;
+    char* output_path;
+    size_t patient_index;
+    struct batch_patient* patient;    /* set once the manifest is parsed */
+    int has_expected_crc32;
+    uint32_t expected_crc32;
+    const char* error;   /* NULL if the job succeeded */
+};
+
+/* a worker's queue of jobs: order[head..tail) */
+struct batch_queue {
+    size_t head;
+    size_t tail;
+#if defined(__linux__)
+    pthread_mutex_t lock;
+#else
+    int lock;
+#endif
+};
+
+struct batch {
+    const struct exec_options* eo;
+    struct batch_job* jobs;
+    size_t job_count;
+    size_t* order;          /* job indices, grouped by patient */
+    struct batch_patient* patients;
+    size_t patient_count;
+    struct batch_queue* queues;
+    int workers;
+#if defined(__linux__)
+    pthread_mutex_t patient_lock;
+#else
+    int patient_lock;
+#endif
+};
+
+struct batch_worker {
+    struct batch* b;
+    int id;
+};
+
+static char* batch_strdup(const char* s, size_t len) {
+    char* ret = xmalloc(len + 1);
+    memcpy(ret, s, len);
+    ret[len] = '\0';
+    return ret;
+}
+
+static struct batch_patient* batch_find_patient(
+    struct batch* b,
+    size_t* capacity,
+    const char* path,
+    size_t len)
+{
+    struct batch_patient* p = NULL;
+    size_t i;
+    for (i = 0; i < b->patient_count; i++) {
+        if (strlen(b->patients[i].path) == len
+            && MEMEQ(b->patients[i].path, path, len))
+        {
+            return &b->patients[i];
+        }
+    }
+    if (b->patient_count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        b->patients = xrealloc(b->patients, *capacity * sizeof(*b->patients));
+    }
+    p = &b->patients[b->patient_count++];
+    p->path = batch_strdup(path, len);
+    p->state = 0;
+    p->users = 0;
+    return p;
+}
+
+/**
+ * Parses the manifest text into jobs. Patients are referenced by index until
+ * the patient array stops moving, then by pointer.
+ * @return 0 on success or nonzero (after reporting the bad line) on error
+ */
+static int batch_parse_manifest(
+    struct batch* b,
+    const unsigned char* text,
+    size_t len)
+{
+    size_t job_capacity = 0;
+    size_t patient_capacity = 0;
+    size_t pos = 0;
+    size_t line = 0;
+    size_t i;
+
+    while (pos < len) {
+        const char* field[BATCH_FIELDS_MAX];
+        size_t field_len[BATCH_FIELDS_MAX];
+        size_t fields = 0;
+        size_t end = pos;
+        struct batch_job* job = NULL;
+        struct batch_patient* patient = NULL;
+
+        line++;
+        while (end < len && text[end] != '\n') {
+            end++;
+        }
+
+        /* split the line on whitespace */
+        while (pos < end) {
+            size_t start = 0;
+            while (pos < end && isspace(text[pos])) {
+                pos++;
+            }
+            if (pos == end || (fields == 0 && text[pos] == '#')) {
+                break;
+            }
+            start = pos;
+            while (pos < end && !isspace(text[pos])) {
+                pos++;
+            }
+            if (fields == BATCH_FIELDS_MAX) {
+                fields++;
+                break;
+            }
+            field[fields] = (const char*)text + start;
+            field_len[fields++] = pos - start;
+        }
+        pos = end + 1;
+
+        if (fields == 0) {
+            continue;
+        } else if (fields < 3 || fields > BATCH_FIELDS_MAX) {
+            fprintf(stderr, "error: manifest line %lu: expected PATIENT PATCH"
+                " OUTPUT [EXPECTED-CRC32]\n", (unsigned long)line);
+            return -1;
+        }
+
+        if (b->job_count == job_capacity) {
+            job_capacity = job_capacity ? job_capacity * 2 : 64;
+            b->jobs = xrealloc(b->jobs, job_capacity * sizeof(*b->jobs));
+        }
+        job = &b->jobs[b->job_count++];
+        job->line = line;
+        job->patch_path = batch_strdup(field[1], field_len[1]);
+        job->output_path = batch_strdup(field[2], field_len[2]);
+        job->has_expected_crc32 = fields == 4;
+        job->expected_crc32 = 0;
+        job->error = NULL;
+        job->patient = NULL;
+
+        if (job->has_expected_crc32) {
+            char* crc = batch_strdup(field[3], field_len[3]);
+            char* crc_end = NULL;
+            job->expected_crc32 = (uint32_t)strtoul(crc, &crc_end, 16);
+            if (field_len[3] > 8 || *crc_end
+                || !isxdigit((unsigned char)*crc))
+            {
+                fprintf(stderr, "error: manifest line %lu: invalid CRC32:"
+                    " %s\n", (unsigned long)line, crc);
+                free(crc);
+                return -1;
+            }
+            free(crc);
+        }
+
+        patient = batch_find_patient(b, &patient_capacity, field[0],
+            field_len[0]);
+        patient->users++;
+        job->patient_index = (size_t)(patient - b->patients);
+    }
+
+    for (i = 0; i < b->job_count; i++) {
+        b->jobs[i].patient = &b->patients[b->jobs[i].patient_index];
+    }
+    return 0;
+}
+
+/* maps a job's patient if no other job has yet */
+static struct batch_patient* batch_acquire_patient(
+    struct batch* b,
+    struct batch_job* job)
+{
+    struct batch_patient* p = job->patient;
+    BATCH_LOCK(&b->patient_lock);
+    if (p->state == 0) {
+        p->state = map_file_read(p->path, &p->map) ? -1 : 1;
+    }
+    BATCH_UNLOCK(&b->patient_lock);
+    return p->state == 1 ? p : NULL;
+}
+
+/* unmaps a job's patient once the last job using it is done */
+static void batch_release_patient(struct batch* b, struct batch_job* job) {
+    struct batch_patient* p = job->patient;
+    BATCH_LOCK(&b->patient_lock);
+    if (--p->users == 0 && p->state == 1) {
+        unmap_file(&p->map);
+        p->state = 0;
+    }
+    BATCH_UNLOCK(&b->patient_lock);
+}
+
+/* loads a patch file, mapping it if possible */
+static int batch_load_patch(const char* path, struct file_map* m) {
+    FILE* f = NULL;
+    int code = 0;
+    if (!map_file_read(path, m)) {
+        return 0;
+    }
+    if (!(f = fopen(path, "rb"))) {
+        return -1;
+    }
+    code = load_file(f, m);
+    fclose(f);
+    return code;
+}
+
+static void batch_run_job(struct batch* b, struct batch_job* job) {
+    struct batch_patient* patient = NULL;
+    struct file_map patch;
+    struct file_map output;
+    struct patch_index idx;
+    struct patched_view view;
+    uint32_t crc = CRC32_BASE;
+    int code = 0;
+
+    if (!(patient = batch_acquire_patient(b, job))) {
+        job->error = "failed to map patient file";
+        batch_release_patient(b, job);
+        return;
+    }
+    if (batch_load_patch(job->patch_path, &patch)) {
+        job->error = "failed to read patch file";
+        batch_release_patient(b, job);
+        return;
+    }
+    code = patch_index_build(&idx, patch.data, patch.size,
+        b->eo->respect_post_trunc);
+    if (code) {
+        job->error = PATCH_CODE_STR[code];
+        unmap_file(&patch);
+        batch_release_patient(b, job);
+        return;
+    }
+
+    patched_view_init(&view, &idx, patient->map.data, patient->map.size);
+    if (map_file_write_from(job->output_path, patient->map.fd, view.size,
+        &output, NULL))
+    {
+        job->error = errno == ENOSPC ? "no space left for output file"
+            : "failed to write output file";
+    } else {
+        patched_view_apply(&view, output.data,
+            job->has_expected_crc32 ? &crc : NULL);
+        if (unmap_file(&output)) {
+            job->error = "unable to close output file";
+        } else if (job->has_expected_crc32
+            && crc32_finalize(crc) != job->expected_crc32)
+        {
+            job->error = "output CRC32 does not match; output deleted";
+            remove(job->output_path);
+        }
+    }
+
+    patched_view_free(&view);
+    patch_index_free(&idx);
+    unmap_file(&patch);
+    batch_release_patient(b, job);
+}
+
+/**
+ * Takes the next job for a worker: from the front of its own queue, or else
+ * stolen from the back of the fullest other queue.
+ * @return 0 if a job was taken, or nonzero if every queue is empty
+ */
+static int batch_take_job(struct batch* b, int id, size_t* job) {
+    struct batch_queue* own = &b->queues[id];
+    for (;;) {
+        struct batch_queue* victim = NULL;
+        size_t most = 0;
+        int i;
+
+        BATCH_LOCK(&own->lock);
+        if (own->head < own->tail) {
+            *job = b->order[own->head++];
+            BATCH_UNLOCK(&own->lock);
+            return 0;
+        }
+        BATCH_UNLOCK(&own->lock);
+
+        /* the fullest queue may have shrunk by the time it is stolen from,
+           so the steal itself is checked again */
+        for (i = 0; i < b->workers; i++) {
+            size_t left = 0;
+            if (i == id) {
+                continue;
+            }
+            BATCH_LOCK(&b->queues[i].lock);
+            left = b->queues[i].tail - b->queues[i].head;
+            BATCH_UNLOCK(&b->queues[i].lock);
+            if (left > most) {
+                most = left;
+                victim = &b->queues[i];
+            }
+        }
+        if (!victim) {
+            return -1;
+        }
+        BATCH_LOCK(&victim->lock);
+        if (victim->head < victim->tail) {
+            *job = b->order[--victim->tail];
+            BATCH_UNLOCK(&victim->lock);
+            return 0;
+        }
+        BATCH_UNLOCK(&victim->lock);
+    }
+}
+
+static void* batch_worker_run(void* arg) {
+    struct batch_worker* w = arg;
+    size_t job = 0;
+    while (!batch_take_job(w->b, w->id, &job)) {
+        batch_run_job(w->b, &w->b->jobs[job]);
+    }
+    return NULL;
+}
+
+/* where a job goes in the run order: grouped by patient, then by line */
+struct batch_order_key {
+    size_t patient_index;
+    size_t line;
+    size_t job;
+};
+
+static int compare_order_keys(const void* a, const void* b) {
+    const struct batch_order_key* ka = a;
+    const struct batch_order_key* kb = b;
+    if (ka->patient_index != kb->patient_index) {
+        return ka->patient_index < kb->patient_index ? -1 : 1;
+    }
+    return ka->line < kb->line ? -1 : ka->line > kb->line;
+}
+
+static void batch_run_workers(struct batch* b) {
+    struct batch_worker* workers = xmalloc(b->workers * sizeof(*workers));
+    size_t per_worker = b->job_count / b->workers;
+    int i;
+
+    /* hand each worker a contiguous block, so jobs on the same patient tend
+       to run close together and its mapping is shared rather than redone */
+    for (i = 0; i < b->workers; i++) {
+        b->queues[i].head = per_worker * i;
+        b->queues[i].tail = i == b->workers - 1
+            ? b->job_count : per_worker * (i + 1);
+#if defined(__linux__)
+        pthread_mutex_init(&b->queues[i].lock, NULL);
+#endif
+        workers[i].b = b;
+        workers[i].id = i;
+    }
+
+    run_parallel(workers, (size_t)b->workers, sizeof(*workers),
+        batch_worker_run);
+#if defined(__linux__)
+    for (i = 0; i < b->workers; i++) {
+        pthread_mutex_destroy(&b->queues[i].lock);
+    }
+#endif
+    free(workers);
+}
+
+int batch_run(const struct exec_options* eo, const char* manifest_path) {
+    struct batch b;
+    struct file_map manifest;
+    FILE* manifest_file = NULL;
+    size_t failed = 0;
+    size_t i;
+
+    b.eo = eo;
+    b.jobs = NULL;
+    b.job_count = 0;
+    b.order = NULL;
+    b.patients = NULL;
+    b.patient_count = 0;
+    b.queues = NULL;
+    b.workers = eo->jobs < 1 ? 1 : eo->jobs;
+
+    if (!(manifest_file = fopen(manifest_path, "rb"))
+        || load_file(manifest_file, &manifest))
+    {
+        fprintf(stderr, "error: failed to read manifest %s\n", manifest_path);
+        if (manifest_file) {
+            fclose(manifest_file);
+        }
+        return EXIT_FAILURE;
+    }
+    fclose(manifest_file);
+
+    if (batch_parse_manifest(&b, manifest.data, manifest.size)) {
+        unmap_file(&manifest);
+        failed = 1;
+        goto CLEANUP;
+    }
+    unmap_file(&manifest);
+
+    crc32_init();
+
+    if (b.job_count) {
+        struct batch_order_key* keys =
+            xmalloc(b.job_count * sizeof(*keys));
+        for (i = 0; i < b.job_count; i++) {
+            keys[i].patient_index = b.jobs[i].patient_index;
+            keys[i].line = b.jobs[i].line;
+            keys[i].job = i;
+        }
+        qsort(keys, b.job_count, sizeof(*keys), compare_order_keys);
+        b.order = xmalloc(b.job_count * sizeof(*b.order));
+        for (i = 0; i < b.job_count; i++) {
+            b.order[i] = keys[i].job;
+        }
+        free(keys);
+
+        if ((size_t)b.workers > b.job_count) {
+            b.workers = (int)b.job_count;
+        }
+        b.queues = xmalloc(b.workers * sizeof(*b.queues));
+#if defined(__linux__)
+        pthread_mutex_init(&b.patient_lock, NULL);
+#endif
+        batch_run_workers(&b);
+#if defined(__linux__)
+        pthread_mutex_destroy(&b.patient_lock);
+#endif
+    }
+
+    /* per-job errors, in manifest order */
+    for (i = 0; i < b.job_count; i++) {
+        if (b.jobs[i].error) {
+            fprintf(stderr, "error: manifest line %lu (%s): %s\n",
+                (unsigned long)b.jobs[i].line, b.jobs[i].output_path,
+                b.jobs[i].error);
+            failed++;
+        }
+    }
+    printf("batch: %lu jobs, %lu succeeded, %lu failed\n",
+        (unsigned long)b.job_count, (unsigned long)(b.job_count - failed),
+        (unsigned long)failed);
+
+CLEANUP:
+    for (i = 0; i < b.job_count; i++) {
+        free(b.jobs[i].patch_path);
+        free(b.jobs[i].output_path);
+    }
+    for (i = 0; i < b.patient_count; i++) {
+        free(b.patients[i].path);
+    }
+    free(b.jobs);
+    free(b.order);
+    free(b.patients);
+    free(b.queues);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
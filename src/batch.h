@@ -0,0 +1,19 @@
+#ifndef BATCH_H_INCLUDED
+#define BATCH_H_INCLUDED
+
+#include "options.h"
+
+/**
+ * Runs every job listed in the manifest at manifest_path on eo->jobs worker
+ * threads. Each non-empty manifest line that doesn't start with '#' holds a
+ * job as whitespace-separated fields:
+ *
+ *     PATIENT PATCH OUTPUT [EXPECTED-CRC32]
+ *
+ * Jobs that share a patient share one read-only mapping of it. Failed jobs
+ * are reported individually on stderr, followed by a summary on stdout.
+ * @return EXIT_SUCCESS if every job succeeded, or EXIT_FAILURE otherwise
+ */
+int batch_run(const struct exec_options* eo, const char* manifest_path);
+
+#endif
@@ -0,0 +1,285 @@
+#include "cache.h"
+#include "overlay.h"
+#include "util.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * An entry is, with all integers big-endian:
+ *
+ *     "IPSACMP2"
+ *     CRC32 (4 bytes) and size (8 bytes) of the patch
+ *     flags (4 bytes)
+ *     truncation length (4 bytes), or 0xFFFFFFFF if there is none
+ *     one past the last byte the patch writes (8 bytes)
+ *     number of extents (8 bytes)  size of the payload blob (8 bytes)
+ *     extents:  offset (8 bytes)  length (8 bytes)
+ *               fill (4 bytes), or 0xFFFFFFFF for literal bytes
+ *               offset of the literal bytes in the blob (8 bytes)
+ *     payload blob
+ *     the patch itself, which must match the one being loaded byte for byte
+ *     CRC32 of everything before it (4 bytes)
+ */
+static const char CACHE_MAGIC[] = "IPSACMP2";
+
+#define CACHE_MAGIC_WIDTH 8
+#define CACHE_HEADER_SIZE 52
+#define CACHE_EXTENT_SIZE 28
+#define CACHE_CRC_WIDTH 4
+
+#define CACHE_FLAG_READ_TRUNC 1
+#define CACHE_FLAG_TRAILING_DATA 2
+
+/* no truncation length, or a literal extent */
+#define CACHE_NONE 0xFFFFFFFFu
+
+/* no IPS patch writes past this */
+#define CACHE_END_MAX \
+    (((size_t)1 << (8 * HUNK_OFFSET_WIDTH)) + HUNK_LENGTH_MAX)
+
+#define CACHE_SUFFIX ".ipsc"
+
+char* patch_cache_path(
+    const char* dir,
+    uint32_t crc,
+    size_t size,
+    int read_trunc)
+{
+    /* "/", 8 hex digits, "-", up to 20 decimal digits, "-t", the suffix */
+    char* ret = xmalloc(strlen(dir) + 32 + sizeof(CACHE_SUFFIX));
+    sprintf(ret, "%s/%.8lx-%lu%s" CACHE_SUFFIX, dir, (unsigned long)crc,
+        (unsigned long)size, read_trunc ? "-t" : "");
+    return ret;
+}
+
+int patch_cache_load(
+    const char* path,
+    const unsigned char* data,
+    size_t size,
+    uint32_t crc,
+    int read_trunc,
+    struct file_map* m,
+    struct patch_index* idx)
+{
+    const unsigned char* p = NULL;
+    uint64_t flags = 0;
+    uint64_t trunc_length = 0;
+    uint64_t count = 0;
+    uint64_t blob_size = 0;
+    size_t blob = 0;
+    size_t end = 0;
+    size_t i;
+
+    if (map_file_read(path, m)) {
+        return CACHE_MISS;
+    }
+    p = m->data;
+
+    /* the key, then the layout, then the contents */
+    if (m->size < CACHE_HEADER_SIZE + CACHE_CRC_WIDTH
+        || m->size - CACHE_HEADER_SIZE - CACHE_CRC_WIDTH < size
+        || !MEMEQ(p, CACHE_MAGIC, CACHE_MAGIC_WIDTH)
+        || decode_big_endian_n(p + 8, 4) != crc
+        || decode_big_endian_n(p + 12, 8) != size)
+    {
+        goto STALE;
+    }
+    flags = decode_big_endian_n(p + 20, 4);
+    trunc_length = decode_big_endian_n(p + 24, 4);
+    count = decode_big_endian_n(p + 36, 8);
+    blob_size = decode_big_endian_n(p + 44, 8);
+    if (!(flags & CACHE_FLAG_READ_TRUNC) != !read_trunc
+        || count > (m->size - CACHE_HEADER_SIZE - CACHE_CRC_WIDTH - size)
+            / CACHE_EXTENT_SIZE
+        || blob_size != m->size - CACHE_HEADER_SIZE - CACHE_CRC_WIDTH - size
+            - count * CACHE_EXTENT_SIZE
+        || !MEMEQ(p + m->size - CACHE_CRC_WIDTH - size, data, size)
+        || crc32_quick(m->data, m->size - CACHE_CRC_WIDTH)
+            != decode_big_endian_n(p + m->size - CACHE_CRC_WIDTH,
+                CACHE_CRC_WIDTH))
+    {
+        goto STALE;
+    }
+
+    idx->data = m->data;
+    idx->size = m->size;
+    idx->hunks = xmalloc((count ? (size_t)count : 1) * sizeof(*idx->hunks));
+    idx->hunk_count = (size_t)count;
+    idx->eof_offset = 0;
+    idx->trunc_length = trunc_length == CACHE_NONE ? -1 : (int)trunc_length;
+    idx->trailing_data = (flags & CACHE_FLAG_TRAILING_DATA) != 0;
+    idx->max_end = (size_t)decode_big_endian_n(p + 28, 8);
+    if (idx->max_end > CACHE_END_MAX) {
+        goto STALE_INDEX;
+    }
+
+    /* the extents must make up an overlay: sorted, apart, and in bounds */
+    blob = CACHE_HEADER_SIZE + (size_t)count * CACHE_EXTENT_SIZE;
+    for (i = 0; i < idx->hunk_count; i++) {
+        const unsigned char* e = p + CACHE_HEADER_SIZE + i * CACHE_EXTENT_SIZE;
+        struct patch_hunk* hunk = &idx->hunks[i];
+        uint64_t offset = decode_big_endian_n(e, 8);
+        uint64_t length = decode_big_endian_n(e + 8, 8);
+        uint64_t fill = decode_big_endian_n(e + 16, 4);
+        uint64_t payload = decode_big_endian_n(e + 20, 8);
+
+        if (offset < end || length == 0 || length > idx->max_end
+            || offset > idx->max_end - length
+            || (fill == CACHE_NONE
+                ? payload > blob_size || length > blob_size - payload
+                : fill > 0xFF))
+        {
+            goto STALE_INDEX;
+        }
+        end = (size_t)(offset + length);
+
+        hunk->header.type = fill == CACHE_NONE ? HUNK_REGULAR : HUNK_RLE;
+        hunk->header.offset = (int)offset;
+        hunk->header.length = (int)length;
+        hunk->header.fill = (unsigned char)(fill == CACHE_NONE ? 0 : fill);
+        hunk->record_offset = 0;
+        hunk->payload_offset = blob + (size_t)payload;
+    }
+    return CACHE_HIT;
+
+STALE_INDEX:
+    patch_index_free(idx);
+STALE:
+    unmap_file(m);
+    return CACHE_STALE;
+}
+
+/**
+ * Copies the extents of ov to table, merging those that touch and are both
+ * literal bytes or both the same fill, since an entry's literal bytes all
+ * sit back to back in its blob. *blob_size receives their total.
+ * @return the number of extents in table
+ */
+static size_t cache_coalesce(
+    const struct overlay* ov,
+    struct extent* table,
+    size_t* blob_size)
+{
+    size_t n = 0;
+    size_t i;
+
+    *blob_size = 0;
+    for (i = 0; i < ov->count; i++) {
+        const struct extent* ext = &ov->extents[i];
+        struct extent* prev = n ? &table[n - 1] : NULL;
+        if (ext->fill < 0) {
+            *blob_size += ext->length;
+        }
+        if (prev && prev->offset + prev->length == ext->offset
+            && prev->fill == ext->fill)
+        {
+            prev->length += ext->length;
+        } else {
+            table[n++] = *ext;
+        }
+    }
+    return n;
+}
+
+int patch_cache_store(
+    const char* path,
+    const unsigned char* data,
+    size_t size,
+    uint32_t crc,
+    int read_trunc,
+    const struct patch_index* idx)
+{
+    unsigned char header[CACHE_HEADER_SIZE];
+    struct overlay ov;
+    struct extent* table = NULL;
+    char* temp = xmalloc(strlen(path) + 32);
+    FILE* f = NULL;
+    uint32_t entry_crc = CRC32_BASE;
+    size_t blob_size = 0;
+    size_t payload = 0;
+    size_t count = 0;
+    size_t i;
+
+    overlay_build_patch(&ov, idx);
+    table = xmalloc((ov.count ? ov.count : 1) * sizeof(*table));
+    count = cache_coalesce(&ov, table, &blob_size);
+
+    /* written beside the entry, then renamed over it */
+    sprintf(temp, "%s.%lu.tmp", path, process_id());
+    if (!(f = fopen(temp, "wb"))) {
+        goto ERROR;
+    }
+
+    memcpy(header, CACHE_MAGIC, CACHE_MAGIC_WIDTH);
+    encode_big_endian_n(header + 8, crc, 4);
+    encode_big_endian_n(header + 12, size, 8);
+    encode_big_endian_n(header + 20, (read_trunc ? CACHE_FLAG_READ_TRUNC : 0)
+        | (idx->trailing_data ? CACHE_FLAG_TRAILING_DATA : 0), 4);
+    encode_big_endian_n(header + 24, idx->trunc_length < 0
+        ? CACHE_NONE : (uint64_t)idx->trunc_length, 4);
+    encode_big_endian_n(header + 28, idx->max_end, 8);
+    encode_big_endian_n(header + 36, count, 8);
+    encode_big_endian_n(header + 44, blob_size, 8);
+    if (crc32_fwrite(f, &entry_crc, header, CACHE_HEADER_SIZE)) {
+        goto ERROR;
+    }
+
+    for (i = 0; i < count; i++) {
+        const struct extent* ext = &table[i];
+        unsigned char e[CACHE_EXTENT_SIZE];
+        encode_big_endian_n(e, ext->offset, 8);
+        encode_big_endian_n(e + 8, ext->length, 8);
+        encode_big_endian_n(e + 16, ext->fill < 0
+            ? CACHE_NONE : (uint64_t)ext->fill, 4);
+        encode_big_endian_n(e + 20, ext->fill < 0 ? payload : 0, 8);
+        if (crc32_fwrite(f, &entry_crc, e, CACHE_EXTENT_SIZE)) {
+            goto ERROR;
+        }
+        if (ext->fill < 0) {
+            payload += ext->length;
+        }
+    }
+
+    /* a coalesced extent's literal bytes may come from several hunks */
+    for (i = 0; i < ov.count; i++) {
+        const struct extent* ext = &ov.extents[i];
+        if (ext->fill < 0
+            && crc32_fwrite(f, &entry_crc, ext->data, ext->length))
+        {
+            goto ERROR;
+        }
+    }
+    if (crc32_fwrite(f, &entry_crc, data, size)) {
+        goto ERROR;
+    }
+
+    encode_big_endian_n(header, crc32_finalize(entry_crc), CACHE_CRC_WIDTH);
+    if (fwrite(header, 1, CACHE_CRC_WIDTH, f) < CACHE_CRC_WIDTH) {
+        goto ERROR;
+    }
+    if (fclose(f)) {
+        f = NULL;
+        goto ERROR;
+    }
+    f = NULL;
+    if (replace_file(temp, path)) {
+        goto ERROR;
+    }
+
+    overlay_free(&ov);
+    free(table);
+    free(temp);
+    return 0;
+
+ERROR:
+    if (f) {
+        fclose(f);
+    }
+    remove(temp);
+    overlay_free(&ov);
+    free(table);
+    free(temp);
+    return -1;
+}
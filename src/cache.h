@@ -0,0 +1,66 @@
+#ifndef CACHE_H_INCLUDED
+#define CACHE_H_INCLUDED
+
+#include "patch.h"
+#include "util.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*******************************************************************************
+Compiled patch cache
+A directory (--cache-dir) of patches compiled into a form that can be used
+straight from a mapping: the patch's overlay as a table of sorted, coalesced
+extents, followed by their literal bytes in one contiguous blob. Entries are
+keyed by the CRC32 and size of the patch they were compiled from, and keep a
+copy of the patch itself, so a patch that is applied again is only hashed and
+compared, never decoded, and one that merely shares a key with an entry is
+never mistaken for the patch it was made from.
+*******************************************************************************/
+
+#define CACHE_HIT 0
+#define CACHE_MISS 1     /* there is no entry for the patch */
+#define CACHE_STALE 2    /* the entry is damaged or doesn't match the patch */
+
+/**
+ * Returns the path of the cache entry in dir for a size-byte patch with the
+ * given CRC32, decoded with or without its truncation length (read_trunc).
+ * The caller must free() it.
+ */
+char* patch_cache_path(
+    const char* dir,
+    uint32_t crc,
+    size_t size,
+    int read_trunc);
+
+/**
+ * Loads the cache entry at path, made for the size-byte patch at data with
+ * the given CRC32 and read_trunc. On a hit, m receives a mapping of the entry
+ * and idx an index of it whose hunks are its extents, in offset order, with
+ * their payloads in m; the caller must release both.
+ * @return CACHE_HIT, CACHE_MISS or CACHE_STALE
+ */
+int patch_cache_load(
+    const char* path,
+    const unsigned char* data,
+    size_t size,
+    uint32_t crc,
+    int read_trunc,
+    struct file_map* m,
+    struct patch_index* idx);
+
+/**
+ * Compiles the size-byte patch at data, which has the given CRC32 and is
+ * indexed by idx (decoded with read_trunc), and stores it at path, in a
+ * directory that must exist. Any entry already there is replaced in one step,
+ * so concurrent readers never see half an entry.
+ * @return 0 on success or nonzero on error
+ */
+int patch_cache_store(
+    const char* path,
+    const unsigned char* data,
+    size_t size,
+    uint32_t crc,
+    int read_trunc,
+    const struct patch_index* idx);
+
+#endif
@@ -0,0 +1,355 @@
+#include "diff.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*******************************************************************************
+Compare kernels
+Each kernel finds the first differing byte of two buffers. The vector kernels
+compare 32 (SSE2) or 64 (AVX2) bytes per step and only look for the exact byte
+once a block turns out to differ, so long equal stretches go by at memory
+speed.
+*******************************************************************************/
+#if defined(__GNUC__) && defined(__x86_64__)
+    #define DIFF_HAVE_X86
+    #include <cpuid.h>
+    #include <immintrin.h>
+#endif
+
+typedef size_t (*diff_kernel_fn)(
+    const unsigned char*,
+    const unsigned char*,
+    size_t);
+
+struct diff_kernel {
+    const char* name;
+    diff_kernel_fn fn;
+    int (*supported)(void);
+};
+
+static const struct diff_kernel* diff_active = NULL;
+
+static int diff_always_supported(void) {
+    return 1;
+}
+
+static size_t diff_kernel_scalar(
+    const unsigned char* a,
+    const unsigned char* b,
+    size_t len)
+{
+    size_t i = 0;
+
+    /* a word at a time, then byte by byte within the first differing word */
+    while (len - i >= sizeof(size_t)) {
+        size_t wa;
+        size_t wb;
+        memcpy(&wa, a + i, sizeof(wa));
+        memcpy(&wb, b + i, sizeof(wb));
+        if (wa != wb) {
+            break;
+        }
+        i += sizeof(size_t);
+    }
+    while (i < len && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+#if defined(DIFF_HAVE_X86)
+static int diff_sse2_supported(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return (edx & bit_SSE2) != 0;
+}
+
+__attribute__((target("sse2")))
+static size_t diff_kernel_sse2(
+    const unsigned char* a,
+    const unsigned char* b,
+    size_t len)
+{
+    size_t i = 0;
+
+    while (len - i >= 32) {
+        __m128i eq0 = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i*)(a + i)),
+            _mm_loadu_si128((const __m128i*)(b + i)));
+        __m128i eq1 = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i*)(a + i + 16)),
+            _mm_loadu_si128((const __m128i*)(b + i + 16)));
+        if (_mm_movemask_epi8(_mm_and_si128(eq0, eq1)) != 0xFFFF) {
+            unsigned int ne = ~((unsigned int)_mm_movemask_epi8(eq0)
+                | ((unsigned int)_mm_movemask_epi8(eq1) << 16));
+            return i + (size_t)__builtin_ctz(ne);
+        }
+        i += 32;
+    }
+    return i + diff_kernel_scalar(a + i, b + i, len - i);
+}
+
+static int diff_avx2_supported(void) {
+    unsigned int eax, ebx, ecx, edx;
+    unsigned int xcr0_lo, xcr0_hi;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)
+        || !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+    {
+        return 0;
+    }
+    /* the OS has to save the YMM registers as well as the XMM ones */
+    __asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    (void)xcr0_hi;
+    if ((xcr0_lo & 6) != 6 || __get_cpuid_max(0, NULL) < 7) {
+        return 0;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & bit_AVX2) != 0;
+}
+
+__attribute__((target("avx2")))
+static size_t diff_kernel_avx2(
+    const unsigned char* a,
+    const unsigned char* b,
+    size_t len)
+{
+    size_t i = 0;
+
+    while (len - i >= 64) {
+        __m256i eq0 = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i*)(a + i)),
+            _mm256_loadu_si256((const __m256i*)(b + i)));
+        __m256i eq1 = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i*)(a + i + 32)),
+            _mm256_loadu_si256((const __m256i*)(b + i + 32)));
+        if (_mm256_movemask_epi8(_mm256_and_si256(eq0, eq1)) != -1) {
+            unsigned int ne0 = ~(unsigned int)_mm256_movemask_epi8(eq0);
+            if (ne0) {
+                return i + (size_t)__builtin_ctz(ne0);
+            }
+            return i + 32 + (size_t)__builtin_ctz(
+                ~(unsigned int)_mm256_movemask_epi8(eq1));
+        }
+        i += 64;
+    }
+    return i + diff_kernel_sse2(a + i, b + i, len - i);
+}
+#endif
+
+/* in order of preference */
+static const struct diff_kernel diff_kernels[] = {
+#if defined(DIFF_HAVE_X86)
+    { "avx2", diff_kernel_avx2, diff_avx2_supported },
+    { "sse2", diff_kernel_sse2, diff_sse2_supported },
+#endif
+    { "scalar", diff_kernel_scalar, diff_always_supported }
+};
+
+#define DIFF_KERNEL_COUNT (sizeof(diff_kernels) / sizeof(diff_kernels[0]))
+
+void diff_init(void) {
+    size_t k;
+    for (k = 0; k < DIFF_KERNEL_COUNT; k++) {
+        if (diff_kernels[k].supported()) {
+            diff_active = &diff_kernels[k];
+            break;
+        }
+    }
+}
+
+int diff_select_kernel(const char* name) {
+    size_t k;
+    for (k = 0; k < DIFF_KERNEL_COUNT; k++) {
+        if (STREQ(diff_kernels[k].name, name)) {
+            if (!diff_kernels[k].supported()) {
+                return -1;
+            }
+            diff_active = &diff_kernels[k];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char* diff_kernel_name(void) {
+    return diff_active->name;
+}
+
+size_t diff_mismatch(const unsigned char* a, const unsigned char* b, size_t len) {
+    return diff_active->fn(a, b, len);
+}
+
+/*******************************************************************************
+Diffs
+*******************************************************************************/
+
+/* what modified is compared against past the end of original */
+static const unsigned char diff_zeros[4096] = { 0 };
+
+/* appends a changed run, growing the previous one instead if it continues it */
+static void diff_push(
+    struct overlay* ov,
+    size_t* capacity,
+    size_t offset,
+    size_t length,
+    const unsigned char* data)
+{
+    struct extent* prev = ov->count ? &ov->extents[ov->count - 1] : NULL;
+    struct extent* ext = NULL;
+
+    if (prev && prev->offset + prev->length == offset
+        && prev->data + prev->length == data)
+    {
+        prev->length += length;
+        return;
+    }
+    if (ov->count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        ov->extents = xrealloc(ov->extents, *capacity * sizeof(*ov->extents));
+    }
+    ext = &ov->extents[ov->count++];
+    ext->offset = offset;
+    ext->length = length;
+    ext->fill = -1;
+    ext->data = data;
+}
+
+/* appends the runs where the len bytes at b (at offset) differ from a */
+static void diff_range(
+    struct overlay* ov,
+    size_t* capacity,
+    const unsigned char* a,
+    const unsigned char* b,
+    size_t offset,
+    size_t len)
+{
+    size_t i = 0;
+    while (i < len) {
+        size_t start = 0;
+        i += diff_mismatch(a + i, b + i, len - i);
+        if (i == len) {
+            break;
+        }
+        start = i;
+        while (i < len && a[i] != b[i]) {
+            i++;
+        }
+        diff_push(ov, capacity, offset + start, i - start, b + start);
+    }
+}
+
+/* appends the runs where [start, end) of modified differs from original,
+   zero-extended */
+static void diff_span(
+    struct overlay* ov,
+    size_t* capacity,
+    const unsigned char* original,
+    size_t original_size,
+    const unsigned char* modified,
+    size_t start,
+    size_t end)
+{
+    if (start < original_size) {
+        size_t stop = end < original_size ? end : original_size;
+        diff_range(ov, capacity, original + start, modified + start, start,
+            stop - start);
+        start = stop;
+    }
+    while (start < end) {
+        size_t n = end - start;
+        if (n > sizeof(diff_zeros)) {
+            n = sizeof(diff_zeros);
+        }
+        diff_range(ov, capacity, diff_zeros, modified + start, start, n);
+        start += n;
+    }
+}
+
+/* a chunk of a diff, compared on its own thread */
+struct diff_job {
+    const unsigned char* original;
+    size_t original_size;
+    const unsigned char* modified;
+    size_t start;
+    size_t end;
+    struct overlay ov;
+};
+
+static void* diff_job_run(void* arg) {
+    struct diff_job* job = arg;
+    size_t capacity = 0;
+    job->ov.extents = NULL;
+    job->ov.count = 0;
+    diff_span(&job->ov, &capacity, job->original, job->original_size,
+        job->modified, job->start, job->end);
+    return NULL;
+}
+
+/* chunk boundaries fall on multiples of this */
+#define DIFF_CHUNK_ALIGN ((size_t)1 << 12)
+
+void diff_build(
+    struct overlay* ov,
+    const unsigned char* original,
+    size_t original_size,
+    const unsigned char* modified,
+    size_t modified_size,
+    int jobs)
+{
+    const size_t min_chunk = (size_t)1 << 20;
+    struct diff_job* job = NULL;
+    size_t capacity = 0;
+    size_t chunk = 0;
+    int i;
+
+    ov->extents = NULL;
+    ov->count = 0;
+
+#if !defined(__linux__)
+    jobs = 1;
+#endif
+    if (jobs < 1) {
+        jobs = 1;
+    }
+    /* don't bother splitting small inputs */
+    if (modified_size / min_chunk < (size_t)jobs) {
+        jobs = (int)(modified_size / min_chunk) + 1;
+    }
+    chunk = (modified_size / jobs + DIFF_CHUNK_ALIGN - 1)
+        & ~(DIFF_CHUNK_ALIGN - 1);
+
+    job = xmalloc(jobs * sizeof(*job));
+    for (i = 0; i < jobs; i++) {
+        job[i].original = original;
+        job[i].original_size = original_size;
+        job[i].modified = modified;
+        job[i].start = chunk * i < modified_size ? chunk * i : modified_size;
+        job[i].end = i == jobs - 1 || chunk * (i + 1) > modified_size
+            ? modified_size : chunk * (i + 1);
+    }
+
+    run_parallel(job, (size_t)jobs, sizeof(*job), diff_job_run);
+
+    /* stitch the chunks back together in offset order; a run that crosses a
+       chunk boundary continues its first half, so it is joined back up */
+    for (i = 0; i < jobs; i++) {
+        size_t j;
+        for (j = 0; j < job[i].ov.count; j++) {
+            const struct extent* ext = &job[i].ov.extents[j];
+            diff_push(ov, &capacity, ext->offset, ext->length, ext->data);
+        }
+        overlay_free(&job[i].ov);
+    }
+    free(job);
+
+    if (modified_size > original_size && (!ov->count
+        || ov->extents[ov->count - 1].offset + ov->extents[ov->count - 1].length
+            < modified_size))
+    {
+        diff_push(ov, &capacity, modified_size - 1, 1,
+            modified + modified_size - 1);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef DIFF_H_INCLUDED
+#define DIFF_H_INCLUDED
+
+#include "overlay.h"
+#include <stddef.h>
+
+/**
+ * diff_init() selects the fastest compare kernel this CPU supports. These
+ * report the selected kernel's name and select one explicitly (after
+ * diff_init()) by name: "avx2", "sse2" or "scalar". diff_select_kernel()
+ * returns 0 on success or nonzero if the kernel is unknown or unsupported
+ * here.
+ */
+void diff_init(void);
+const char* diff_kernel_name(void);
+int diff_select_kernel(const char* name);
+
+/**
+ * Returns the offset of the first byte that differs between the len bytes at
+ * a and b, or len if they are equal.
+ */
+size_t diff_mismatch(const unsigned char* a, const unsigned char* b, size_t len);
+
+/**
+ * Builds the overlay that turns original into modified: a literal extent
+ * (pointing into modified) for every run of bytes that differ. Past the end
+ * of original, modified is compared against zeros, as a patch would see it.
+ * The last byte of a modified that is longer than original is always
+ * included, since it sets the size of the output. modified must outlive the
+ * overlay.
+ *
+ * Large inputs are split into up to jobs aligned chunks that are compared on
+ * separate threads. The result is the same for any number of jobs.
+ */
+void diff_build(
+    struct overlay* ov,
+    const unsigned char* original,
+    size_t original_size,
+    const unsigned char* modified,
+    size_t modified_size,
+    int jobs);
+
+#endif
@@ -0,0 +1,465 @@
+#include "digest.h"
+#include "util.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char* DIGEST_NAME[] = { "crc32", "md5", "sha1", "sha256" };
+const char* DIGEST_TAG[] = { "CRC32", "MD5", "SHA1", "SHA256" };
+const size_t DIGEST_SIZE[] = { 4, 16, 20, 32 };
+
+/* how much of a file every digest is fed before moving on to the next */
+#define DIGEST_BUFLEN ((size_t)1 << 18)
+
+#define ROTL32(X, N) (((X) << (N)) | ((X) >> (32 - (N))))
+#define ROTR32(X, N) (((X) >> (N)) | ((X) << (32 - (N))))
+
+static uint32_t load_le32(const unsigned char* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16
+        | (uint32_t)p[3] << 24;
+}
+
+static uint32_t load_be32(const unsigned char* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8
+        | (uint32_t)p[3];
+}
+
+static void store_le32(unsigned char* p, uint32_t x) {
+    p[0] = (unsigned char)x;
+    p[1] = (unsigned char)(x >> 8);
+    p[2] = (unsigned char)(x >> 16);
+    p[3] = (unsigned char)(x >> 24);
+}
+
+/*******************************************************************************
+MD5 (RFC 1321)
+*******************************************************************************/
+static const uint32_t MD5_K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+/* left rotations, by round and step within the round */
+static const int MD5_S[4][4] = {
+    { 7, 12, 17, 22 }, { 5, 9, 14, 20 }, { 4, 11, 16, 23 }, { 6, 10, 15, 21 }
+};
+
+/* one step: a = b + ((a + F + K[i] + m[G]) <<< S) */
+#define MD5_STEP(F, G, S) \
+    do { \
+        uint32_t t = d; \
+        a += (F) + MD5_K[i] + m[(G)]; \
+        d = c; \
+        c = b; \
+        b += ROTL32(a, (S)); \
+        a = t; \
+    } while (0)
+
+static void md5_block(uint32_t* h, const unsigned char* p) {
+    uint32_t m[16];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        m[i] = load_le32(p + 4 * i);
+    }
+    for (i = 0; i < 16; i++) {
+        MD5_STEP((b & c) | (~b & d), i, MD5_S[0][i % 4]);
+    }
+    for (; i < 32; i++) {
+        MD5_STEP((d & b) | (~d & c), (5 * i + 1) % 16, MD5_S[1][i % 4]);
+    }
+    for (; i < 48; i++) {
+        MD5_STEP(b ^ c ^ d, (3 * i + 5) % 16, MD5_S[2][i % 4]);
+    }
+    for (; i < 64; i++) {
+        MD5_STEP(c ^ (b | ~d), (7 * i) % 16, MD5_S[3][i % 4]);
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+}
+
+/*******************************************************************************
+SHA-1 and SHA-256 (FIPS 180-4)
+*******************************************************************************/
+/*
+ * One step, with the roles of the variables rotated instead of their values:
+ * e += (a <<< 5) + F(b, c, d) + K + w[I], then b <<<= 30. Five steps in a row
+ * leave every variable back in its own role.
+ */
+#define SHA1_STEP(A, B, C, D, E, F, K, I) \
+    do { \
+        E += ROTL32(A, 5) + F(B, C, D) + (K) + SHA1_W(I); \
+        B = ROTL32(B, 30); \
+    } while (0)
+
+/* the message schedule, kept as a window of its last 16 words */
+#define SHA1_W(I) ((I) < 16 ? w[(I)] : (w[(I) & 15] = sha1_next(w, (I))))
+
+#define SHA1_CH(B, C, D) (((B) & (C)) | (~(B) & (D)))
+#define SHA1_PARITY(B, C, D) ((B) ^ (C) ^ (D))
+#define SHA1_MAJ(B, C, D) (((B) & (C)) | ((D) & ((B) | (C))))
+
+#define SHA1_STEPS5(F, K, I) \
+    do { \
+        SHA1_STEP(a, b, c, d, e, F, K, (I)); \
+        SHA1_STEP(e, a, b, c, d, F, K, (I) + 1); \
+        SHA1_STEP(d, e, a, b, c, F, K, (I) + 2); \
+        SHA1_STEP(c, d, e, a, b, F, K, (I) + 3); \
+        SHA1_STEP(b, c, d, e, a, F, K, (I) + 4); \
+    } while (0)
+
+static uint32_t sha1_next(const uint32_t* w, int i) {
+    uint32_t x = w[(i - 3) & 15] ^ w[(i - 8) & 15] ^ w[(i - 14) & 15]
+        ^ w[i & 15];
+    return ROTL32(x, 1);
+}
+
+static void sha1_block(uint32_t* h, const unsigned char* p) {
+    uint32_t w[16];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = load_be32(p + 4 * i);
+    }
+    for (i = 0; i < 20; i += 5) {
+        SHA1_STEPS5(SHA1_CH, 0x5a827999, i);
+    }
+    for (; i < 40; i += 5) {
+        SHA1_STEPS5(SHA1_PARITY, 0x6ed9eba1, i);
+    }
+    for (; i < 60; i += 5) {
+        SHA1_STEPS5(SHA1_MAJ, 0x8f1bbcdc, i);
+    }
+    for (; i < 80; i += 5) {
+        SHA1_STEPS5(SHA1_PARITY, 0xca62c1d6, i);
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void sha256_block(uint32_t* h, const unsigned char* p) {
+    uint32_t w[64];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    uint32_t e = h[4], f = h[5], g = h[6], k = h[7];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = load_be32(p + 4 * i);
+    }
+    for (; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18)
+            ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19)
+            ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    /* k stands in for the standard's h, which names the state here */
+    for (i = 0; i < 64; i++) {
+        uint32_t t1 = k + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25))
+            + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22))
+            + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+/*******************************************************************************
+Digests
+*******************************************************************************/
+int digest_parse_list(const char* list, int* algos) {
+    int count = 0;
+
+    for (;;) {
+        size_t len = strcspn(list, ",");
+        int algo;
+        int i;
+
+        for (algo = 0; algo < DIGEST_COUNT; algo++) {
+            if (strlen(DIGEST_NAME[algo]) == len
+                && MEMEQ(DIGEST_NAME[algo], list, len))
+            {
+                break;
+            }
+        }
+        if (algo == DIGEST_COUNT) {
+            return -1;
+        }
+        for (i = 0; i < count && algos[i] != algo; i++) {
+        }
+        if (i == count) {
+            algos[count++] = algo;
+        }
+
+        if (!list[len]) {
+            return count;
+        }
+        list += len + 1;
+    }
+}
+
+void digest_init(struct digest* d, int algo) {
+    static const uint32_t MD5_H[4] = {
+        0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476
+    };
+    static const uint32_t SHA1_H[5] = {
+        0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+    };
+    static const uint32_t SHA256_H[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    d->algo = algo;
+    d->length = 0;
+    d->used = 0;
+    switch (algo) {
+    case DIGEST_CRC32:
+        d->state[0] = CRC32_BASE;
+        break;
+    case DIGEST_MD5:
+        memcpy(d->state, MD5_H, sizeof(MD5_H));
+        break;
+    case DIGEST_SHA1:
+        memcpy(d->state, SHA1_H, sizeof(SHA1_H));
+        break;
+    default:
+        memcpy(d->state, SHA256_H, sizeof(SHA256_H));
+        break;
+    }
+}
+
+static void digest_block(struct digest* d, const unsigned char* p) {
+    switch (d->algo) {
+    case DIGEST_MD5:
+        md5_block(d->state, p);
+        break;
+    case DIGEST_SHA1:
+        sha1_block(d->state, p);
+        break;
+    default:
+        sha256_block(d->state, p);
+        break;
+    }
+}
+
+void digest_update(struct digest* d, const unsigned char* data, size_t len) {
+    d->length += len;
+    if (d->algo == DIGEST_CRC32) {
+        d->state[0] = crc32_update(d->state[0], (void*)data, len);
+        return;
+    }
+
+    if (d->used) {
+        size_t take = 64 - d->used < len ? 64 - d->used : len;
+        memcpy(d->block + d->used, data, take);
+        d->used += take;
+        data += take;
+        len -= take;
+        if (d->used < 64) {
+            return;
+        }
+        digest_block(d, d->block);
+        d->used = 0;
+    }
+    for (; len >= 64; data += 64, len -= 64) {
+        digest_block(d, data);
+    }
+    memcpy(d->block, data, len);
+    d->used = len;
+}
+
+size_t digest_final(struct digest* d, unsigned char* out) {
+    uint64_t bits = d->length * 8;
+    size_t i;
+
+    if (d->algo == DIGEST_CRC32) {
+        encode_big_endian_n(out, crc32_finalize(d->state[0]), 4);
+        return DIGEST_SIZE[DIGEST_CRC32];
+    }
+
+    /* a 1 bit, zeros up to 8 bytes short of a block, then the bit length */
+    d->block[d->used++] = 0x80;
+    if (d->used > 56) {
+        memset(d->block + d->used, 0, 64 - d->used);
+        digest_block(d, d->block);
+        d->used = 0;
+    }
+    memset(d->block + d->used, 0, 56 - d->used);
+    if (d->algo == DIGEST_MD5) {
+        store_le32(d->block + 56, (uint32_t)bits);
+        store_le32(d->block + 60, (uint32_t)(bits >> 32));
+    } else {
+        encode_big_endian_n(d->block + 56, bits, 8);
+    }
+    digest_block(d, d->block);
+
+    for (i = 0; i < DIGEST_SIZE[d->algo] / 4; i++) {
+        if (d->algo == DIGEST_MD5) {
+            store_le32(out + 4 * i, d->state[i]);
+        } else {
+            encode_big_endian_n(out + 4 * i, d->state[i], 4);
+        }
+    }
+    return DIGEST_SIZE[d->algo];
+}
+
+/* every stride-th digest of a mapped file, starting with the first */
+struct digest_job {
+    struct digest* digests;
+    size_t count;
+    size_t stride;
+    const unsigned char* data;
+    size_t size;
+};
+
+static void* digest_job_run(void* arg) {
+    const struct digest_job* job = arg;
+    size_t offset;
+    size_t i;
+
+    /* each digest takes a piece in turn while it is still in the cache */
+    for (offset = 0; offset < job->size; offset += DIGEST_BUFLEN) {
+        size_t len = job->size - offset < DIGEST_BUFLEN
+            ? job->size - offset : DIGEST_BUFLEN;
+        for (i = 0; i < job->count; i += job->stride) {
+            digest_update(&job->digests[i], job->data + offset, len);
+        }
+    }
+    return NULL;
+}
+
+static void digest_mapped(
+    struct digest* digests,
+    size_t count,
+    int jobs,
+    const unsigned char* data,
+    size_t size)
+{
+    struct digest_job job[DIGEST_COUNT];
+    size_t threads = jobs <= 1 ? 1
+        : (size_t)jobs < count ? (size_t)jobs : count;
+    size_t i;
+
+    for (i = 0; i < threads; i++) {
+        job[i].digests = digests + i;
+        job[i].count = count - i;
+        job[i].stride = threads;
+        job[i].data = data;
+        job[i].size = size;
+    }
+
+    run_parallel(job, threads, sizeof(*job), digest_job_run);
+}
+
+int digest_file(
+    const char* path,
+    const int* algos,
+    size_t count,
+    int jobs,
+    unsigned char (*out)[DIGEST_SIZE_MAX])
+{
+    struct digest digests[DIGEST_COUNT];
+    struct file_map m;
+    unsigned char* buf = NULL;
+    FILE* f = NULL;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        digest_init(&digests[i], algos[i]);
+    }
+
+    if (!STREQ(path, "-") && !map_file_read(path, &m)) {
+        digest_mapped(digests, count, jobs, m.data, m.size);
+        unmap_file(&m);
+    } else {
+        /* pipes and the like are read once, a block at a time */
+        if (!(f = STREQ(path, "-") ? stdin : fopen(path, "rb"))) {
+            return -1;
+        }
+        buf = xmalloc(DIGEST_BUFLEN);
+        for (;;) {
+            size_t chars_read = fread(buf, 1, DIGEST_BUFLEN, f);
+            for (i = 0; i < count; i++) {
+                digest_update(&digests[i], buf, chars_read);
+            }
+            if (chars_read < DIGEST_BUFLEN) {
+                if (feof(f)) {
+                    break;
+                }
+                goto ERROR;
+            }
+        }
+        free(buf);
+        if (f != stdin) {
+            fclose(f);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        digest_final(&digests[i], out[i]);
+    }
+    return 0;
+
+ERROR:
+    free(buf);
+    if (f != stdin) {
+        fclose(f);
+    }
+    return -1;
+}
@@ -0,0 +1,76 @@
+#ifndef DIGEST_H_INCLUDED
+#define DIGEST_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*******************************************************************************
+File digests
+CRC32 (from the util engine), MD5 (RFC 1321), SHA-1 and SHA-256 (FIPS 180-4),
+for keying files the way ROM databases do. A file is read once and every block
+of it is fed to each selected digest, so asking for all four costs one read.
+*******************************************************************************/
+
+#define DIGEST_CRC32 0
+#define DIGEST_MD5 1
+#define DIGEST_SHA1 2
+#define DIGEST_SHA256 3
+#define DIGEST_COUNT 4
+
+/* the size of the largest digest (SHA-256) in bytes */
+#define DIGEST_SIZE_MAX 32
+
+/* lowercase names, as given to --algo */
+extern const char* DIGEST_NAME[];
+
+/* names as printed by `sha256sum --tag` and friends */
+extern const char* DIGEST_TAG[];
+
+extern const size_t DIGEST_SIZE[];
+
+struct digest {
+    int algo;                   /* DIGEST_* value */
+    uint32_t state[8];          /* chaining values (state[0] is the CRC32) */
+    uint64_t length;            /* bytes hashed so far */
+    unsigned char block[64];    /* a partial block waiting for more bytes */
+    size_t used;                /* bytes in block */
+};
+
+/**
+ * Parses a comma-separated list of digest names into algos, in the order
+ * given, dropping repeats.
+ * @return the number of digests, or -1 if a name is unknown
+ */
+int digest_parse_list(const char* list, int* algos);
+
+/**
+ * Starts a digest of kind algo. crc32_init() must have been called for
+ * DIGEST_CRC32.
+ */
+void digest_init(struct digest* d, int algo);
+
+void digest_update(struct digest* d, const unsigned char* data, size_t len);
+
+/**
+ * Finishes d and stores its value at out, in the usual byte order.
+ * @return the size of the value (DIGEST_SIZE[d->algo])
+ */
+size_t digest_final(struct digest* d, unsigned char* out);
+
+/**
+ * Computes count digests of the file at path (or of stdin for "-"), one of
+ * each kind in algos, storing their values in out. A regular file is mapped
+ * and, if jobs is more than 1, its digests are computed on separate threads;
+ * anything else is read once in large blocks that every digest is fed in
+ * turn. crc32_init() must have been called for DIGEST_CRC32.
+ * @return 0 on success or nonzero if the file couldn't be read
+ */
+int digest_file(
+    const char* path,
+    const int* algos,
+    size_t count,
+    int jobs,
+    unsigned char (*out)[DIGEST_SIZE_MAX]);
+
+#endif
@@ -0,0 +1,384 @@
+#include "encode.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* the last offset a hunk can start at */
+#define HUNK_OFFSET_MAX ((size_t)0xFFFFFF)
+
+/* the offset whose encoding reads as the EOF marker */
+#define HUNK_OFFSET_EOF ((size_t)0x454F46)
+
+#define REGULAR_HEADER_WIDTH (HUNK_OFFSET_WIDTH + HUNK_LENGTH_WIDTH)
+#define RLE_RECORD_WIDTH (REGULAR_HEADER_WIDTH + HUNK_LENGTH_WIDTH + 1)
+
+/* shorter runs of one byte never pay for an RLE record */
+#define RLE_RUN_MIN 4
+
+#define COST_NONE ((size_t)-1)
+
+const char* ENCODE_CODE_STR[] = {
+    "ok",
+    "patch writes at an offset IPS can't express",
+    "truncation length too large for IPS",
+    /* add new strings between these */
+    "ENCODE_CODE_STR bounds error"
+};
+
+/* a growing array of pieces: extents cut up at runs of one byte */
+struct piece_list {
+    struct extent* pieces;
+    size_t count;
+    size_t capacity;
+};
+
+static int hunk_offset_ok(size_t offset) {
+    return offset <= HUNK_OFFSET_MAX && offset != HUNK_OFFSET_EOF;
+}
+
+static unsigned char* writer_reserve(struct patch_writer* w, size_t n) {
+    if (w->size + n > w->capacity) {
+        while (w->size + n > w->capacity) {
+            w->capacity = w->capacity ? w->capacity * 2 : 4096;
+        }
+        w->data = xrealloc(w->data, w->capacity);
+    }
+    w->size += n;
+    return w->data + w->size - n;
+}
+
+/**
+ * Returns how much of the remaining bytes at offset go into the next hunk: as
+ * many as fit, but never so many that the following hunk would have to start
+ * somewhere IPS can't express.
+ */
+static size_t hunk_chunk_length(size_t offset, size_t remaining) {
+    size_t n = remaining < HUNK_LENGTH_MAX ? remaining : HUNK_LENGTH_MAX;
+    if (n < remaining) {
+        if (offset + n > HUNK_OFFSET_MAX) {
+            /* end with a full-length hunk, which starts early enough */
+            n = remaining - HUNK_LENGTH_MAX;
+        } else if (offset + n == HUNK_OFFSET_EOF) {
+            n--;
+        }
+    }
+    return n;
+}
+
+static void write_regular(
+    struct patch_writer* w,
+    size_t offset,
+    const unsigned char* data,
+    size_t len)
+{
+    while (len) {
+        size_t n = hunk_chunk_length(offset, len);
+        unsigned char* rec = writer_reserve(w, REGULAR_HEADER_WIDTH + n);
+        encode_big_endian_n(rec, offset, HUNK_OFFSET_WIDTH);
+        encode_big_endian_n(rec + HUNK_OFFSET_WIDTH, n, HUNK_LENGTH_WIDTH);
+        memcpy(rec + REGULAR_HEADER_WIDTH, data, n);
+        w->hunk_count++;
+        offset += n;
+        data += n;
+        len -= n;
+    }
+}
+
+static void write_rle(
+    struct patch_writer* w,
+    size_t offset,
+    unsigned char fill,
+    size_t len)
+{
+    while (len) {
+        size_t n = hunk_chunk_length(offset, len);
+        unsigned char* rec = writer_reserve(w, RLE_RECORD_WIDTH);
+        encode_big_endian_n(rec, offset, HUNK_OFFSET_WIDTH);
+        encode_big_endian_n(rec + HUNK_OFFSET_WIDTH, 0, HUNK_LENGTH_WIDTH);
+        encode_big_endian_n(rec + REGULAR_HEADER_WIDTH, n, HUNK_LENGTH_WIDTH);
+        rec[RLE_RECORD_WIDTH - 1] = fill;
+        w->hunk_count++;
+        offset += n;
+        len -= n;
+    }
+}
+
+/* appends a piece, growing the previous one instead when it continues it */
+static void piece_push(
+    struct piece_list* list,
+    size_t offset,
+    size_t length,
+    int fill,
+    const unsigned char* data)
+{
+    struct extent* prev = list->count ? &list->pieces[list->count - 1] : NULL;
+    struct extent* p = NULL;
+
+    if (prev && prev->offset + prev->length == offset && prev->fill == fill
+        && (fill >= 0 || prev->data + prev->length == data))
+    {
+        prev->length += length;
+        return;
+    }
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->pieces = xrealloc(list->pieces,
+            list->capacity * sizeof(*list->pieces));
+    }
+    p = &list->pieces[list->count++];
+    p->offset = offset;
+    p->length = length;
+    p->fill = fill;
+    p->data = data;
+}
+
+/* appends an extent as pieces, splitting runs of one byte out of literals */
+static void piece_push_extent(struct piece_list* list, const struct extent* ext) {
+    size_t start = 0;
+    size_t i = 0;
+
+    if (ext->fill >= 0) {
+        piece_push(list, ext->offset, ext->length, ext->fill, NULL);
+        return;
+    }
+
+    while (i < ext->length) {
+        size_t run = 1;
+        while (i + run < ext->length && ext->data[i + run] == ext->data[i]) {
+            run++;
+        }
+        if (run >= RLE_RUN_MIN) {
+            if (i > start) {
+                piece_push(list, ext->offset + start, i - start, -1,
+                    ext->data + start);
+            }
+            piece_push(list, ext->offset + i, run, ext->data[i], NULL);
+            start = i + run;
+        }
+        i += run;
+    }
+    if (i > start) {
+        piece_push(list, ext->offset + start, i - start, -1, ext->data + start);
+    }
+}
+
+/* appends the unchanged bytes [offset, end) of the base as pieces */
+static void piece_push_base(
+    struct piece_list* list,
+    const unsigned char* base,
+    size_t base_size,
+    size_t offset,
+    size_t end)
+{
+    if (offset < base_size) {
+        struct extent ext;
+        ext.offset = offset;
+        ext.length = (end < base_size ? end : base_size) - offset;
+        ext.fill = -1;
+        ext.data = base + offset;
+        piece_push_extent(list, &ext);
+        offset += ext.length;
+    }
+    if (offset < end) {
+        piece_push(list, offset, end - offset, 0, NULL);
+    }
+}
+
+/**
+ * Writes one run of touching pieces as the cheapest sequence of hunks. Each
+ * piece either joins a REGULAR hunk or, if it is a run of one byte, becomes an
+ * RLE hunk; a shortest-path pass over the pieces picks which.
+ * @return 0 on success or nonzero if no hunk sequence can express the run
+ */
+static int encode_run(
+    struct patch_writer* w,
+    const struct piece_list* list,
+    unsigned char** scratch,
+    size_t* scratch_size)
+{
+    const struct extent* pieces = list->pieces;
+    size_t n = list->count;
+    /* cheapest cost so far with piece i ending a REGULAR or an RLE hunk */
+    size_t* regular = xmalloc(2 * n * sizeof(*regular));
+    size_t* rle = regular + n;
+    /* whether that cheapest way has piece i - 1 in an RLE hunk */
+    unsigned char* regular_from_rle = xmalloc(2 * n);
+    unsigned char* rle_from_rle = regular_from_rle + n;
+    unsigned char* is_rle = NULL;
+    size_t i;
+    int ret = 0;
+
+    for (i = 0; i < n; i++) {
+        const struct extent* p = &pieces[i];
+        size_t prev_regular = i ? regular[i - 1] : COST_NONE;
+        size_t prev_rle = i ? rle[i - 1] : 0;
+        int starts_ok = hunk_offset_ok(p->offset);
+
+        /* continue the previous REGULAR hunk, or start a new one */
+        regular[i] = COST_NONE;
+        regular_from_rle[i] = 0;
+        if (prev_regular != COST_NONE) {
+            regular[i] = prev_regular + p->length;
+        }
+        if (starts_ok && prev_rle != COST_NONE
+            && prev_rle + REGULAR_HEADER_WIDTH + p->length < regular[i])
+        {
+            regular[i] = prev_rle + REGULAR_HEADER_WIDTH + p->length;
+            regular_from_rle[i] = 1;
+        }
+
+        /* an RLE hunk always starts fresh */
+        rle[i] = COST_NONE;
+        rle_from_rle[i] = 0;
+        if (p->fill >= 0 && starts_ok) {
+            size_t cost = RLE_RECORD_WIDTH
+                * ((p->length + HUNK_LENGTH_MAX - 1) / HUNK_LENGTH_MAX);
+            if (prev_regular != COST_NONE
+                && (prev_rle == COST_NONE || prev_regular < prev_rle))
+            {
+                rle[i] = prev_regular + cost;
+            } else if (prev_rle != COST_NONE) {
+                rle[i] = prev_rle + cost;
+                rle_from_rle[i] = 1;
+            }
+        }
+    }
+
+    if (regular[n - 1] == COST_NONE && rle[n - 1] == COST_NONE) {
+        ret = -1;
+        goto CLEANUP;
+    }
+
+    /* walk back along the cheapest path, then write it out forwards */
+    is_rle = xmalloc(n);
+    is_rle[n - 1] = rle[n - 1] < regular[n - 1];
+    for (i = n - 1; i > 0; i--) {
+        is_rle[i - 1] = is_rle[i] ? rle_from_rle[i] : regular_from_rle[i];
+    }
+
+    for (i = 0; i < n; ) {
+        size_t len = 0;
+        size_t j;
+
+        if (is_rle[i]) {
+            write_rle(w, pieces[i].offset, (unsigned char)pieces[i].fill,
+                pieces[i].length);
+            i++;
+            continue;
+        }
+
+        for (j = i; j < n && !is_rle[j]; j++) {
+            len += pieces[j].length;
+        }
+        if (len > *scratch_size) {
+            *scratch_size = len;
+            *scratch = xrealloc(*scratch, len);
+        }
+        len = 0;
+        for (j = i; j < n && !is_rle[j]; j++) {
+            if (pieces[j].fill < 0) {
+                memcpy(*scratch + len, pieces[j].data, pieces[j].length);
+            } else {
+                memset(*scratch + len, pieces[j].fill, pieces[j].length);
+            }
+            len += pieces[j].length;
+        }
+        write_regular(w, pieces[i].offset, *scratch, len);
+        i = j;
+    }
+
+CLEANUP:
+    free(is_rle);
+    free(regular_from_rle);
+    free(regular);
+    return ret;
+}
+
+int patch_encode(
+    struct patch_writer* w,
+    const struct overlay* ov,
+    const unsigned char* base,
+    size_t base_size,
+    long trunc_length)
+{
+    struct piece_list list;
+    unsigned char* scratch = NULL;
+    size_t scratch_size = 0;
+    size_t i = 0;
+    int code = ENCODE_CODE_OK;
+
+    w->data = NULL;
+    w->size = 0;
+    w->capacity = 0;
+    w->hunk_count = 0;
+    list.pieces = NULL;
+    list.count = 0;
+    list.capacity = 0;
+
+    if (trunc_length > (long)HUNK_OFFSET_MAX) {
+        return ENCODE_CODE_TRUNC;
+    }
+
+    memcpy(writer_reserve(w, MAGIC_PATCH_WIDTH), MAGIC_PATCH,
+        MAGIC_PATCH_WIDTH);
+
+    while (i < ov->count) {
+        const struct extent* ext = &ov->extents[i];
+        size_t end = ext->offset + ext->length;
+
+        list.count = 0;
+        if (ext->offset == HUNK_OFFSET_EOF && base) {
+            piece_push_base(&list, base, base_size, ext->offset - 1,
+                ext->offset);
+        } else if (!hunk_offset_ok(ext->offset)) {
+            code = ENCODE_CODE_OFFSET;
+            goto ERROR;
+        }
+        piece_push_extent(&list, ext);
+
+        /* gather the run, bridging short gaps with unchanged bytes */
+        for (i++; i < ov->count; i++) {
+            ext = &ov->extents[i];
+            if (ext->offset > end) {
+                if (!base || ext->offset - end > REGULAR_HEADER_WIDTH) {
+                    break;
+                }
+                piece_push_base(&list, base, base_size, end, ext->offset);
+            }
+            piece_push_extent(&list, ext);
+            end = ext->offset + ext->length;
+        }
+
+        if (end > HUNK_OFFSET_MAX + HUNK_LENGTH_MAX
+            || encode_run(w, &list, &scratch, &scratch_size))
+        {
+            code = ENCODE_CODE_OFFSET;
+            goto ERROR;
+        }
+    }
+
+    memcpy(writer_reserve(w, HUNK_OFFSET_WIDTH), EOF_MARKER,
+        HUNK_OFFSET_WIDTH);
+    if (trunc_length >= 0) {
+        encode_big_endian_n(writer_reserve(w, TRUNC_LENGTH_WIDTH),
+            (size_t)trunc_length, TRUNC_LENGTH_WIDTH);
+    }
+
+    free(scratch);
+    free(list.pieces);
+    return ENCODE_CODE_OK;
+
+ERROR:
+    free(scratch);
+    free(list.pieces);
+    patch_writer_free(w);
+    return code;
+}
+
+void patch_writer_free(struct patch_writer* w) {
+    free(w->data);
+    w->data = NULL;
+    w->size = 0;
+    w->capacity = 0;
+    w->hunk_count = 0;
+}
@@ -0,0 +1,48 @@
+#ifndef ENCODE_H_INCLUDED
+#define ENCODE_H_INCLUDED
+
+#include "overlay.h"
+#include <stddef.h>
+
+/**
+ * An IPS patch being written into a growing buffer.
+ */
+struct patch_writer {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+    size_t hunk_count;
+};
+
+#define ENCODE_CODE_OK 0
+#define ENCODE_CODE_OFFSET 1
+#define ENCODE_CODE_TRUNC 2
+
+extern const char* ENCODE_CODE_STR[];
+
+/**
+ * Encodes an overlay as an IPS patch into w, which this initializes. Each run
+ * of touching extents is cut into REGULAR and RLE hunks so that it takes the
+ * fewest bytes, with every hunk kept within HUNK_LENGTH_MAX and off offsets
+ * IPS can't express (past 24 bits, or 0x454F46, which reads as "EOF").
+ *
+ * If base is non-NULL, it holds the base_size bytes (zero-extended) the patch
+ * will be applied to. Runs separated by no more unchanged bytes than a hunk
+ * header are then joined by writing those bytes out again, and a run that
+ * would start at 0x454F46 is moved back a byte.
+ *
+ * trunc_length is the truncation length to write after the EOF marker, or -1
+ * for none.
+ * @return ENCODE_CODE_OK, or another ENCODE_CODE_* value if the overlay can't
+ *         be expressed in IPS (in which case w holds nothing to free)
+ */
+int patch_encode(
+    struct patch_writer* w,
+    const struct overlay* ov,
+    const unsigned char* base,
+    size_t base_size,
+    long trunc_length);
+
+void patch_writer_free(struct patch_writer* w);
+
+#endif
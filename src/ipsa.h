@@ -0,0 +1,89 @@
+#ifndef IPSA_H_INCLUDED
+#define IPSA_H_INCLUDED
+
+/*
+ * libipsa - in-memory IPS patching
+ *
+ * These functions work purely on buffers: they never open files, print
+ * anything or abort, and report problems through the IPSA_* codes below.
+ */
+
+#include <stddef.h>
+
+/* everything else in the library is hidden */
+#if defined(_WIN32)
+    #if defined(IPSA_BUILDING)
+        #define IPSA_API __declspec(dllexport)
+    #else
+        #define IPSA_API __declspec(dllimport)
+    #endif
+#elif defined(__GNUC__)
+    #define IPSA_API __attribute__((visibility("default")))
+#else
+    #define IPSA_API
+#endif
+
+#define IPSA_OK 0
+#define IPSA_ERR_MAGIC_EOF 1          /* patch too short to hold "PATCH" */
+#define IPSA_ERR_NO_MAGIC 2           /* patch doesn't start with "PATCH" */
+#define IPSA_ERR_HUNK_EOF 3           /* patch ends inside a hunk header */
+#define IPSA_ERR_PAYLOAD_EOF 4        /* patch ends inside a hunk payload */
+#define IPSA_ERR_TRUNC_EOF 5          /* patch ends inside a truncation length */
+#define IPSA_ERR_NO_MEMORY 6
+#define IPSA_ERR_OUTPUT_TOO_SMALL 7   /* out_capacity is less than *out_size */
+#define IPSA_ERR_INVALID_ARGUMENT 8
+
+/* honor a truncation length after the patch's EOF marker */
+#define IPSA_FLAG_POST_TRUNC 0x1
+
+/**
+ * Returns a short description of an IPSA_* code.
+ */
+IPSA_API const char* ipsa_strerror(int code);
+
+/**
+ * Validates a patch and computes the size of the result of applying it to a
+ * patient of patient_size bytes, storing it in *out_size.
+ * Returns IPSA_OK or an IPSA_ERR_* code.
+ */
+IPSA_API int ipsa_output_size(
+    size_t patient_size,
+    const void* patch,
+    size_t patch_size,
+    int flags,
+    size_t* out_size);
+
+/**
+ * Applies a patch to a patient, writing the result to the caller's buffer
+ * out, which holds out_capacity bytes. out may be the patient buffer itself
+ * to patch in place, as long as it is large enough. *out_size always
+ * receives the size of the result when the patch is valid; if that exceeds
+ * out_capacity, nothing is written and IPSA_ERR_OUTPUT_TOO_SMALL is returned.
+ * Returns IPSA_OK or an IPSA_ERR_* code.
+ */
+IPSA_API int ipsa_apply(
+    const void* patient,
+    size_t patient_size,
+    const void* patch,
+    size_t patch_size,
+    int flags,
+    void* out,
+    size_t out_capacity,
+    size_t* out_size);
+
+/**
+ * Like ipsa_apply(), but the output buffer is allocated by the library and
+ * stored in *out. It must be released with ipsa_free().
+ */
+IPSA_API int ipsa_apply_alloc(
+    const void* patient,
+    size_t patient_size,
+    const void* patch,
+    size_t patch_size,
+    int flags,
+    void** out,
+    size_t* out_size);
+
+IPSA_API void ipsa_free(void* p);
+
+#endif
@@ -1,5 +1,16 @@
 #include "config_ipsapply.h"
+#include "batch.h"
+#include "cache.h"
+#include "diff.h"
+#include "digest.h"
+#include "encode.h"
+#include "journal.h"
 #include "options.h"
+#include "overlay.h"
+#include "patch.h"
+#include "pipeline.h"
+#include "serve.h"
+#include "uring.h"
 #include "util.h"
 #include <errno.h>
 #include <inttypes.h>
@@ -9,10 +20,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define HUNK_OFFSET_WIDTH 3
-#define HUNK_LENGTH_WIDTH 2
-#define TRUNC_LENGTH_WIDTH 3
-
 #define FILE_CODE_OK 0
 #define FILE_CODE_EARLY_EOF 1
 #define FILE_CODE_ERROR 2
@@ -27,105 +34,6 @@ const char* FILE_CODE_STR[] = {
 
 #define FILE_CODE(F) (feof(F) ? FILE_CODE_EARLY_EOF : FILE_CODE_ERROR)
 
-const char EOF_MARKER[] = "EOF";
-const char MAGIC_PATCH[] = "PATCH";
-
-enum hunk_header_type {
-    HUNK_REGULAR,
-    HUNK_RLE,
-    HUNK_EOF
-};
-
-struct hunk_header {
-    enum hunk_header_type type;
-
-    int offset;
-    int length;
-    unsigned char fill;   /* RLE only */
-};
-
-int decode_big_endian_3(unsigned char bytes[3]) {
-    return (bytes[0] << 16) | (bytes[1] << 8) | bytes[2];
-}
-
-int decode_big_endian_2(unsigned char bytes[2]) {
-    return (bytes[0] << 8) | bytes[1];
-}
-
-int read_hunk_header(FILE* f, struct hunk_header* h) {
-    /* all hunk header fields are 3 bytes wide at most */
-    unsigned char buf[3] = { 0 };
-    size_t chars_read = 0;
-
-    /* get offset or EOF marker */
-    chars_read = fread(buf, 1, HUNK_OFFSET_WIDTH, f);
-    if (chars_read < HUNK_OFFSET_WIDTH) {
-        return FILE_CODE(f);
-    } else if (MEMEQ(buf, EOF_MARKER, HUNK_OFFSET_WIDTH)) {
-        h->type = HUNK_EOF;
-        return FILE_CODE_OK;
-    } else {
-        h->offset = decode_big_endian_3(buf);
-    }
-
-    /* get regular length */
-    chars_read = fread(buf, 1, HUNK_LENGTH_WIDTH, f);
-    if (chars_read < HUNK_LENGTH_WIDTH) {
-        return FILE_CODE(f);
-    }
-    h->length = decode_big_endian_2(buf);
-    if (h->length != 0) {
-        h->type = HUNK_REGULAR;
-        return FILE_CODE_OK;
-    } else {
-        h->type = HUNK_RLE;
-    }
-
-    /* at this point, this is an RLE hunk */
-    /* read the RLE length */
-    chars_read = fread(buf, 1, HUNK_LENGTH_WIDTH, f);
-    if (chars_read < HUNK_LENGTH_WIDTH) {
-        return FILE_CODE(f);
-    }
-    h->length = decode_big_endian_2(buf);
-
-    /* read the RLE fill byte */
-    chars_read = fread(buf, 1, 1, f);
-    if (chars_read < 1) {
-        return FILE_CODE(f);
-    }
-    h->fill = buf[0];
-
-    return FILE_CODE_OK;
-}
-
-int read_magic_patch(FILE* f, int* found) {
-    char buf[6] = { 0 };
-    size_t chars_read = fread(buf, 1, 5, f);
-    if (chars_read < 5) {
-        return FILE_CODE(f);
-    }
-    *found = STREQ(MAGIC_PATCH, buf);
-    return FILE_CODE_OK;
-}
-
-/* if the function succeeds, and length is -1, no post data was provided */
-int read_trunc_length(FILE* f, int* length) {
-    unsigned char buf[3] = { 0 };
-    size_t chars_read = fread(buf, 1, TRUNC_LENGTH_WIDTH, f);
-
-    if (chars_read == 0 && FILE_CODE(f) == FILE_CODE_EARLY_EOF) {
-        /* it's OK if no data at all exists past the EOF marker */
-        *length = -1;
-    } else if (chars_read < TRUNC_LENGTH_WIDTH) {
-        return FILE_CODE(f);
-    } else {
-        *length = decode_big_endian_3(buf);
-    }
-
-    return FILE_CODE_OK;
-}
-
 void print_patch_directive(FILE* f) {
     if (f) {
         fprintf(f, "0x00000000 PATCH\n");
@@ -158,174 +66,222 @@ void print_hunk_directive(FILE* f, long offset, const struct hunk_header* hunk)
 }
 
 void print_trunc_directive(FILE* f, int trunc_length) {
+    if (!f) {
+        return;
+    }
     fprintf(f, "TRUNCATE length=%#.6x\n", (unsigned)trunc_length);
 }
 
-int patch_parse(
-    struct exec_options* eo,
-    FILE* patch_file,
-    FILE* text_file,
-    FILE* patient_file,
-    FILE* output_file)
-{
-    int magic_patch_found = 0;
-    int code = 0;
-    int warned_ftell_failure = 0;
-    struct hunk_header hunk = { HUNK_EOF, 0, 0, '\0' };
-    unsigned char* pay_buf = NULL;
+/**
+ * Prints every directive of an indexed patch, in patch order.
+ */
+void print_patch_index(FILE* f, const struct patch_index* idx) {
+    struct hunk_header eof = { HUNK_EOF, 0, 0, '\0' };
+    size_t i;
 
-    /* check some preconditions */
-    if (patch_file == NULL || ((patient_file == NULL) != (output_file == NULL))) {
-        fprintf(stderr, "error: invalid file combination in patch_parse\n");
-        goto ERROR;
+    if (!f) {
+        return;
     }
 
-    pay_buf = xmalloc((1 << (8 * HUNK_LENGTH_WIDTH)) - 1);
-
-    /* copy the patient file to the output file to start */
-    if (patient_file) {
-        if (copy_file(patient_file, output_file)
-            || fseek(patient_file, 0, SEEK_SET)
-            || fseek(output_file, 0, SEEK_SET))
-        {
-            fprintf(stderr, "error: failed to copy patient data to output file\n");
-            goto ERROR;
-        }
+    print_patch_directive(f);
+    for (i = 0; i < idx->hunk_count; i++) {
+        print_hunk_directive(f, (long)idx->hunks[i].record_offset,
+            &idx->hunks[i].header);
     }
-
-    /* parse the patch file */
-
-    /* read magic PATCH */
-    code = read_magic_patch(patch_file, &magic_patch_found);
-    if (code) {
-        fprintf(stderr, "error: while detecting magic PATCH: "
-            "%s\n", FILE_CODE_STR[code]);
-        goto ERROR;
-    } else if (!magic_patch_found) {
-        fprintf(stderr, "error: magic PATCH not found\n");
-        goto ERROR;
+    print_hunk_directive(f, (long)idx->eof_offset, &eof);
+    if (idx->trunc_length >= 0) {
+        print_trunc_directive(f, idx->trunc_length);
     }
-    print_patch_directive(text_file);
+}
 
-    /* read hunks */
-    for (;;) {
-        long told = ftell(patch_file);
-        if (told == -1L) {
-            if (!warned_ftell_failure) {
-                fprintf(stderr, "warning: failed ftell on input file: %s\n",
-                    strerror(errno));
-                warned_ftell_failure = 1;
-            }
-            told = LONG_MAX;
+/**
+ * Warns about parts of an indexed patch that are legal but suspicious.
+ */
+void warn_patch_index(const struct patch_index* idx) {
+    size_t i;
+    for (i = 0; i < idx->hunk_count; i++) {
+        if (idx->hunks[i].header.length == 0) {
+            fprintf(stderr, "warning: hunk with length 0\n");
         }
+    }
+    if (idx->trailing_data) {
+        fprintf(stderr, "warning: unexpected bytes at end of file."
+            " ignoring...\n");
+    }
+}
 
-        code = read_hunk_header(patch_file, &hunk);
-        if (code) {
-            fprintf(stderr, "error: while reading hunks: %s\n",
-                FILE_CODE_STR[code]);
-            goto ERROR;
-        }
+void print_copy_strategy(const struct exec_options* eo, int strategy) {
+    if (eo->verbose) {
+        fprintf(stderr, "info: patient copied to output using %s\n",
+            COPY_STRATEGY_STR[strategy]);
+    }
+}
 
-        /* print offset (in patch file) of current hunk directive */
-        print_hunk_directive(text_file, (unsigned long)told, &hunk);
+#define FILL_BUFLEN ((size_t)1 << 16)
 
-        if (hunk.type == HUNK_EOF) {
-            break;
-        }
+/* zero fills at least this long are punched out as holes in sparse mode */
+#define HOLE_MIN ((size_t)1 << 12)
 
-        if (hunk.length == 0) {
-            fprintf(stderr, "warning: hunk with length 0\n");
-        }
+#define IS_HOLE(EXT) ((EXT)->fill == 0 && (EXT)->length >= HOLE_MIN)
 
-        if (hunk.type == HUNK_REGULAR) {
-            if (output_file) {
-                if (fread(pay_buf, 1, hunk.length, patch_file) < (size_t)hunk.length) {
-                    fprintf(
-                        stderr,
-                        "error: while reading hunk payload: %s\n",
-                        FILE_CODE_STR[FILE_CODE(patch_file)]
-                    );
-                    goto ERROR;
-                }
-                if (fseek(output_file, hunk.offset, SEEK_SET)) {
-                    fprintf(stderr, "error: unable to seek to hunk payload"
-                        " offset in patient file");
-                    goto ERROR;
-                }
-                if (fwrite(pay_buf, 1, hunk.length, output_file) < (size_t)hunk.length) {
-                    fprintf(
-                        stderr,
-                        "error: while writing hunk payload: %s\n",
-                        FILE_CODE_STR[FILE_CODE(output_file)]
-                    );
-                    goto ERROR;
-                }
-            } else {
-                /* skip the hunk payload because we aren't applying it */
-                if (fseek(patch_file, hunk.length, SEEK_CUR)) {
-                    fprintf(stderr, "error: while reading hunks:"
-                        " failed to seek past hunk payload\n");
-                    goto ERROR;
-                }
+/**
+ * Appends the spans of the run of adjacent extents that starts at
+ * ov->extents[i] to *spans, growing it as needed. Fills are drawn from
+ * fill_bufs, which are allocated as needed. If sparse is nonzero, the run
+ * stops short of the next hole (see IS_HOLE).
+ * @return the index of the first extent after the run
+ */
+size_t gather_run(
+    const struct overlay* ov,
+    size_t i,
+    int sparse,
+    unsigned char** fill_bufs,
+    struct write_span** spans,
+    size_t* span_count,
+    size_t* span_capacity)
+{
+    do {
+        const struct extent* ext = &ov->extents[i];
+        size_t done = 0;
+        while (done < ext->length) {
+            struct write_span* span = NULL;
+            size_t n = ext->length - done;
+            if (*span_count == *span_capacity) {
+                *span_capacity = *span_capacity ? *span_capacity * 2 : 64;
+                *spans = xrealloc(*spans, *span_capacity * sizeof(**spans));
             }
-        } else { /* HUNK_RLE */
-            if (output_file) {
-                if (fseek(output_file, hunk.offset, SEEK_SET)) {
-                    fprintf(stderr, "error: unable to seek to RLE hunk payload"
-                        " offset in patient file");
-                    goto ERROR;
+            span = &(*spans)[(*span_count)++];
+            if (ext->fill < 0) {
+                span->data = ext->data;
+            } else {
+                if (!fill_bufs[ext->fill]) {
+                    fill_bufs[ext->fill] = xmalloc(FILL_BUFLEN);
+                    memset(fill_bufs[ext->fill], ext->fill, FILL_BUFLEN);
                 }
-                memset(pay_buf, hunk.fill, hunk.length);
-                if (fwrite(pay_buf, 1, hunk.length, output_file) < (size_t)hunk.length) {
-                    fprintf(stderr,
-                        "error: while writing RLE hunk payload: %s\n",
-                        FILE_CODE_STR[FILE_CODE(output_file)]
-                    );
-                    goto ERROR;
+                if (n > FILL_BUFLEN) {
+                    n = FILL_BUFLEN;
                 }
+                span->data = fill_bufs[ext->fill];
             }
+            span->length = n;
+            done += n;
         }
-    }
+        i++;
+    } while (i < ov->count && ov->extents[i].offset
+        == ov->extents[i - 1].offset + ov->extents[i - 1].length
+        && !(sparse && IS_HOLE(&ov->extents[i])));
+    return i;
+}
 
-    /* optional truncation */
-    if (eo->respect_post_trunc) {
-        int expect_eof_char = EOF;
-        int trunc_length = 0;
-        code = read_trunc_length(patch_file, &trunc_length);
-        if (code) {
-            fprintf(stderr, "error: while reading truncation length: %s\n",
-                FILE_CODE_STR[code]);
-            goto ERROR;
-        } else if (trunc_length >= 0) {
-            print_trunc_directive(text_file, trunc_length);
-            if (output_file && truncate_file(output_file, trunc_length)) {
-                fprintf(stderr, "error: failed to truncate file");
-                goto ERROR;
+/**
+ * Writes an overlay to f in a single forward sweep. Each run of adjacent
+ * extents is gathered into one write_spans_at() call. If sparse is nonzero,
+ * long zero fills are left as holes with punch_hole() instead, for as long
+ * as f supports that. If calls is non-NULL, it is incremented once per write
+ * or punch call made.
+ * @return 0 on success or nonzero on error
+ */
+int write_overlay(
+    FILE* f,
+    const struct overlay* ov,
+    int sparse,
+    size_t* calls)
+{
+    unsigned char* fill_bufs[0x100] = { NULL };
+    struct write_span* spans = NULL;
+    size_t span_capacity = 0;
+    size_t i = 0;
+    size_t j;
+    int ret = 0;
+
+    while (i < ov->count && !ret) {
+        size_t run_offset = ov->extents[i].offset;
+        size_t span_count = 0;
+
+        if (sparse && IS_HOLE(&ov->extents[i])) {
+            if (!punch_hole(f, ov->extents[i].offset, ov->extents[i].length)) {
+                if (calls) {
+                    ++*calls;
+                }
+                i++;
+                continue;
             }
+            /* no holes here after all, so write zeros from now on */
+            sparse = 0;
         }
 
-        /* test for additional unexpected data and issue a warning.
-           we only do this if we were instructed to check for a truncation
-           length after the EOF marker */
-        expect_eof_char = getc(patch_file);
-        if (expect_eof_char == EOF && !feof(patch_file)) {
-            fprintf(stderr, "error: while checking for"
-                " post-truncation-length data: %s\n", FILE_CODE_STR[FILE_CODE(patch_file)]);
-        } else if (expect_eof_char != EOF) {
-            ungetc(expect_eof_char, patch_file);
-            /* unexpected data at the tail of the file */
-            fprintf(stderr, "warning: unexpected bytes at end of file."
-                " ignoring...\n");
-        }
+        i = gather_run(ov, i, sparse, fill_bufs, &spans, &span_count,
+            &span_capacity);
+        ret = write_spans_at(f, run_offset, spans, span_count, calls);
     }
 
-    /* cleanup */
-    free(pay_buf);
-    return EXIT_SUCCESS;
+    for (j = 0; j < 0x100; j++) {
+        free(fill_bufs[j]);
+    }
+    free(spans);
+    return ret;
+}
 
-ERROR:
-    free(pay_buf);
-    return EXIT_FAILURE;
+/**
+ * Like write_overlay(), but every run is planned up front and then queued on
+ * ring, so the whole overlay takes a handful of submissions.
+ * @return 0 on success or nonzero on error
+ */
+int write_overlay_uring(
+    struct uring* ring,
+    FILE* f,
+    const struct overlay* ov)
+{
+    unsigned char* fill_bufs[0x100] = { NULL };
+    struct write_span* spans = NULL;
+    struct uring_write* runs = NULL;
+    size_t* firsts = NULL;   /* where each run starts in spans */
+    size_t span_count = 0;
+    size_t span_capacity = 0;
+    size_t run_count = 0;
+    size_t i = 0;
+    size_t j;
+    int ret = 0;
+
+    runs = xmalloc((ov->count ? ov->count : 1) * sizeof(*runs));
+    firsts = xmalloc((ov->count ? ov->count : 1) * sizeof(*firsts));
+    while (i < ov->count) {
+        runs[run_count].offset = ov->extents[i].offset;
+        firsts[run_count] = span_count;
+        i = gather_run(ov, i, 0, fill_bufs, &spans, &span_count,
+            &span_capacity);
+        runs[run_count].count = span_count - firsts[run_count];
+        run_count++;
+    }
+    /* spans has stopped moving now */
+    for (j = 0; j < run_count; j++) {
+        runs[j].spans = spans + firsts[j];
+    }
+
+    ret = uring_write_runs(ring, f, runs, run_count);
+
+    for (j = 0; j < 0x100; j++) {
+        free(fill_bufs[j]);
+    }
+    free(firsts);
+    free(runs);
+    free(spans);
+    return ret;
+}
+
+void print_write_stats(
+    const struct exec_options* eo,
+    size_t hunk_count,
+    const struct overlay* ov,
+    size_t calls)
+{
+    if (eo->verbose) {
+        /* applying hunks one by one costs a seek and a write each */
+        fprintf(stderr, "info: wrote %lu hunks as %lu extents in %lu write"
+            " calls (saved %ld calls)\n", (unsigned long)hunk_count,
+            (unsigned long)ov->count, (unsigned long)calls,
+            2 * (long)hunk_count - (long)calls);
+    }
 }
 
 /**
@@ -354,13 +310,26 @@ FILE* fopen_text(const char* path) {
     }
 }
 
+/* treats the path "-" as stdout */
 FILE* fopen_output(const char* path) {
     if (!path) {
         return NULL;
+    } else if (STREQ(path, "-")) {
+        return stdout;
     }
     return fopen(path, "wb");
 }
 
+/* like fopen_output, but a file (though not stdout) can be read back too */
+FILE* fopen_output_readable(const char* path) {
+    if (!path) {
+        return NULL;
+    } else if (STREQ(path, "-")) {
+        return stdout;
+    }
+    return fopen(path, "w+b");
+}
+
 int fclose_check(FILE* f) {
     if (f && f != stdin && f != stdout) {
         return fclose(f);
@@ -368,153 +337,1618 @@ int fclose_check(FILE* f) {
     return 0;
 }
 
-int subcommand_apply(struct exec_options* eo) {
-    int return_code = EXIT_FAILURE;
-    FILE* patch_file = NULL;
-    FILE* text_file = NULL;
-    FILE* patient_file = NULL;
-    FILE* output_file = NULL;
+/**
+ * Writes an encoded patch to the file at path.
+ * @return 0 on success or nonzero (after reporting the error) on error
+ */
+int write_encoded_patch(const char* path, const struct patch_writer* w) {
+    FILE* output_file = fopen_output(path);
+    if (!output_file) {
+        fprintf(stderr, "error: failed to open output file\n");
+        return -1;
+    }
+    if (fwrite(w->data, 1, w->size, output_file) < w->size) {
+        fprintf(stderr, "error: while writing output: %s\n",
+            FILE_CODE_STR[FILE_CODE(output_file)]);
+        fclose_check(output_file);
+        return -1;
+    }
+    if (fclose_check(output_file)) {
+        fprintf(stderr, "error: unable to close output file\n");
+        return -1;
+    }
+    return 0;
+}
 
-    /* text file is optional for this subcommand */
-    if (eo->text_file_path && !(text_file = fopen_text(eo->text_file_path))) {
-        fprintf(stderr, "error: failed to open text file\n");
-        goto ERROR;
+/**
+ * Writes the patch that undoes an apply (see overlay_build_undo()) to the
+ * --emit-undo file. The saved bytes come straight from a mapping of the
+ * patient, so this doesn't take another pass over it.
+ * @return 0 on success or nonzero (after reporting the error) on error
+ */
+int write_undo_patch(
+    const struct exec_options* eo,
+    const struct overlay* ov,
+    const unsigned char* patient,
+    size_t patient_size,
+    size_t kept,
+    size_t size)
+{
+    struct overlay undo;
+    struct patch_writer w;
+    int code = 0;
+
+    overlay_build_undo(&undo, ov, patient, patient_size, kept, size);
+    code = patch_encode(&w, &undo, patient, patient_size,
+        size > patient_size ? (long)patient_size : -1);
+    overlay_free(&undo);
+    if (code) {
+        fprintf(stderr, "error: can't write undo patch: %s\n",
+            ENCODE_CODE_STR[code]);
+        return -1;
     }
 
-    if (!(patch_file = fopen_patch(eo->patch_file_path))) {
-        fprintf(stderr, "error: failed to open patch file\n");
-        goto ERROR;
+    code = write_encoded_patch(eo->undo_file_path, &w);
+    if (!code && eo->verbose) {
+        fprintf(stderr, "info: wrote undo patch of %lu hunks, %lu bytes\n",
+            (unsigned long)w.hunk_count, (unsigned long)w.size);
     }
+    patch_writer_free(&w);
+    return code;
+}
 
-    if (!(patient_file = fopen_patient(eo->patient_file_path))) {
-        fprintf(stderr, "error: failed to open patient file\n");
-        goto ERROR;
+/**
+ * The patches given with -p, loaded and indexed, in the order they apply.
+ */
+struct patch_stack {
+    struct file_map* maps;
+    struct patch_index* idxs;
+    size_t count;
+    size_t hunk_count;       /* over every patch */
+    int truncates;           /* whether any patch truncates the image */
+};
+
+/**
+ * Writes the --emit-undo patch for applying stack to the patient. It is
+ * written once, before any engine runs, so an engine that turns out to be
+ * unavailable and falls back to another doesn't write it again.
+ * @return 0 on success or nonzero (after reporting the error) on error
+ */
+int emit_undo_patch(
+    const struct exec_options* eo,
+    const struct patch_stack* stack)
+{
+    struct file_map patient;
+    struct overlay ov;
+    size_t size = 0;
+    size_t kept = 0;
+    int code = 0;
+
+    if (map_file_read(eo->patient_file_path, &patient)) {
+        fprintf(stderr, "error: --emit-undo requires a patient that is a"
+            " regular file\n");
+        return -1;
     }
+    overlay_build_stack(&ov, stack->idxs, stack->count, patient.size, &size,
+        &kept);
+    code = write_undo_patch(eo, &ov, patient.data, patient.size, kept, size);
+    overlay_free(&ov);
+    unmap_file(&patient);
+    return code;
+}
 
-    if (!(output_file = fopen_output(eo->output_file_path))) {
-        fprintf(stderr, "error: failed to open output file\n");
-        goto ERROR;
+/**
+ * Applies a stack of indexed patches with stdio. The patient is copied to the
+ * output, then the stack's overlay is written over it in offset order, so the
+ * image is written once however many patches there are. With --sparse, holes
+ * in the patient stay holes and long zero fills are punched out rather than
+ * written. If crc is non-NULL, it receives the CRC32 of the output, which is
+ * read back for it (output_file must be opened for reading too).
+ */
+int patch_apply_stdio(
+    struct exec_options* eo,
+    const struct patch_stack* stack,
+    FILE* patient_file,
+    FILE* output_file,
+    uint32_t* crc)
+{
+    int copy_strategy = COPY_STRATEGY_NONE;
+    struct overlay ov;
+    long patient_size = 0;
+    size_t size = 0;
+    size_t kept = 0;
+    size_t calls = 0;
+
+    /* copy the patient file to the output file to start */
+    if ((eo->sparse
+            ? copy_file_sparse(patient_file, output_file, &copy_strategy)
+            : copy_file(patient_file, output_file, &copy_strategy))
+        || (patient_size = ftell(output_file)) < 0
+        || fseek(patient_file, 0, SEEK_SET)
+        || fseek(output_file, 0, SEEK_SET))
+    {
+        fprintf(stderr, "error: failed to copy patient data to output file\n");
+        return EXIT_FAILURE;
     }
+    print_copy_strategy(eo, copy_strategy);
 
-    return_code = patch_parse(eo, patch_file, text_file, patient_file, output_file);
+    overlay_build_stack(&ov, stack->idxs, stack->count, (size_t)patient_size,
+        &size, &kept);
+    overlay_zero_cut(&ov, (size_t)patient_size, kept, size);
 
-    fclose_check(patch_file);
-    patch_file = NULL;
-    fclose_check(patient_file);
-    patient_file = NULL;
+    if (write_overlay(output_file, &ov, eo->sparse, &calls)) {
+        fprintf(stderr, "error: while writing hunk payload: %s\n",
+            FILE_CODE_STR[FILE_CODE_ERROR]);
+        goto ERROR;
+    }
+    print_write_stats(eo, stack->hunk_count, &ov, calls);
 
-    if (fclose_check(text_file)) {
-        text_file = NULL;
-        fprintf(stderr, "error: unable to close text file\n");
+    /* optional truncation */
+    if (stack->truncates && truncate_file(output_file, size)) {
+        fprintf(stderr, "error: failed to truncate file\n");
         goto ERROR;
     }
-    text_file = NULL;
 
-    if (fclose_check(output_file)) {
-        output_file = NULL;
-        fprintf(stderr, "error: unable to close output file\n");
+    if (crc && (fseek(output_file, 0, SEEK_SET) || crc32_file(output_file, crc))) {
+        fprintf(stderr, "error: while reading back output file: %s\n",
+            FILE_CODE_STR[FILE_CODE(output_file)]);
         goto ERROR;
     }
-    output_file = NULL;
 
-    return return_code;
+    overlay_free(&ov);
+    return EXIT_SUCCESS;
 
 ERROR:
-    fclose_check(patch_file);
-    fclose_check(patient_file);
-    fclose_check(text_file);
-    fclose_check(output_file);
+    overlay_free(&ov);
     return EXIT_FAILURE;
 }
 
-int subcommand_text(struct exec_options* eo) {
-    int return_code = EXIT_FAILURE;
-    FILE* patch_file = NULL;
-    FILE* text_file = NULL;
-    
-    if (!(patch_file = fopen_patch(eo->patch_file_path))) {
-        fprintf(stderr, "error: failed to open patch file\n");
-        goto ERROR;
-    }
-
-    if (!(text_file = fopen_text(eo->text_file_path))) {
-        fprintf(stderr, "error: failed to open text file\n");
-        goto ERROR;
-    }
-
-    return_code = patch_parse(eo, patch_file, text_file, NULL, NULL);
+#define MAPPED_UNAVAILABLE (-1)
 
-    fclose_check(patch_file);
-    patch_file = NULL;
+/**
+ * Applies a stack of indexed patches through memory mappings of the patient
+ * and output files instead of stdio. The output is sized up front, then the
+ * stack's overlay is copied directly into the output mapping. If crc is
+ * non-NULL, it receives the CRC32 of the output, computed in the same pass.
+ * @return EXIT_SUCCESS or EXIT_FAILURE, or MAPPED_UNAVAILABLE if the files
+ *         can't be mapped and the caller should fall back to stdio
+ */
+int patch_apply_mapped(
+    struct exec_options* eo,
+    const struct patch_stack* stack,
+    uint32_t* crc)
+{
+    struct file_map patient;
+    struct file_map output;
+    struct patched_view view;
+    int copy_strategy = COPY_STRATEGY_NONE;
 
-    if (fclose_check(text_file)) {
-        text_file = NULL;
-        fprintf(stderr, "error: unable to close text file\n");
-        goto ERROR;
+    if (map_file_read(eo->patient_file_path, &patient)) {
+        return MAPPED_UNAVAILABLE;
+    }
+    patched_view_init_stack(&view, stack->idxs, stack->count, patient.data,
+        patient.size);
+
+    /* the output starts out as a copy of the patient, resized to fit */
+    if (map_file_write_from(eo->output_file_path, patient.fd, view.size,
+        &output, &copy_strategy))
+    {
+        int error = errno;
+        patched_view_free(&view);
+        unmap_file(&patient);
+        if (error == ENOSPC) {
+            /* stdio would run out of room just the same */
+            fprintf(stderr, "error: while writing output: %s\n",
+                strerror(error));
+            return EXIT_FAILURE;
+        }
+        return MAPPED_UNAVAILABLE;
     }
+    print_copy_strategy(eo, copy_strategy);
+    overlay_zero_cut(&view.overlay, patient.size, view.patient_size, view.size);
 
-    return return_code;
+    /* one forward sweep over the output, with truncated hunks clipped */
+    if (crc) {
+        *crc = CRC32_BASE;
+    }
+    patched_view_apply(&view, output.data, crc);
+    if (crc) {
+        *crc = crc32_finalize(*crc);
+    }
+    if (eo->verbose) {
+        fprintf(stderr, "info: copied %lu hunks as %lu extents into the"
+            " output mapping\n", (unsigned long)stack->hunk_count,
+            (unsigned long)view.overlay.count);
+    }
 
-ERROR:
-    fclose_check(patch_file);
-    fclose_check(text_file);
-    return EXIT_FAILURE;
+    patched_view_free(&view);
+    unmap_file(&patient);
+    if (unmap_file(&output)) {
+        fprintf(stderr, "error: unable to close output file\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
 }
 
-int subcommand_crc32(const struct exec_options* eo) {
+#define URING_UNAVAILABLE (-1)
+
+/**
+ * Applies a stack of indexed patches like patch_apply_stdio(), but the copy
+ * of the patient and the overlay writes are queued on an io_uring in batches
+ * of up to --queue-depth operations. With --verbose, the operations and
+ * submissions it took are reported, to hold against the stdio engine's
+ * write calls.
+ * @return EXIT_SUCCESS or EXIT_FAILURE, or URING_UNAVAILABLE if io_uring
+ *         can't be used here and the caller should fall back to stdio
+ */
+int patch_apply_uring(
+    struct exec_options* eo,
+    const struct patch_stack* stack,
+    uint32_t* crc)
+{
+    struct uring ring;
+    struct overlay ov;
     FILE* patient_file = NULL;
-    const size_t buflen = 4096;
-    unsigned char* buf = NULL;
-    int done = 0;
-    uint32_t crc = CRC32_BASE;
+    FILE* output_file = NULL;
+    long patient_size = 0;
+    size_t size = 0;
+    size_t kept = 0;
+    size_t copy_ops = 0;
+    size_t copy_submits = 0;
+
+    ov.extents = NULL;
+    ov.count = 0;
+    if (uring_init(&ring, (unsigned)eo->queue_depth)) {
+        return URING_UNAVAILABLE;
+    }
 
     if (!(patient_file = fopen_patient(eo->patient_file_path))) {
         fprintf(stderr, "error: failed to open patient file\n");
         goto ERROR;
     }
+    output_file = crc ? fopen_output_readable(eo->output_file_path)
+        : fopen_output(eo->output_file_path);
+    if (!output_file) {
+        fprintf(stderr, "error: failed to open output file\n");
+        goto ERROR;
+    }
 
-    buf = xmalloc(buflen);
+    if (uring_copy_file(&ring, patient_file, output_file)
+        || fseek(output_file, 0, SEEK_END)
+        || (patient_size = ftell(output_file)) < 0)
+    {
+        fprintf(stderr, "error: failed to copy patient data to output file\n");
+        goto ERROR;
+    }
+    copy_ops = ring.ops;
+    copy_submits = ring.submits;
+    if (eo->verbose) {
+        fprintf(stderr, "info: patient copied to output in %lu io_uring"
+            " operations over %lu submissions\n", (unsigned long)copy_ops,
+            (unsigned long)copy_submits);
+    }
 
-    crc32_init();
+    overlay_build_stack(&ov, stack->idxs, stack->count, (size_t)patient_size,
+        &size, &kept);
+    overlay_zero_cut(&ov, (size_t)patient_size, kept, size);
 
-    while (!done) {
-        size_t chars_read = fread(buf, 1, buflen, patient_file);
-        if (chars_read < buflen) {
-            if (feof(patient_file)) {
-                done = 1;
-            } else {
-                fprintf(stderr, "error: while reading patient file: %s\n",
-                    FILE_CODE_STR[FILE_CODE(patient_file)]);
-                goto ERROR;
-            }
-        }
-        crc = crc32_update(crc, buf, chars_read);
+    if (write_overlay_uring(&ring, output_file, &ov)) {
+        fprintf(stderr, "error: while writing hunk payload: %s\n",
+            FILE_CODE_STR[FILE_CODE_ERROR]);
+        goto ERROR;
+    }
+    if (eo->verbose) {
+        fprintf(stderr, "info: wrote %lu hunks as %lu extents in %lu io_uring"
+            " operations over %lu submissions\n",
+            (unsigned long)stack->hunk_count, (unsigned long)ov.count,
+            (unsigned long)(ring.ops - copy_ops),
+            (unsigned long)(ring.submits - copy_submits));
     }
 
-    crc = crc32_finalize(crc);
+    if (stack->truncates && truncate_file(output_file, size)) {
+        fprintf(stderr, "error: failed to truncate file\n");
+        goto ERROR;
+    }
 
-    printf("%.8" PRIX32 "\n", crc);
+    if (crc && (fseek(output_file, 0, SEEK_SET) || crc32_file(output_file, crc))) {
+        fprintf(stderr, "error: while reading back output file: %s\n",
+            FILE_CODE_STR[FILE_CODE(output_file)]);
+        goto ERROR;
+    }
 
-    free(buf);
+    overlay_free(&ov);
+    uring_free(&ring);
     fclose_check(patient_file);
+    if (fclose_check(output_file)) {
+        fprintf(stderr, "error: unable to close output file\n");
+        return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
 
 ERROR:
-    free(buf);
+    overlay_free(&ov);
+    uring_free(&ring);
     fclose_check(patient_file);
+    fclose_check(output_file);
     return EXIT_FAILURE;
 }
 
-int main(int argc, char** argv) {
-    struct exec_options* eo = NULL;
-    int exit_code = EXIT_SUCCESS;
+/* the patient is read and the output written this many bytes at a time */
+#define STREAM_BLOCK ((size_t)1 << 18)
+
+/* lays the overlay over a block of the image, then writes it out */
+int write_stream_block(
+    FILE* f,
+    const struct overlay* ov,
+    size_t* cursor,
+    size_t offset,
+    unsigned char* block,
+    size_t len,
+    uint32_t* crc)
+{
+    overlay_apply_range(ov, cursor, offset, block, len);
+    if (crc) {
+        *crc = crc32_update(*crc, block, len);
+    }
+    return fwrite(block, 1, len, f) < len;
+}
 
-    eo = parse_exec_options(argc, argv);
-    if (!eo->parse_success) {
-        fprintf(stderr, "%s\n", "Error parsing options."
-            " Use `ipsa --help` to view help.");
-        exit_code = EXIT_FAILURE;
-    } else if (eo->help) {
+/**
+ * Applies a stack of indexed patches in a single pass over the patient,
+ * without seeking either file, so that both can be pipes (-f - -o -). The
+ * patient is read a block at a time, the stack's overlay is laid over each
+ * block, and the block is written out; whatever the image grows by past the
+ * patient's end is made of the overlay and zeros alone. Only the patches are
+ * held in memory. If crc is non-NULL, it receives the CRC32 of the output,
+ * computed as it is written.
+ */
+int patch_apply_stream(
+    const struct exec_options* eo,
+    const struct patch_stack* stack,
+    uint32_t* crc)
+{
+    unsigned char* block = xmalloc(STREAM_BLOCK);
+    FILE* patient_file = NULL;
+    FILE* output_file = NULL;
+    struct overlay ov;
+    size_t size = 0;
+    size_t kept = 0;
+    size_t cursor = 0;
+    size_t pos = 0;
+    size_t n = 0;
+    size_t i;
+
+    /* the extents don't depend on the patient's size, and neither does the
+       size of an image that is truncated, so the patient's size only has to
+       be known once it has been read */
+    overlay_build_stack(&ov, stack->idxs, stack->count, (size_t)-1, &size,
+        &kept);
+    overlay_zero_cut(&ov, (size_t)-1, kept, size);
+    if (crc) {
+        *crc = CRC32_BASE;
+    }
+
+    if (!(patient_file = fopen_patient(eo->patient_file_path))) {
+        fprintf(stderr, "error: failed to open patient file\n");
+        goto ERROR;
+    }
+    if (!(output_file = fopen_output(eo->output_file_path))) {
+        fprintf(stderr, "error: failed to open output file\n");
+        goto ERROR;
+    }
+
+    /* the rest of a patient cut short is still read, so that whatever feeds
+       the pipe isn't cut off */
+    while ((n = fread(block, 1, STREAM_BLOCK, patient_file))) {
+        size_t take = n;
+        if (stack->truncates) {
+            take = pos >= size ? 0 : size - pos < n ? size - pos : n;
+        }
+        if (take && write_stream_block(output_file, &ov, &cursor, pos, block,
+            take, crc))
+        {
+            fprintf(stderr, "error: while writing output: %s\n",
+                FILE_CODE_STR[FILE_CODE(output_file)]);
+            goto ERROR;
+        }
+        pos += n;
+    }
+    if (ferror(patient_file)) {
+        fprintf(stderr, "error: while reading patient: %s\n",
+            FILE_CODE_STR[FILE_CODE(patient_file)]);
+        goto ERROR;
+    }
+
+    size = pos;
+    for (i = 0; i < stack->count; i++) {
+        size = patch_output_size(&stack->idxs[i], size);
+    }
+    for (pos = pos < size ? pos : size; pos < size; pos += n) {
+        n = size - pos < STREAM_BLOCK ? size - pos : STREAM_BLOCK;
+        memset(block, 0, n);
+        if (write_stream_block(output_file, &ov, &cursor, pos, block, n, crc)) {
+            fprintf(stderr, "error: while writing output: %s\n",
+                FILE_CODE_STR[FILE_CODE(output_file)]);
+            goto ERROR;
+        }
+    }
+    if (fflush(output_file)) {
+        fprintf(stderr, "error: while writing output: %s\n",
+            FILE_CODE_STR[FILE_CODE(output_file)]);
+        goto ERROR;
+    }
+    if (crc) {
+        *crc = crc32_finalize(*crc);
+    }
+    if (eo->verbose) {
+        fprintf(stderr, "info: streamed %lu hunks as %lu extents into %lu"
+            " bytes of output\n", (unsigned long)stack->hunk_count,
+            (unsigned long)ov.count, (unsigned long)size);
+    }
+
+    overlay_free(&ov);
+    free(block);
+    fclose_check(patient_file);
+    if (fclose_check(output_file)) {
+        fprintf(stderr, "error: unable to close output file\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+
+ERROR:
+    overlay_free(&ov);
+    free(block);
+    fclose_check(patient_file);
+    fclose_check(output_file);
+    return EXIT_FAILURE;
+}
+
+/**
+ * Loads a whole input file into memory: it is mapped if it is a regular file
+ * and read into a buffer otherwise (e.g. "-" for stdin). The result must be
+ * released with unmap_file().
+ * @return 0 on success or nonzero on error
+ */
+int load_input(const char* path, struct file_map* m) {
+    FILE* f = NULL;
+    int code = 0;
+
+    if (path && !STREQ(path, "-") && !map_file_read(path, m)) {
+        return 0;
+    }
+    if (!(f = fopen_patch(path))) {
+        return -1;
+    }
+    code = load_file(f, m);
+    fclose_check(f);
+    return code;
+}
+
+/**
+ * Loads the whole patch into memory with load_input() and decodes it into
+ * idx. Errors and warnings are reported on stderr. On success, the caller
+ * must release both m and idx.
+ *
+ * If compiled is nonzero and --cache-dir is given, a patch found in the cache
+ * (see cache.h) isn't decoded at all: m and idx are swapped for its compiled
+ * form, whose hunks are the patch's coalesced extents in offset order rather
+ * than its records. A patch that isn't cached yet, or whose entry is stale,
+ * is decoded as usual and then compiled into the cache.
+ * @return 0 on success or nonzero on error
+ */
+int load_patch(
+    const struct exec_options* eo,
+    const char* path,
+    struct file_map* m,
+    struct patch_index* idx,
+    int compiled)
+{
+    struct file_map cached;
+    char* cache_path = NULL;
+    uint32_t crc = 0;
+    int code = 0;
+
+    if (load_input(path, m)) {
+        fprintf(stderr, "error: failed to read patch file%s%s\n",
+            path ? " " : "", path ? path : "");
+        return -1;
+    }
+
+    if (compiled && eo->cache_dir) {
+        crc = crc32_quick(m->data, m->size);
+        cache_path = patch_cache_path(eo->cache_dir, crc, m->size,
+            eo->respect_post_trunc);
+        code = patch_cache_load(cache_path, m->data, m->size, crc,
+            eo->respect_post_trunc, &cached, idx);
+        if (code == CACHE_HIT) {
+            if (eo->verbose) {
+                fprintf(stderr, "info: using compiled patch %s\n", cache_path);
+            }
+            unmap_file(m);
+            *m = cached;
+            free(cache_path);
+            warn_patch_index(idx);
+            return 0;
+        } else if (code == CACHE_STALE) {
+            fprintf(stderr, "warning: rebuilding stale cache entry %s\n",
+                cache_path);
+        }
+    }
+
+    code = patch_index_build(idx, m->data, m->size, eo->respect_post_trunc);
+    if (code) {
+        fprintf(stderr, "error: %s\n", PATCH_CODE_STR[code]);
+        unmap_file(m);
+        free(cache_path);
+        return -1;
+    }
+    warn_patch_index(idx);
+
+    if (cache_path) {
+        if (make_dir(eo->cache_dir) || patch_cache_store(cache_path,
+            m->data, m->size, crc, eo->respect_post_trunc, idx))
+        {
+            fprintf(stderr, "warning: unable to write cache entry %s\n",
+                cache_path);
+        } else if (eo->verbose) {
+            fprintf(stderr, "info: compiled patch into %s\n", cache_path);
+        }
+        free(cache_path);
+    }
+    return 0;
+}
+
+void free_patches(struct patch_stack* stack) {
+    size_t i;
+    for (i = 0; i < stack->count; i++) {
+        patch_index_free(&stack->idxs[i]);
+        unmap_file(&stack->maps[i]);
+    }
+    free(stack->idxs);
+    free(stack->maps);
+    stack->idxs = NULL;
+    stack->maps = NULL;
+    stack->count = 0;
+}
+
+/**
+ * Loads every patch given with -p with load_patch(), compiled (from the
+ * cache) if compiled is nonzero. On success, the caller must release the
+ * stack with free_patches().
+ * @return 0 on success or nonzero on error
+ */
+int load_patches(
+    const struct exec_options* eo,
+    struct patch_stack* stack,
+    int compiled)
+{
+    size_t want = eo->patch_count ? (size_t)eo->patch_count : 1;
+
+    stack->maps = xmalloc(want * sizeof(*stack->maps));
+    stack->idxs = xmalloc(want * sizeof(*stack->idxs));
+    stack->count = 0;
+    stack->hunk_count = 0;
+    stack->truncates = 0;
+
+    /* cache entries are keyed and checked by CRC32 */
+    if (compiled && eo->cache_dir) {
+        crc32_init();
+    }
+    while (stack->count < want) {
+        struct patch_index* idx = &stack->idxs[stack->count];
+        if (load_patch(eo, eo->patch_count
+            ? eo->patch_file_paths[stack->count] : NULL,
+            &stack->maps[stack->count], idx, compiled))
+        {
+            free_patches(stack);
+            return -1;
+        }
+        stack->count++;
+        stack->hunk_count += idx->hunk_count;
+        stack->truncates |= idx->trunc_length >= 0;
+    }
+    return 0;
+}
+
+/**
+ * Prints the directives of every patch in a stack, one patch after another.
+ */
+void print_patch_stack(FILE* f, const struct patch_stack* stack) {
+    size_t i;
+    for (i = 0; i < stack->count; i++) {
+        print_patch_index(f, &stack->idxs[i]);
+    }
+}
+
+/**
+ * Derives the CRC32 of the output from the patient's CRC32 (--patient-crc32)
+ * with patched_view_crc32_delta(), which reads only the patched regions of
+ * the patient through a mapping.
+ * @return 0 on success or nonzero if the patient can't be mapped
+ */
+int output_crc_from_patient(
+    const struct exec_options* eo,
+    const struct patch_stack* stack,
+    uint32_t* crc)
+{
+    struct file_map patient;
+    struct patched_view view;
+
+    if (!eo->patient_file_path || STREQ(eo->patient_file_path, "-")
+        || map_file_read(eo->patient_file_path, &patient))
+    {
+        return -1;
+    }
+    patched_view_init_stack(&view, stack->idxs, stack->count, patient.data,
+        patient.size);
+    *crc = patched_view_crc32_delta(&view, (uint32_t)eo->patient_crc32,
+        patient.size);
+    patched_view_free(&view);
+    unmap_file(&patient);
+    return 0;
+}
+
+/**
+ * Prints and/or verifies the CRC32 of a freshly written output file, as
+ * requested by --print-crc32 and --expect-crc32. An output that doesn't match
+ * the expected CRC32 is deleted. An output streamed to stdout can't be, and
+ * its CRC32 is printed on stderr instead so as not to end up in the stream.
+ * @return EXIT_SUCCESS, or EXIT_FAILURE on a mismatch
+ */
+int check_output_crc(const struct exec_options* eo, uint32_t crc) {
+    int streamed = eo->output_file_path && STREQ(eo->output_file_path, "-");
+
+    if (eo->print_crc32) {
+        fprintf(streamed ? stderr : stdout, "%.8" PRIX32 "\n", crc);
+    }
+    if (eo->has_expected_crc32 && crc != (uint32_t)eo->expected_crc32) {
+        fprintf(stderr, "error: output CRC32 %.8" PRIX32 " does not match"
+            " expected %.8" PRIX32 "%s\n", crc, (uint32_t)eo->expected_crc32,
+            streamed ? "" : "; deleting output");
+        if (!streamed && remove(eo->output_file_path)) {
+            fprintf(stderr, "error: unable to delete output file: %s\n",
+                strerror(errno));
+        }
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Applies a stack of indexed patches to the patient file itself rather than a
+ * copy, so only the patched bytes are written. Whatever the patches overwrite
+ * or cut off is saved to an undo journal first (see journal.h), which is
+ * removed once the patient is fully written and synced. With --sparse, long
+ * zero fills are punched out of the patient rather than written.
+ *
+ * If compute_crc is non-NULL, it receives the CRC32 of the result, which is
+ * worked out from the patient and patches before anything is written. If crc
+ * (the computed or an already known CRC32) doesn't match --expect-crc32, the
+ * patient is left alone.
+ */
+int patch_apply_in_place(
+    struct exec_options* eo,
+    const struct patch_stack* stack,
+    uint32_t* compute_crc,
+    const uint32_t* crc)
+{
+    struct file_map patient;
+    struct patched_view view;
+    struct overlay ov;
+    FILE* f = NULL;
+    char* journal = journal_path(eo->patient_file_path);
+    size_t calls = 0;
+
+    if ((f = fopen(journal, "rb"))) {
+        fclose(f);
+        fprintf(stderr, "error: %s is left over from an interrupted in-place"
+            " apply; run `ipsa recover` on the patient first\n", journal);
+        free(journal);
+        return EXIT_FAILURE;
+    }
+    if (map_file_read(eo->patient_file_path, &patient)) {
+        fprintf(stderr, "error: failed to map patient file\n");
+        free(journal);
+        return EXIT_FAILURE;
+    }
+    patched_view_init_stack(&view, stack->idxs, stack->count, patient.data,
+        patient.size);
+
+    if (compute_crc) {
+        *compute_crc = CRC32_BASE;
+        patched_view_apply(&view, NULL, compute_crc);
+        *compute_crc = crc32_finalize(*compute_crc);
+    }
+    if (crc && eo->has_expected_crc32 && *crc != (uint32_t)eo->expected_crc32) {
+        fprintf(stderr, "error: output CRC32 %.8" PRIX32 " does not match"
+            " expected %.8" PRIX32 "; patient left unchanged\n",
+            *crc, (uint32_t)eo->expected_crc32);
+        patched_view_free(&view);
+        unmap_file(&patient);
+        free(journal);
+        return EXIT_FAILURE;
+    }
+
+    overlay_build(&ov, view.overlay.extents, view.overlay.count);
+    overlay_zero_cut(&ov, patient.size, view.patient_size, view.size);
+
+    /* both are taken from the patient before any of it is overwritten */
+    if (eo->undo_file_path && write_undo_patch(eo, &ov, patient.data,
+        patient.size, view.patient_size, view.size))
+    {
+        goto ERROR;
+    }
+    if (journal_save(journal, patient.data, patient.size, &ov, view.size)) {
+        fprintf(stderr, "error: failed to write undo journal %s\n", journal);
+        goto ERROR;
+    }
+
+    if (!(f = fopen(eo->patient_file_path, "r+b"))
+        || write_overlay(f, &ov, eo->sparse, &calls)
+        || (stack->truncates && truncate_file(f, view.size))
+        || sync_file(f) || fclose(f))
+    {
+        fprintf(stderr, "error: failed while writing the patient; `ipsa"
+            " recover -f %s` restores it from %s\n", eo->patient_file_path,
+            journal);
+        goto ERROR;
+    }
+    print_write_stats(eo, stack->hunk_count, &ov, calls);
+
+    if (journal_discard(journal)) {
+        fprintf(stderr, "warning: unable to remove undo journal %s\n",
+            journal);
+    }
+
+    overlay_free(&ov);
+    patched_view_free(&view);
+    unmap_file(&patient);
+    free(journal);
+    return EXIT_SUCCESS;
+
+ERROR:
+    overlay_free(&ov);
+    patched_view_free(&view);
+    unmap_file(&patient);
+    free(journal);
+    return EXIT_FAILURE;
+}
+
+/**
+ * Applies the patches given with -p while they are still being read (see
+ * pipeline.h), rather than loading and validating them all first. The patient
+ * is copied to the output, then the patches are written over it in patch
+ * order. A patch that turns out to be malformed partway through would leave
+ * the output half patched, so the output is deleted. If crc is non-NULL, it
+ * receives the CRC32 of the output, which is read back for it.
+ */
+int patch_apply_pipeline(const struct exec_options* eo, uint32_t* crc) {
+    size_t count = eo->patch_count ? (size_t)eo->patch_count : 1;
+    FILE** patches = xmalloc(count * sizeof(*patches));
+    FILE* patient_file = NULL;
+    FILE* output_file = NULL;
+    struct pipeline_report report;
+    int copy_strategy = COPY_STRATEGY_NONE;
+    int code = PIPELINE_CODE_OK;
+    size_t opened = 0;
+    size_t i;
+
+    for (opened = 0; opened < count; opened++) {
+        const char* path = eo->patch_count
+            ? eo->patch_file_paths[opened] : NULL;
+        if (!(patches[opened] = fopen_patch(path))) {
+            fprintf(stderr, "error: failed to read patch file%s%s\n",
+                path ? " " : "", path ? path : "");
+            goto ERROR;
+        }
+    }
+    if (!(patient_file = fopen_patient(eo->patient_file_path))) {
+        fprintf(stderr, "error: failed to open patient file\n");
+        goto ERROR;
+    }
+    output_file = crc ? fopen_output_readable(eo->output_file_path)
+        : fopen_output(eo->output_file_path);
+    if (!output_file) {
+        fprintf(stderr, "error: failed to open output file\n");
+        goto ERROR;
+    }
+
+    if (copy_file(patient_file, output_file, &copy_strategy)) {
+        fprintf(stderr, "error: failed to copy patient data to output file\n");
+        goto ERROR;
+    }
+    print_copy_strategy(eo, copy_strategy);
+
+    code = pipeline_apply(patches, count, output_file, eo->respect_post_trunc,
+        &report);
+    if (code == PIPELINE_CODE_PATCH) {
+        fprintf(stderr, "error: %s: %s\n", eo->patch_count
+            ? eo->patch_file_paths[report.patch] : "-",
+            PATCH_CODE_STR[report.patch_code]);
+        goto ERROR;
+    } else if (code == PIPELINE_CODE_READ) {
+        fprintf(stderr, "error: failed to read patch file %s\n",
+            eo->patch_count ? eo->patch_file_paths[report.patch] : "-");
+        goto ERROR;
+    } else if (code) {
+        fprintf(stderr, "error: while writing hunk payload: %s\n",
+            FILE_CODE_STR[FILE_CODE_ERROR]);
+        goto ERROR;
+    }
+    if (eo->verbose) {
+        fprintf(stderr, "info: wrote %lu hunks from %lu slabs in %lu write"
+            " calls; the writer waited %lu times, the decoder %lu times\n",
+            (unsigned long)report.hunks, (unsigned long)report.slabs,
+            (unsigned long)report.calls, (unsigned long)report.writer_stalls,
+            (unsigned long)report.decoder_stalls);
+    }
+
+    if (crc && (fseek(output_file, 0, SEEK_SET)
+        || crc32_file(output_file, crc)))
+    {
+        fprintf(stderr, "error: while reading back output file: %s\n",
+            FILE_CODE_STR[FILE_CODE(output_file)]);
+        goto ERROR;
+    }
+
+    for (i = 0; i < opened; i++) {
+        fclose_check(patches[i]);
+    }
+    free(patches);
+    fclose_check(patient_file);
+    if (fclose_check(output_file)) {
+        fprintf(stderr, "error: unable to close output file\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+
+ERROR:
+    for (i = 0; i < opened; i++) {
+        fclose_check(patches[i]);
+    }
+    free(patches);
+    fclose_check(patient_file);
+    if (output_file) {
+        fclose_check(output_file);
+        remove(eo->output_file_path);
+    }
+    return EXIT_FAILURE;
+}
+
+int subcommand_apply(struct exec_options* eo) {
+    int return_code = EXIT_FAILURE;
+    FILE* text_file = NULL;
+    FILE* patient_file = NULL;
+    FILE* output_file = NULL;
+    struct patch_stack stack;
+    uint32_t crc = 0;
+    uint32_t* want_crc = eo->print_crc32 || eo->has_expected_crc32
+        ? &crc : NULL;
+    uint32_t* engine_crc = want_crc;
+    int to_stdout = eo->output_file_path && STREQ(eo->output_file_path, "-");
+    int mappable = eo->patient_file_path && !STREQ(eo->patient_file_path, "-")
+        && eo->output_file_path && !to_stdout;
+    /* streams can't be seeked, so they are only read or written once */
+    int streaming = eo->apply_engine == APPLY_ENGINE_STREAM
+        || (eo->apply_engine == APPLY_ENGINE_AUTO && !mappable && !eo->sparse);
+    uint64_t started = 0;
+    int i;
+
+    /* text file is optional for this subcommand */
+    if (eo->text_file_path && !(text_file = fopen_text(eo->text_file_path))) {
+        fprintf(stderr, "error: failed to open text file\n");
+        return EXIT_FAILURE;
+    }
+
+    if (eo->apply_engine == APPLY_ENGINE_MMAP && !mappable) {
+        fprintf(stderr, "error: the mmap engine requires patient and output"
+            " files (not streams)\n");
+        fclose_check(text_file);
+        return EXIT_FAILURE;
+    }
+    /* io_uring reads and writes at offsets, which streams don't have */
+    if (eo->apply_engine == APPLY_ENGINE_URING && !mappable) {
+        fprintf(stderr, "error: the uring engine requires patient and output"
+            " files (not streams)\n");
+        fclose_check(text_file);
+        return EXIT_FAILURE;
+    }
+    /* stores through a mapping always allocate the blocks they touch */
+    if ((eo->apply_engine == APPLY_ENGINE_MMAP
+        || eo->apply_engine == APPLY_ENGINE_URING
+        || eo->apply_engine == APPLY_ENGINE_STREAM) && eo->sparse)
+    {
+        fprintf(stderr, "error: only the stdio engine can write sparse"
+            " output\n");
+        fclose_check(text_file);
+        return EXIT_FAILURE;
+    }
+    /* the stdio engine hashes its output by reading it back */
+    if (to_stdout && want_crc && !streaming) {
+        fprintf(stderr, "error: only the stream engine can compute the CRC32"
+            " of output to stdout\n");
+        fclose_check(text_file);
+        return EXIT_FAILURE;
+    }
+    if (eo->in_place && (!eo->patient_file_path
+        || STREQ(eo->patient_file_path, "-") || eo->output_file_path))
+    {
+        fprintf(stderr, "error: --in-place requires a patient file and no"
+            " output file\n");
+        fclose_check(text_file);
+        return EXIT_FAILURE;
+    }
+
+    if (eo->undo_file_path && (!eo->patient_file_path
+        || STREQ(eo->patient_file_path, "-")))
+    {
+        fprintf(stderr, "error: --emit-undo requires a patient file (not a"
+            " stream)\n");
+        fclose_check(text_file);
+        return EXIT_FAILURE;
+    }
+    if (eo->undo_file_path && streaming && !eo->in_place) {
+        fprintf(stderr, "error: --emit-undo can't be combined with the stream"
+            " engine\n");
+        fclose_check(text_file);
+        return EXIT_FAILURE;
+    }
+
+    /* the patient would find stdin already drained by the patch */
+    for (i = 0; eo->patient_file_path && STREQ(eo->patient_file_path, "-")
+        && i < eo->patch_count; i++)
+    {
+        if (STREQ(eo->patch_file_paths[i], "-")) {
+            fprintf(stderr, "error: the patient and a patch can't both be"
+                " read from stdin\n");
+            fclose_check(text_file);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (eo->pipeline && (eo->in_place || eo->undo_file_path || eo->sparse
+        || text_file || to_stdout || (eo->apply_engine != APPLY_ENGINE_AUTO
+            && eo->apply_engine != APPLY_ENGINE_STDIO)))
+    {
+        fprintf(stderr, "error: --pipeline can't be combined with --in-place,"
+            " --emit-undo, --sparse, a text file, output to stdout or engines"
+            " other than stdio\n");
+        fclose_check(text_file);
+        return EXIT_FAILURE;
+    }
+
+    /* pipelined patches are decoded as they are applied instead */
+    if (eo->pipeline) {
+        memset(&stack, 0, sizeof(stack));
+        if (want_crc) {
+            crc32_init();
+        }
+        started = monotonic_ns();
+        return_code = patch_apply_pipeline(eo, want_crc);
+        goto CLEANUP;
+    }
+
+    /* decode and validate the whole patch before touching the output; its
+       records are only needed to print them */
+    if (load_patches(eo, &stack, !text_file)) {
+        fclose_check(text_file);
+        return EXIT_FAILURE;
+    }
+    print_patch_stack(text_file, &stack);
+    /* undo journals carry a CRC32 too */
+    if (want_crc || eo->in_place) {
+        crc32_init();
+    }
+
+    /* with a known patient CRC32, the engine doesn't need to hash anything */
+    if (want_crc && eo->has_patient_crc32) {
+        if (!output_crc_from_patient(eo, &stack, &crc)) {
+            engine_crc = NULL;
+        } else if (eo->verbose) {
+            fprintf(stderr, "info: can't map patient; hashing the whole"
+                " output instead of using --patient-crc32\n");
+        }
+    }
+
+    /* the engines are timed so that they can be compared with --verbose */
+    started = monotonic_ns();
+    if (eo->in_place) {
+        return_code = patch_apply_in_place(eo, &stack, engine_crc, want_crc);
+        goto CLEANUP;
+    }
+    if (streaming) {
+        return_code = patch_apply_stream(eo, &stack, engine_crc);
+        goto CLEANUP;
+    }
+
+    if (eo->undo_file_path && emit_undo_patch(eo, &stack)) {
+        goto ERROR;
+    }
+
+    if (eo->apply_engine == APPLY_ENGINE_URING) {
+        return_code = patch_apply_uring(eo, &stack, engine_crc);
+        if (return_code != URING_UNAVAILABLE) {
+            goto CLEANUP;
+        } else if (eo->verbose) {
+            fprintf(stderr, "info: io_uring is unavailable; using the stdio"
+                " engine\n");
+        }
+    } else if (mappable && eo->apply_engine != APPLY_ENGINE_STDIO
+        && !eo->sparse)
+    {
+        return_code = patch_apply_mapped(eo, &stack, engine_crc);
+        if (return_code != MAPPED_UNAVAILABLE) {
+            goto CLEANUP;
+        } else if (eo->apply_engine == APPLY_ENGINE_MMAP) {
+            fprintf(stderr, "error: failed to map files for the mmap"
+                " engine\n");
+            goto ERROR;
+        }
+    }
+
+    if (!(patient_file = fopen_patient(eo->patient_file_path))) {
+        fprintf(stderr, "error: failed to open patient file\n");
+        goto ERROR;
+    }
+
+    output_file = engine_crc ? fopen_output_readable(eo->output_file_path)
+        : fopen_output(eo->output_file_path);
+    if (!output_file) {
+        fprintf(stderr, "error: failed to open output file\n");
+        goto ERROR;
+    }
+
+    return_code = patch_apply_stdio(eo, &stack, patient_file, output_file,
+        engine_crc);
+
+    fclose_check(patient_file);
+    patient_file = NULL;
+
+    if (fclose_check(output_file)) {
+        output_file = NULL;
+        fprintf(stderr, "error: unable to close output file\n");
+        goto ERROR;
+    }
+    output_file = NULL;
+
+CLEANUP:
+    if (eo->verbose && return_code == EXIT_SUCCESS) {
+        fprintf(stderr, "info: applied in %.3f ms\n",
+            (double)(monotonic_ns() - started) / 1e6);
+    }
+    free_patches(&stack);
+    if (fclose_check(text_file)) {
+        fprintf(stderr, "error: unable to close text file\n");
+        return_code = EXIT_FAILURE;
+    }
+    if (return_code == EXIT_SUCCESS && want_crc) {
+        return_code = check_output_crc(eo, crc);
+    }
+    return return_code;
+
+ERROR:
+    free_patches(&stack);
+    fclose_check(patient_file);
+    fclose_check(text_file);
+    fclose_check(output_file);
+    if (eo->has_expected_crc32 && output_file && !to_stdout) {
+        remove(eo->output_file_path);
+    }
+    return EXIT_FAILURE;
+}
+
+int subcommand_text(struct exec_options* eo) {
+    FILE* text_file = NULL;
+    struct patch_stack stack;
+
+    if (load_patches(eo, &stack, 0)) {
+        return EXIT_FAILURE;
+    }
+
+    if (!(text_file = fopen_text(eo->text_file_path))) {
+        fprintf(stderr, "error: failed to open text file\n");
+        goto ERROR;
+    }
+
+    print_patch_stack(text_file, &stack);
+
+    free_patches(&stack);
+
+    if (fclose_check(text_file)) {
+        fprintf(stderr, "error: unable to close text file\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+
+ERROR:
+    free_patches(&stack);
+    return EXIT_FAILURE;
+}
+
+int subcommand_cat(struct exec_options* eo) {
+    const size_t buflen = (size_t)1 << 20;
+    unsigned char* buf = NULL;
+    FILE* output_file = NULL;
+    struct patch_stack stack;
+    struct file_map patient;
+    struct patched_view view;
+    size_t offset = 0;
+    size_t end = 0;
+
+    if (load_patches(eo, &stack, 1)) {
+        return EXIT_FAILURE;
+    }
+    if (load_input(eo->patient_file_path, &patient)) {
+        fprintf(stderr, "error: failed to read patient file\n");
+        free_patches(&stack);
+        return EXIT_FAILURE;
+    }
+    patched_view_init_stack(&view, stack.idxs, stack.count, patient.data,
+        patient.size);
+
+    if (eo->has_range) {
+        offset = eo->range_start < view.size ? eo->range_start : view.size;
+        end = view.size - offset < eo->range_length
+            ? view.size : offset + eo->range_length;
+    } else {
+        end = view.size;
+    }
+
+    output_file = eo->output_file_path
+        ? fopen_output(eo->output_file_path) : stdout;
+    if (!output_file) {
+        fprintf(stderr, "error: failed to open output file\n");
+        goto ERROR;
+    }
+
+    buf = xmalloc(buflen);
+    while (offset < end) {
+        size_t n = patched_view_read(&view, offset,
+            end - offset < buflen ? end - offset : buflen, buf);
+        if (fwrite(buf, 1, n, output_file) < n) {
+            fprintf(stderr, "error: while writing output: %s\n",
+                FILE_CODE_STR[FILE_CODE(output_file)]);
+            goto ERROR;
+        }
+        offset += n;
+    }
+
+    free(buf);
+    buf = NULL;
+    if (fclose_check(output_file) || (output_file == stdout && fflush(stdout))) {
+        output_file = NULL;
+        fprintf(stderr, "error: unable to close output file\n");
+        goto ERROR;
+    }
+
+    patched_view_free(&view);
+    unmap_file(&patient);
+    free_patches(&stack);
+    return EXIT_SUCCESS;
+
+ERROR:
+    free(buf);
+    fclose_check(output_file);
+    patched_view_free(&view);
+    unmap_file(&patient);
+    free_patches(&stack);
+    return EXIT_FAILURE;
+}
+
+/**
+ * Merges the patches given with -p into one patch that does the same as
+ * applying them in order, and writes it to the output file.
+ */
+int subcommand_merge(struct exec_options* eo) {
+    struct patch_stack stack;
+    struct patch_writer w;
+    struct overlay ov;
+    size_t size = 0;
+    size_t kept = 0;
+    size_t in_size = 0;
+    long cut = -1;
+    int code = 0;
+    size_t i;
+
+    if (!eo->output_file_path) {
+        fprintf(stderr, "error: merge requires an output file\n");
+        return EXIT_FAILURE;
+    }
+    if (load_patches(eo, &stack, 1)) {
+        return EXIT_FAILURE;
+    }
+
+    /* none of this depends on the patient: once any patch truncates, the
+       final size is set by the last truncation and the writes after it */
+    overlay_build_stack(&ov, stack.idxs, stack.count, 0, &size, &kept);
+    for (i = 0; i < stack.count; i++) {
+        int trunc_length = stack.idxs[i].trunc_length;
+        if (trunc_length >= 0 && (cut < 0 || trunc_length < cut)) {
+            cut = trunc_length;
+        }
+        in_size += stack.maps[i].size;
+    }
+
+    /* patient bytes past the first cut read as zeros wherever the image grows
+       back over them, so one patch has to write those zeros itself */
+    if (cut >= 0 && (size_t)cut < size) {
+        overlay_fill_under(&ov, (size_t)cut, size - (size_t)cut, 0);
+    }
+
+    code = patch_encode(&w, &ov, NULL, 0, stack.truncates ? (long)size : -1);
+    overlay_free(&ov);
+    if (code) {
+        fprintf(stderr, "error: %s\n", ENCODE_CODE_STR[code]);
+        free_patches(&stack);
+        return EXIT_FAILURE;
+    }
+
+    if (write_encoded_patch(eo->output_file_path, &w)) {
+        patch_writer_free(&w);
+        free_patches(&stack);
+        return EXIT_FAILURE;
+    }
+
+    if (eo->verbose) {
+        fprintf(stderr, "info: merged %lu patches (%lu hunks, %lu bytes) into"
+            " %lu hunks, %lu bytes\n", (unsigned long)stack.count,
+            (unsigned long)stack.hunk_count, (unsigned long)in_size,
+            (unsigned long)w.hunk_count, (unsigned long)w.size);
+    }
+    patch_writer_free(&w);
+    free_patches(&stack);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Rewrites the patches given with -p as the smallest patch that turns the
+ * patient into the same output: bytes the patch writes unchanged are
+ * dropped, and what is left is re-encoded against the patient.
+ */
+int subcommand_optimize(struct exec_options* eo) {
+    struct patch_stack stack;
+    struct file_map patient;
+    struct patched_view view;
+    struct patch_writer w;
+    struct overlay ov;
+    size_t base_size = 0;
+    size_t in_size = 0;
+    size_t i;
+    int code = 0;
+
+    if (!eo->output_file_path) {
+        fprintf(stderr, "error: optimize requires an output file\n");
+        return EXIT_FAILURE;
+    }
+    /* the patches' own sizes are reported against the result */
+    if (load_patches(eo, &stack, 0)) {
+        return EXIT_FAILURE;
+    }
+    if (load_input(eo->patient_file_path, &patient)) {
+        fprintf(stderr, "error: failed to read patient file\n");
+        free_patches(&stack);
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < stack.count; i++) {
+        in_size += stack.maps[i].size;
+    }
+
+    patched_view_init_stack(&view, stack.idxs, stack.count, patient.data,
+        patient.size);
+    base_size = patient.size < view.size ? patient.size : view.size;
+
+    /* applied in one go, the patch sees the patient up to the output size,
+       so anything a stack cut off before that has to be zeroed explicitly */
+    overlay_build(&ov, view.overlay.extents, view.overlay.count);
+    overlay_zero_cut(&ov, patient.size, view.patient_size, view.size);
+    overlay_drop_unchanged(&ov, patient.data, base_size);
+
+    /* without a truncation, the output size comes from the last byte written,
+       which has to stay even if it writes a zero that is already there */
+    if (!stack.truncates && view.size > base_size
+        && (!ov.count || ov.extents[ov.count - 1].offset
+            + ov.extents[ov.count - 1].length < view.size))
+    {
+        const struct extent* last =
+            &view.overlay.extents[view.overlay.count - 1];
+        size_t count = ov.count + 1;
+        struct extent* writes = xmalloc(count * sizeof(*writes));
+        if (ov.count) {
+            memcpy(writes, ov.extents, ov.count * sizeof(*writes));
+        }
+        writes[ov.count] = *last;
+        writes[ov.count].offset = view.size - 1;
+        writes[ov.count].length = 1;
+        if (last->fill < 0) {
+            writes[ov.count].data = last->data + (last->length - 1);
+        }
+        overlay_free(&ov);
+        overlay_build(&ov, writes, count);
+        free(writes);
+    }
+
+    code = patch_encode(&w, &ov, patient.data, base_size,
+        stack.truncates ? (long)view.size : -1);
+    overlay_free(&ov);
+    patched_view_free(&view);
+    if (code) {
+        fprintf(stderr, "error: %s\n", ENCODE_CODE_STR[code]);
+        unmap_file(&patient);
+        free_patches(&stack);
+        return EXIT_FAILURE;
+    }
+
+    code = write_encoded_patch(eo->output_file_path, &w);
+    if (!code) {
+        printf("%lu hunks, %lu bytes -> %lu hunks, %lu bytes\n",
+            (unsigned long)stack.hunk_count, (unsigned long)in_size,
+            (unsigned long)w.hunk_count, (unsigned long)w.size);
+    }
+    patch_writer_free(&w);
+    unmap_file(&patient);
+    free_patches(&stack);
+    return code ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Writes a patch that turns the patient (the original) into the modified
+ * file. A modified file shorter than the original gets a truncation length.
+ */
+int subcommand_diff(struct exec_options* eo) {
+    struct file_map original;
+    struct file_map modified;
+    struct patch_writer w;
+    struct overlay ov;
+    int code = 0;
+
+    if (!eo->output_file_path || !eo->modified_file_path) {
+        fprintf(stderr, "error: diff requires modified and output files\n");
+        return EXIT_FAILURE;
+    }
+
+    diff_init();
+    if (eo->compare_kernel && diff_select_kernel(eo->compare_kernel)) {
+        fprintf(stderr, "error: compare kernel %s is not available\n",
+            eo->compare_kernel);
+        return EXIT_FAILURE;
+    }
+    if (eo->verbose) {
+        fprintf(stderr, "info: using compare kernel %s\n", diff_kernel_name());
+    }
+
+    if (load_input(eo->patient_file_path, &original)) {
+        fprintf(stderr, "error: failed to read patient file\n");
+        return EXIT_FAILURE;
+    }
+    if (load_input(eo->modified_file_path, &modified)) {
+        fprintf(stderr, "error: failed to read modified file\n");
+        unmap_file(&original);
+        return EXIT_FAILURE;
+    }
+
+    diff_build(&ov, original.data, original.size, modified.data,
+        modified.size, eo->jobs);
+    code = patch_encode(&w, &ov, original.data,
+        original.size < modified.size ? original.size : modified.size,
+        modified.size < original.size ? (long)modified.size : -1);
+    overlay_free(&ov);
+    if (code) {
+        fprintf(stderr, "error: %s\n", ENCODE_CODE_STR[code]);
+        unmap_file(&modified);
+        unmap_file(&original);
+        return EXIT_FAILURE;
+    }
+
+    code = write_encoded_patch(eo->output_file_path, &w);
+    if (!code && eo->verbose) {
+        fprintf(stderr, "info: wrote %lu hunks, %lu bytes\n",
+            (unsigned long)w.hunk_count, (unsigned long)w.size);
+    }
+    patch_writer_free(&w);
+    unmap_file(&modified);
+    unmap_file(&original);
+    return code ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int subcommand_crc32(const struct exec_options* eo) {
+    FILE* patient_file = NULL;
+    uint32_t crc = 0;
+
+    if (!(patient_file = fopen_patient(eo->patient_file_path))) {
+        fprintf(stderr, "error: failed to open patient file\n");
+        goto ERROR;
+    }
+
+    crc32_init();
+    if (eo->crc32_kernel && crc32_select_kernel(eo->crc32_kernel)) {
+        fprintf(stderr, "error: CRC32 kernel %s is not available\n",
+            eo->crc32_kernel);
+        goto ERROR;
+    }
+    if (eo->verbose) {
+        fprintf(stderr, "info: using CRC32 kernel %s\n", crc32_kernel_name());
+    }
+
+    /* regular files can be split between several threads */
+    if (eo->jobs > 1) {
+        int code = crc32_file_parallel(patient_file, eo->jobs, &crc);
+        if (code < 0) {
+            fprintf(stderr, "error: while reading patient file: %s\n",
+                FILE_CODE_STR[FILE_CODE_ERROR]);
+            goto ERROR;
+        } else if (code == 0) {
+            printf("%.8" PRIX32 "\n", crc);
+            fclose_check(patient_file);
+            return EXIT_SUCCESS;
+        }
+        if (eo->verbose) {
+            fprintf(stderr, "info: patient is not a regular file;"
+                " hashing with one job\n");
+        }
+    }
+
+    if (crc32_file(patient_file, &crc)) {
+        fprintf(stderr, "error: while reading patient file: %s\n",
+            FILE_CODE_STR[FILE_CODE(patient_file)]);
+        goto ERROR;
+    }
+
+    printf("%.8" PRIX32 "\n", crc);
+
+    fclose_check(patient_file);
+    return EXIT_SUCCESS;
+
+ERROR:
+    fclose_check(patient_file);
+    return EXIT_FAILURE;
+}
+
+/**
+ * Prints the digests chosen with --algo (by default all of them) of each file
+ * in the NULL-terminated list paths, or of the patient if it is empty. With
+ * one digest the output is that of sha256sum and friends; with several, it is
+ * their --tag output, one line per digest.
+ */
+int subcommand_hash(const struct exec_options* eo, char** paths) {
+    const char* list = eo->digest_list
+        ? eo->digest_list : "crc32,md5,sha1,sha256";
+    unsigned char values[DIGEST_COUNT][DIGEST_SIZE_MAX];
+    int algos[DIGEST_COUNT];
+    int count = digest_parse_list(list, algos);
+    int exit_code = EXIT_SUCCESS;
+    char* patient[2];
+
+    if (count < 0) {
+        fprintf(stderr, "error: unknown digest in %s; choose from crc32, md5,"
+            " sha1 and sha256\n", list);
+        return EXIT_FAILURE;
+    }
+    if (!*paths) {
+        if (!eo->patient_file_path) {
+            fprintf(stderr, "error: no file to hash\n");
+            return EXIT_FAILURE;
+        }
+        patient[0] = eo->patient_file_path;
+        patient[1] = NULL;
+        paths = patient;
+    }
+
+    crc32_init();
+    if (eo->crc32_kernel && crc32_select_kernel(eo->crc32_kernel)) {
+        fprintf(stderr, "error: CRC32 kernel %s is not available\n",
+            eo->crc32_kernel);
+        return EXIT_FAILURE;
+    }
+
+    for (; *paths; paths++) {
+        int i;
+        if (digest_file(*paths, algos, (size_t)count, eo->jobs, values)) {
+            fprintf(stderr, "error: can't read %s\n", *paths);
+            exit_code = EXIT_FAILURE;
+            continue;
+        }
+        for (i = 0; i < count; i++) {
+            size_t k;
+            if (count > 1) {
+                printf("%s (%s) = ", DIGEST_TAG[algos[i]], *paths);
+            }
+            for (k = 0; k < DIGEST_SIZE[algos[i]]; k++) {
+                printf("%.2x", values[i][k]);
+            }
+            if (count > 1) {
+                printf("\n");
+            } else {
+                printf("  %s\n", *paths);
+            }
+        }
+    }
+    return exit_code;
+}
+
+/**
+ * Puts a patient back the way it was before an interrupted in-place apply,
+ * using the undo journal that apply left behind.
+ */
+int subcommand_recover(const struct exec_options* eo) {
+    char* journal = NULL;
+    int code = 0;
+
+    if (!eo->patient_file_path || STREQ(eo->patient_file_path, "-")) {
+        fprintf(stderr, "error: recover requires a patient file\n");
+        return EXIT_FAILURE;
+    }
+
+    crc32_init();
+    journal = journal_path(eo->patient_file_path);
+    code = journal_recover(journal, eo->patient_file_path);
+    if (code < 0) {
+        fprintf(stderr, "error: failed to restore %s from %s\n",
+            eo->patient_file_path, journal);
+    } else if (code == JOURNAL_RESTORED) {
+        printf("restored %s from %s\n", eo->patient_file_path, journal);
+    } else if (code == JOURNAL_DISCARDED) {
+        printf("removed incomplete journal %s; %s was never modified\n",
+            journal, eo->patient_file_path);
+    } else {
+        printf("no journal found for %s\n", eo->patient_file_path);
+    }
+    free(journal);
+    return code < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int run_subcommand(
+    struct exec_options* eo,
+    char** argv,
+    const char* subcommand)
+{
+    int exit_code = EXIT_SUCCESS;
+    if (STREQ(subcommand, "apply")) {
+        exit_code = subcommand_apply(eo);
+    } else if (STREQ(subcommand, "text")) {
+        exit_code = subcommand_text(eo);
+    } else if (STREQ(subcommand, "crc32")) {
+        exit_code = subcommand_crc32(eo);
+    } else if (STREQ(subcommand, "hash")) {
+        exit_code = subcommand_hash(eo, argv + eo->final_optind + 1);
+    } else if (STREQ(subcommand, "cat")) {
+        exit_code = subcommand_cat(eo);
+    } else if (STREQ(subcommand, "merge")) {
+        exit_code = subcommand_merge(eo);
+    } else if (STREQ(subcommand, "optimize")) {
+        exit_code = subcommand_optimize(eo);
+    } else if (STREQ(subcommand, "diff")) {
+        exit_code = subcommand_diff(eo);
+    } else if (STREQ(subcommand, "recover")) {
+        exit_code = subcommand_recover(eo);
+    } else if (STREQ(subcommand, "batch")) {
+        char* manifest = argv[eo->final_optind + 1];
+        if (!manifest) {
+            fprintf(stderr, "%s\n", "No manifest given."
+                " Use `ipsa batch MANIFEST`.");
+            exit_code = EXIT_FAILURE;
+        } else {
+            exit_code = batch_run(eo, manifest);
+        }
+    }
+    return exit_code;
+}
+
+static int run_served(int argc, char** argv);
+
+/**
+ * Parses and runs one command line. served is nonzero when it came from a
+ * client of `ipsa serve`, which must run it here rather than forward it.
+ */
+static int run_command(int argc, char** argv, int served) {
+    struct exec_options* eo = NULL;
+    int exit_code = EXIT_SUCCESS;
+
+    eo = parse_exec_options(argc, argv);
+    if (!eo->parse_success) {
+        fprintf(stderr, "%s\n", "Error parsing options."
+            " Use `ipsa --help` to view help.");
+        exit_code = EXIT_FAILURE;
+    } else if (eo->help) {
         printf(
             "%s - %s\n",
             "ipsa - IPS patcher utility",
@@ -529,15 +1963,35 @@ int main(int argc, char** argv) {
             fprintf(stderr, "%s\n", "No subcommand given."
                 " Use `ipsa --help` to view help.");
             exit_code = EXIT_FAILURE;
-        } else if (STREQ(subcommand, "apply")) {
-            exit_code = subcommand_apply(eo);
-        } else if (STREQ(subcommand, "text")) {
-            exit_code = subcommand_text(eo);
-        } else if (STREQ(subcommand, "crc32")) {
-            exit_code = subcommand_crc32(eo);
+        } else if (STREQ(subcommand, "serve")) {
+            if (served) {
+                fprintf(stderr, "error: can't serve from a served request\n");
+                exit_code = EXIT_FAILURE;
+            } else {
+                exit_code = serve_run(eo, run_served);
+            }
+        } else if (eo->socket_path && !served) {
+            exit_code = serve_request(eo->socket_path, argc, argv);
+            if (exit_code < 0) {
+                if (eo->verbose) {
+                    fprintf(stderr, "info: no server listening on %s;"
+                        " running here\n", eo->socket_path);
+                }
+                exit_code = run_subcommand(eo, argv, subcommand);
+            }
+        } else {
+            exit_code = run_subcommand(eo, argv, subcommand);
         }
     }
 
     free_exec_options(eo);
     return exit_code;
 }
+
+static int run_served(int argc, char** argv) {
+    return run_command(argc, argv, 1);
+}
+
+int main(int argc, char** argv) {
+    return run_command(argc, argv, 0);
+}
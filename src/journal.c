@@ -0,0 +1,246 @@
+#include "journal.h"
+#include "util.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A journal is, with all integers big-endian:
+ *
+ *     "IPSAJRNL"  size of the patient (8 bytes)
+ *     records:    offset (8 bytes)  length (4 bytes)  saved bytes
+ *     end:        offset 0xFFFFFFFFFFFFFFFF
+ *     CRC32 of everything before it (4 bytes)
+ *
+ * A journal that doesn't end in a matching CRC32 was cut short by a crash
+ * before the patient was touched.
+ */
+static const char JOURNAL_MAGIC[] = "IPSAJRNL";
+
+#define JOURNAL_MAGIC_WIDTH 8
+#define JOURNAL_SIZE_WIDTH 8
+#define JOURNAL_OFFSET_WIDTH 8
+#define JOURNAL_LENGTH_WIDTH 4
+#define JOURNAL_CRC_WIDTH 4
+
+/* saved runs are split into records of at most this many bytes */
+#define JOURNAL_RECORD_MAX ((size_t)1 << 20)
+
+#define JOURNAL_SUFFIX ".ipsa-journal"
+
+char* journal_path(const char* patient_path) {
+    size_t len = strlen(patient_path);
+    char* ret = xmalloc(len + sizeof(JOURNAL_SUFFIX));
+    memcpy(ret, patient_path, len);
+    memcpy(ret + len, JOURNAL_SUFFIX, sizeof(JOURNAL_SUFFIX));
+    return ret;
+}
+
+/* writes the patient bytes [start, end) as records */
+static int journal_put_run(
+    FILE* f,
+    uint32_t* crc,
+    const unsigned char* patient,
+    size_t start,
+    size_t end)
+{
+    while (start < end) {
+        unsigned char header[JOURNAL_OFFSET_WIDTH + JOURNAL_LENGTH_WIDTH];
+        size_t n = end - start < JOURNAL_RECORD_MAX
+            ? end - start : JOURNAL_RECORD_MAX;
+        encode_big_endian_n(header, start, JOURNAL_OFFSET_WIDTH);
+        encode_big_endian_n(header + JOURNAL_OFFSET_WIDTH, n,
+            JOURNAL_LENGTH_WIDTH);
+        if (crc32_fwrite(f, crc, header, sizeof(header))
+            || crc32_fwrite(f, crc, patient + start, n))
+        {
+            return -1;
+        }
+        start += n;
+    }
+    return 0;
+}
+
+int journal_save(
+    const char* path,
+    const unsigned char* patient,
+    size_t patient_size,
+    const struct overlay* ov,
+    size_t new_size)
+{
+    unsigned char buf[JOURNAL_MAGIC_WIDTH + JOURNAL_SIZE_WIDTH];
+    uint32_t crc = CRC32_BASE;
+    FILE* f = NULL;
+    size_t i;
+
+    if (!(f = fopen(path, "wb"))) {
+        return -1;
+    }
+
+    memcpy(buf, JOURNAL_MAGIC, JOURNAL_MAGIC_WIDTH);
+    encode_big_endian_n(buf + JOURNAL_MAGIC_WIDTH, patient_size,
+        JOURNAL_SIZE_WIDTH);
+    if (crc32_fwrite(f, &crc, buf, sizeof(buf))) {
+        goto ERROR;
+    }
+
+    /* only bytes that exist in the patient can be overwritten */
+    for (i = 0; i < ov->count; i++) {
+        const struct extent* ext = &ov->extents[i];
+        size_t end = ext->offset + ext->length;
+        if (ext->offset >= patient_size) {
+            break;
+        }
+        if (journal_put_run(f, &crc, patient, ext->offset,
+            end < patient_size ? end : patient_size))
+        {
+            goto ERROR;
+        }
+    }
+    if (new_size < patient_size
+        && journal_put_run(f, &crc, patient, new_size, patient_size))
+    {
+        goto ERROR;
+    }
+
+    memset(buf, 0xFF, JOURNAL_OFFSET_WIDTH);
+    if (crc32_fwrite(f, &crc, buf, JOURNAL_OFFSET_WIDTH)) {
+        goto ERROR;
+    }
+    encode_big_endian_n(buf, crc32_finalize(crc), JOURNAL_CRC_WIDTH);
+    if (fwrite(buf, 1, JOURNAL_CRC_WIDTH, f) < JOURNAL_CRC_WIDTH
+        || sync_file(f))
+    {
+        goto ERROR;
+    }
+
+    if (fclose(f)) {
+        f = NULL;
+        goto ERROR;
+    }
+    return sync_parent_dir(path);
+
+ERROR:
+    if (f) {
+        fclose(f);
+    }
+    remove(path);
+    return -1;
+}
+
+/**
+ * Checks that a whole journal is intact.
+ * @return the offset of its end marker, or 0 if it is incomplete
+ */
+static size_t journal_check(const unsigned char* data, size_t size) {
+    const size_t header = JOURNAL_OFFSET_WIDTH + JOURNAL_LENGTH_WIDTH;
+    size_t pos = JOURNAL_MAGIC_WIDTH + JOURNAL_SIZE_WIDTH;
+
+    if (size < pos + JOURNAL_OFFSET_WIDTH + JOURNAL_CRC_WIDTH
+        || !MEMEQ(data, JOURNAL_MAGIC, JOURNAL_MAGIC_WIDTH))
+    {
+        return 0;
+    }
+    for (;;) {
+        size_t length = 0;
+        if (size - pos < JOURNAL_OFFSET_WIDTH + JOURNAL_CRC_WIDTH) {
+            return 0;
+        }
+        if (decode_big_endian_n(data + pos, JOURNAL_OFFSET_WIDTH)
+            == (uint64_t)-1)
+        {
+            break;
+        }
+        if (size - pos < header) {
+            return 0;
+        }
+        length = (size_t)decode_big_endian_n(data + pos + JOURNAL_OFFSET_WIDTH,
+            JOURNAL_LENGTH_WIDTH);
+        if (size - pos - header < length) {
+            return 0;
+        }
+        pos += header + length;
+    }
+
+    if (size - pos != JOURNAL_OFFSET_WIDTH + JOURNAL_CRC_WIDTH
+        || crc32_quick((void*)data, pos + JOURNAL_OFFSET_WIDTH)
+            != decode_big_endian_n(data + pos + JOURNAL_OFFSET_WIDTH,
+                JOURNAL_CRC_WIDTH))
+    {
+        return 0;
+    }
+    return pos;
+}
+
+/* writes every record of an intact journal back into the patient */
+static int journal_restore(
+    const unsigned char* data,
+    size_t end,
+    const char* patient_path)
+{
+    const size_t header = JOURNAL_OFFSET_WIDTH + JOURNAL_LENGTH_WIDTH;
+    uint64_t patient_size = decode_big_endian_n(data + JOURNAL_MAGIC_WIDTH,
+        JOURNAL_SIZE_WIDTH);
+    size_t pos = JOURNAL_MAGIC_WIDTH + JOURNAL_SIZE_WIDTH;
+    FILE* f = NULL;
+
+    if (!(f = fopen(patient_path, "r+b"))) {
+        return -1;
+    }
+    while (pos < end) {
+        struct write_span span;
+        uint64_t offset = decode_big_endian_n(data + pos, JOURNAL_OFFSET_WIDTH);
+        span.length = (size_t)decode_big_endian_n(
+            data + pos + JOURNAL_OFFSET_WIDTH, JOURNAL_LENGTH_WIDTH);
+        span.data = data + pos + header;
+        if (write_spans_at(f, offset, &span, 1, NULL)) {
+            fclose(f);
+            return -1;
+        }
+        pos += header + span.length;
+    }
+    if (truncate_file(f, patient_size) || sync_file(f)) {
+        fclose(f);
+        return -1;
+    }
+    return fclose(f);
+}
+
+int journal_recover(const char* path, const char* patient_path) {
+    struct file_map journal;
+    FILE* f = NULL;
+    size_t end = 0;
+    int ret = JOURNAL_DISCARDED;
+
+    if (!(f = fopen(path, "rb"))) {
+        return errno == ENOENT ? JOURNAL_NONE : -1;
+    }
+    if (load_file(f, &journal)) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    if ((end = journal_check(journal.data, journal.size))) {
+        if (journal_restore(journal.data, end, patient_path)) {
+            unmap_file(&journal);
+            return -1;
+        }
+        ret = JOURNAL_RESTORED;
+    }
+    unmap_file(&journal);
+
+    if (journal_discard(path)) {
+        return -1;
+    }
+    return ret;
+}
+
+int journal_discard(const char* path) {
+    if (remove(path)) {
+        return -1;
+    }
+    return sync_parent_dir(path);
+}
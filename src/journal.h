@@ -0,0 +1,55 @@
+#ifndef JOURNAL_H_INCLUDED
+#define JOURNAL_H_INCLUDED
+
+#include "overlay.h"
+#include <stddef.h>
+
+/*******************************************************************************
+Undo journals
+An in-place apply first saves every patient byte it is about to overwrite or
+cut off to a journal next to the patient, and syncs it to disk. Only then is
+the patient written. The journal is removed once the patient is synced too,
+so a leftover journal means an apply was interrupted and the patient may be
+half-written; journal_recover() puts it back the way it was.
+*******************************************************************************/
+
+/**
+ * Returns the path of the journal for an in-place apply to patient_path
+ * (patient_path with ".ipsa-journal" appended). The result must be free()d.
+ */
+char* journal_path(const char* patient_path);
+
+/**
+ * Saves what an in-place apply of ov to the patient_size-byte patient will
+ * destroy: the patient bytes under ov and, if the result is shorter than the
+ * patient (new_size), those past new_size. The journal is on disk, along
+ * with its directory entry, when this returns.
+ * @return 0 on success or nonzero on error
+ */
+int journal_save(
+    const char* path,
+    const unsigned char* patient,
+    size_t patient_size,
+    const struct overlay* ov,
+    size_t new_size);
+
+#define JOURNAL_NONE 0          /* there is no journal */
+#define JOURNAL_DISCARDED 1     /* the journal was incomplete, so the patient
+                                   was never written; it was removed */
+#define JOURNAL_RESTORED 2      /* the patient was restored from the journal */
+
+/**
+ * Restores the patient at patient_path from the journal at path, if there is
+ * one, then removes the journal.
+ * @return a JOURNAL_* value, or a negative value on error (in which case the
+ *         journal is left in place)
+ */
+int journal_recover(const char* path, const char* patient_path);
+
+/**
+ * Removes the journal of a finished apply.
+ * @return 0 on success or nonzero on error
+ */
+int journal_discard(const char* path);
+
+#endif
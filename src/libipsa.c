@@ -0,0 +1,171 @@
+#include "ipsa.h"
+#include "patch.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char* IPSA_ERR_STR[] = {
+    "ok",
+    "unexpected EOF while detecting magic PATCH",
+    "magic PATCH not found",
+    "unexpected EOF while reading hunks",
+    "unexpected EOF while reading hunk payload",
+    "unexpected EOF while reading truncation length",
+    "out of memory",
+    "output buffer too small",
+    "invalid argument",
+    /* add new strings between these */
+    "unknown error"
+};
+
+#define IPSA_ERR_COUNT (sizeof(IPSA_ERR_STR) / sizeof(IPSA_ERR_STR[0]) - 1)
+
+const char* ipsa_strerror(int code) {
+    if (code < 0 || (size_t)code >= IPSA_ERR_COUNT) {
+        return IPSA_ERR_STR[IPSA_ERR_COUNT];
+    }
+    return IPSA_ERR_STR[code];
+}
+
+/* converts PATCH_CODE_* values to IPSA_* codes */
+static int ipsa_from_patch_code(int code) {
+    switch (code) {
+    case PATCH_CODE_OK:
+        return IPSA_OK;
+    case PATCH_CODE_MAGIC_EOF:
+        return IPSA_ERR_MAGIC_EOF;
+    case PATCH_CODE_NO_MAGIC:
+        return IPSA_ERR_NO_MAGIC;
+    case PATCH_CODE_HUNK_EOF:
+        return IPSA_ERR_HUNK_EOF;
+    case PATCH_CODE_PAYLOAD_EOF:
+        return IPSA_ERR_PAYLOAD_EOF;
+    case PATCH_CODE_TRUNC_EOF:
+        return IPSA_ERR_TRUNC_EOF;
+    default: /* PATCH_CODE_NO_MEMORY */
+        return IPSA_ERR_NO_MEMORY;
+    }
+}
+
+static int ipsa_index(
+    struct patch_index* idx,
+    const void* patch,
+    size_t patch_size,
+    int flags)
+{
+    if (!patch && patch_size) {
+        return IPSA_ERR_INVALID_ARGUMENT;
+    }
+    return ipsa_from_patch_code(patch_index_build(idx, patch, patch_size,
+        (flags & IPSA_FLAG_POST_TRUNC) != 0));
+}
+
+int ipsa_output_size(
+    size_t patient_size,
+    const void* patch,
+    size_t patch_size,
+    int flags,
+    size_t* out_size)
+{
+    struct patch_index idx;
+    int code = 0;
+
+    if (!out_size) {
+        return IPSA_ERR_INVALID_ARGUMENT;
+    }
+    if ((code = ipsa_index(&idx, patch, patch_size, flags))) {
+        return code;
+    }
+    *out_size = patch_output_size(&idx, patient_size);
+    patch_index_free(&idx);
+    return IPSA_OK;
+}
+
+/* applies an already indexed patch; out has room for the whole result */
+static void ipsa_apply_index(
+    const struct patch_index* idx,
+    const void* patient,
+    size_t patient_size,
+    unsigned char* out,
+    size_t size)
+{
+    size_t kept = patient_size < size ? patient_size : size;
+
+    /* memmove, since patching in place is allowed */
+    if (kept && out != patient) {
+        memmove(out, patient, kept);
+    }
+    memset(out + kept, 0, size - kept);
+    patch_apply_buffer(idx, out, size);
+}
+
+int ipsa_apply(
+    const void* patient,
+    size_t patient_size,
+    const void* patch,
+    size_t patch_size,
+    int flags,
+    void* out,
+    size_t out_capacity,
+    size_t* out_size)
+{
+    struct patch_index idx;
+    size_t size = 0;
+    int code = 0;
+
+    if ((!patient && patient_size) || (!out && out_capacity) || !out_size) {
+        return IPSA_ERR_INVALID_ARGUMENT;
+    }
+    if ((code = ipsa_index(&idx, patch, patch_size, flags))) {
+        return code;
+    }
+
+    size = patch_output_size(&idx, patient_size);
+    *out_size = size;
+    if (size > out_capacity) {
+        patch_index_free(&idx);
+        return IPSA_ERR_OUTPUT_TOO_SMALL;
+    }
+
+    ipsa_apply_index(&idx, patient, patient_size, out, size);
+    patch_index_free(&idx);
+    return IPSA_OK;
+}
+
+int ipsa_apply_alloc(
+    const void* patient,
+    size_t patient_size,
+    const void* patch,
+    size_t patch_size,
+    int flags,
+    void** out,
+    size_t* out_size)
+{
+    struct patch_index idx;
+    unsigned char* buf = NULL;
+    size_t size = 0;
+    int code = 0;
+
+    if ((!patient && patient_size) || !out || !out_size) {
+        return IPSA_ERR_INVALID_ARGUMENT;
+    }
+    *out = NULL;
+    if ((code = ipsa_index(&idx, patch, patch_size, flags))) {
+        return code;
+    }
+
+    size = patch_output_size(&idx, patient_size);
+    if (!(buf = malloc(size ? size : 1))) {
+        patch_index_free(&idx);
+        return IPSA_ERR_NO_MEMORY;
+    }
+
+    ipsa_apply_index(&idx, patient, patient_size, buf, size);
+    patch_index_free(&idx);
+    *out = buf;
+    *out_size = size;
+    return IPSA_OK;
+}
+
+void ipsa_free(void* p) {
+    free(p);
+}
@@ -1,6 +1,8 @@
 #include "options.h"
 #include "util.h"
+#include <ctype.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +13,28 @@
 #define LONGOPT_ID_HELP 1003
 #define LONGOPT_ID_OUTPUT_FILE 1004
 #define LONGOPT_ID_TEXT_PATH 1005
+#define LONGOPT_ID_ENGINE 1006
+#define LONGOPT_ID_VERBOSE 1007
+#define LONGOPT_ID_CRC32_KERNEL 1008
+#define LONGOPT_ID_JOBS 1009
+#define LONGOPT_ID_RANGE 1010
+#define LONGOPT_ID_PRINT_CRC32 1011
+#define LONGOPT_ID_EXPECT_CRC32 1012
+#define LONGOPT_ID_PATIENT_CRC32 1013
+#define LONGOPT_ID_MODIFIED_FILE 1014
+#define LONGOPT_ID_COMPARE_KERNEL 1015
+#define LONGOPT_ID_IN_PLACE 1016
+#define LONGOPT_ID_EMIT_UNDO 1017
+#define LONGOPT_ID_SPARSE 1018
+#define LONGOPT_ID_QUEUE_DEPTH 1019
+#define LONGOPT_ID_PIPELINE 1020
+#define LONGOPT_ID_CACHE_DIR 1021
+#define LONGOPT_ID_SOCKET 1022
+#define LONGOPT_ID_ALGO 1023
+
+/* operations the io_uring engine keeps in flight */
+#define QUEUE_DEPTH_DEFAULT 32
+#define QUEUE_DEPTH_MAX 4096
 
 /**
  * Copies a string from src to *dest. If *dest is non-NULL, it is first free()d.
@@ -27,8 +51,73 @@ char* clone_string(char** dest, const char* src) {
     return strcpy(*dest, src);
 }
 
+/**
+ * Converts an apply engine name to its APPLY_ENGINE_* value.
+ * @return the engine value, or -1 if the name is not recognized
+ */
+int parse_apply_engine(const char* name) {
+    if (STREQ(name, "auto")) {
+        return APPLY_ENGINE_AUTO;
+    } else if (STREQ(name, "mmap")) {
+        return APPLY_ENGINE_MMAP;
+    } else if (STREQ(name, "stdio")) {
+        return APPLY_ENGINE_STDIO;
+    } else if (STREQ(name, "uring")) {
+        return APPLY_ENGINE_URING;
+    } else if (STREQ(name, "stream")) {
+        return APPLY_ENGINE_STREAM;
+    }
+    return -1;
+}
+
+/**
+ * Parses a non-negative decimal integer option argument.
+ * @return the value, or -1 if the argument is not a valid number
+ */
+long parse_count(const char* arg) {
+    char* end = NULL;
+    long value = strtol(arg, &end, 10);
+    if (!*arg || *end || value < 0 || value > INT_MAX) {
+        return -1;
+    }
+    return value;
+}
+
+/**
+ * Parses a byte range of the form START:LENGTH, where both numbers may be
+ * decimal, octal (leading 0) or hexadecimal (leading 0x).
+ * @return 0 on success or nonzero if the range is malformed
+ */
+int parse_range(const char* arg, unsigned long* start, unsigned long* length) {
+    char* end = NULL;
+    if (!isdigit((unsigned char)*arg)) {
+        return -1;
+    }
+    *start = strtoul(arg, &end, 0);
+    if (*end != ':' || !isdigit((unsigned char)end[1])) {
+        return -1;
+    }
+    arg = end + 1;
+    *length = strtoul(arg, &end, 0);
+    return *end ? -1 : 0;
+}
+
+/**
+ * Parses a CRC32 given as 1 to 8 hexadecimal digits.
+ * @return 0 on success or nonzero if the argument is malformed
+ */
+int parse_crc32(const char* arg, unsigned long* crc) {
+    size_t len = strlen(arg);
+    char* end = NULL;
+    if (len == 0 || len > 8 || !isxdigit((unsigned char)*arg)) {
+        return -1;
+    }
+    *crc = strtoul(arg, &end, 16);
+    return *end ? -1 : 0;
+}
+
 struct exec_options* parse_exec_options(int argc, char** argv) {
-    const char* shortopts = "p:f:o:x:t";
+    const char* shortopts = "p:f:m:o:x:tvj:";
     struct exec_options* ret = NULL;
 
     struct option longopts[] = {
@@ -38,15 +127,56 @@ struct exec_options* parse_exec_options(int argc, char** argv) {
         { "help",         no_argument,       NULL, LONGOPT_ID_HELP },
         { "output-path",  required_argument, NULL, LONGOPT_ID_OUTPUT_FILE },
         { "text-path",    required_argument, NULL, LONGOPT_ID_TEXT_PATH },
+        { "engine",       required_argument, NULL, LONGOPT_ID_ENGINE },
+        { "verbose",      no_argument,       NULL, LONGOPT_ID_VERBOSE },
+        { "crc32-kernel", required_argument, NULL, LONGOPT_ID_CRC32_KERNEL },
+        { "jobs",         required_argument, NULL, LONGOPT_ID_JOBS },
+        { "range",        required_argument, NULL, LONGOPT_ID_RANGE },
+        { "print-crc32",  no_argument,       NULL, LONGOPT_ID_PRINT_CRC32 },
+        { "expect-crc32", required_argument, NULL, LONGOPT_ID_EXPECT_CRC32 },
+        { "patient-crc32", required_argument, NULL, LONGOPT_ID_PATIENT_CRC32 },
+        { "modified-path", required_argument, NULL, LONGOPT_ID_MODIFIED_FILE },
+        { "compare-kernel", required_argument, NULL, LONGOPT_ID_COMPARE_KERNEL },
+        { "in-place",     no_argument,       NULL, LONGOPT_ID_IN_PLACE },
+        { "emit-undo",    required_argument, NULL, LONGOPT_ID_EMIT_UNDO },
+        { "sparse",       no_argument,       NULL, LONGOPT_ID_SPARSE },
+        { "queue-depth",  required_argument, NULL, LONGOPT_ID_QUEUE_DEPTH },
+        { "pipeline",     no_argument,       NULL, LONGOPT_ID_PIPELINE },
+        { "cache-dir",    required_argument, NULL, LONGOPT_ID_CACHE_DIR },
+        { "socket",       required_argument, NULL, LONGOPT_ID_SOCKET },
+        { "algo",         required_argument, NULL, LONGOPT_ID_ALGO },
         { 0, 0, 0, 0 }
     };
 
     ret = xmalloc(sizeof(*ret));
-    ret->patch_file_path = NULL;
+    ret->patch_file_paths = NULL;
+    ret->patch_count = 0;
     ret->patient_file_path = NULL;
+    ret->modified_file_path = NULL;
     ret->text_file_path = NULL;
     ret->output_file_path = NULL;
+    ret->undo_file_path = NULL;
+    ret->cache_dir = NULL;
+    ret->socket_path = NULL;
+    ret->digest_list = NULL;
+    ret->crc32_kernel = NULL;
+    ret->compare_kernel = NULL;
     ret->respect_post_trunc = 0;
+    ret->apply_engine = APPLY_ENGINE_AUTO;
+    ret->in_place = 0;
+    ret->sparse = 0;
+    ret->pipeline = 0;
+    ret->verbose = 0;
+    ret->jobs = 1;
+    ret->queue_depth = QUEUE_DEPTH_DEFAULT;
+    ret->has_range = 0;
+    ret->range_start = 0;
+    ret->range_length = 0;
+    ret->print_crc32 = 0;
+    ret->has_expected_crc32 = 0;
+    ret->expected_crc32 = 0;
+    ret->has_patient_crc32 = 0;
+    ret->patient_crc32 = 0;
     ret->help = 0;
     ret->parse_success = 0;
     ret->final_optind = 0;
@@ -64,12 +194,19 @@ struct exec_options* parse_exec_options(int argc, char** argv) {
         switch (opcode) {
         case 'p':
         case LONGOPT_ID_PATCH_FILE:
-            clone_string(&ret->patch_file_path, optarg);
+            ret->patch_file_paths = xrealloc(ret->patch_file_paths,
+                (ret->patch_count + 1) * sizeof(*ret->patch_file_paths));
+            ret->patch_file_paths[ret->patch_count] = NULL;
+            clone_string(&ret->patch_file_paths[ret->patch_count++], optarg);
             break;
         case 'f':
         case LONGOPT_ID_PATIENT_FILE:
             clone_string(&ret->patient_file_path, optarg);
             break;
+        case 'm':
+        case LONGOPT_ID_MODIFIED_FILE:
+            clone_string(&ret->modified_file_path, optarg);
+            break;
         case 'o':
         case LONGOPT_ID_OUTPUT_FILE:
             clone_string(&ret->output_file_path, optarg);
@@ -85,6 +222,92 @@ struct exec_options* parse_exec_options(int argc, char** argv) {
         case LONGOPT_ID_TEXT_PATH:
             clone_string(&ret->text_file_path, optarg);
             break;
+        case LONGOPT_ID_ENGINE:
+            ret->apply_engine = parse_apply_engine(optarg);
+            if (ret->apply_engine < 0) {
+                fprintf(stderr, "unknown apply engine: %s\n", optarg);
+                ret->final_optind = optind;
+                return ret;
+            }
+            break;
+        case LONGOPT_ID_IN_PLACE:
+            ret->in_place = 1;
+            break;
+        case LONGOPT_ID_EMIT_UNDO:
+            clone_string(&ret->undo_file_path, optarg);
+            break;
+        case LONGOPT_ID_CACHE_DIR:
+            clone_string(&ret->cache_dir, optarg);
+            break;
+        case LONGOPT_ID_SOCKET:
+            clone_string(&ret->socket_path, optarg);
+            break;
+        case LONGOPT_ID_ALGO:
+            clone_string(&ret->digest_list, optarg);
+            break;
+        case LONGOPT_ID_SPARSE:
+            ret->sparse = 1;
+            break;
+        case LONGOPT_ID_PIPELINE:
+            ret->pipeline = 1;
+            break;
+        case 'v':
+        case LONGOPT_ID_VERBOSE:
+            ret->verbose = 1;
+            break;
+        case LONGOPT_ID_CRC32_KERNEL:
+            clone_string(&ret->crc32_kernel, optarg);
+            break;
+        case LONGOPT_ID_COMPARE_KERNEL:
+            clone_string(&ret->compare_kernel, optarg);
+            break;
+        case 'j':
+        case LONGOPT_ID_JOBS:
+            /* 0 means one job per CPU */
+            ret->jobs = (int)parse_count(optarg);
+            if (ret->jobs < 0) {
+                fprintf(stderr, "invalid job count: %s\n", optarg);
+                ret->final_optind = optind;
+                return ret;
+            } else if (ret->jobs == 0) {
+                ret->jobs = cpu_count();
+            }
+            break;
+        case LONGOPT_ID_QUEUE_DEPTH:
+            ret->queue_depth = (int)parse_count(optarg);
+            if (ret->queue_depth < 1 || ret->queue_depth > QUEUE_DEPTH_MAX) {
+                fprintf(stderr, "invalid queue depth: %s\n", optarg);
+                ret->final_optind = optind;
+                return ret;
+            }
+            break;
+        case LONGOPT_ID_RANGE:
+            if (parse_range(optarg, &ret->range_start, &ret->range_length)) {
+                fprintf(stderr, "invalid range: %s\n", optarg);
+                ret->final_optind = optind;
+                return ret;
+            }
+            ret->has_range = 1;
+            break;
+        case LONGOPT_ID_PRINT_CRC32:
+            ret->print_crc32 = 1;
+            break;
+        case LONGOPT_ID_EXPECT_CRC32:
+            if (parse_crc32(optarg, &ret->expected_crc32)) {
+                fprintf(stderr, "invalid CRC32: %s\n", optarg);
+                ret->final_optind = optind;
+                return ret;
+            }
+            ret->has_expected_crc32 = 1;
+            break;
+        case LONGOPT_ID_PATIENT_CRC32:
+            if (parse_crc32(optarg, &ret->patient_crc32)) {
+                fprintf(stderr, "invalid CRC32: %s\n", optarg);
+                ret->final_optind = optind;
+                return ret;
+            }
+            ret->has_patient_crc32 = 1;
+            break;
         case '?':
         case ':':
         default:
@@ -100,9 +323,20 @@ struct exec_options* parse_exec_options(int argc, char** argv) {
 }
 
 void free_exec_options(struct exec_options* eo) {
-    free(eo->patch_file_path);
+    int i;
+    for (i = 0; i < eo->patch_count; i++) {
+        free(eo->patch_file_paths[i]);
+    }
+    free(eo->patch_file_paths);
     free(eo->patient_file_path);
+    free(eo->modified_file_path);
     free(eo->output_file_path);
+    free(eo->undo_file_path);
+    free(eo->cache_dir);
+    free(eo->socket_path);
+    free(eo->digest_list);
     free(eo->text_file_path);
+    free(eo->crc32_kernel);
+    free(eo->compare_kernel);
     free(eo);
 }
@@ -1,12 +1,41 @@
 #ifndef OPTIONS_H_INCLUDED
 #define OPTIONS_H_INCLUDED
 
+#define APPLY_ENGINE_AUTO 0
+#define APPLY_ENGINE_MMAP 1
+#define APPLY_ENGINE_STDIO 2
+#define APPLY_ENGINE_URING 3
+#define APPLY_ENGINE_STREAM 4
+
 struct exec_options {
-    char* patch_file_path;
+    char** patch_file_paths;   /* in the order they are applied */
+    int patch_count;
     char* patient_file_path;
+    char* modified_file_path;
     char* output_file_path;
+    char* undo_file_path;
+    char* cache_dir;
+    char* socket_path;
+    char* digest_list;    /* --algo, comma-separated */
     char* text_file_path;
+    char* crc32_kernel;
+    char* compare_kernel;
     int respect_post_trunc;
+    int apply_engine;
+    int in_place;
+    int sparse;
+    int pipeline;
+    int verbose;
+    int jobs;
+    int queue_depth;
+    int has_range;
+    unsigned long range_start;
+    unsigned long range_length;
+    int print_crc32;
+    int has_expected_crc32;
+    unsigned long expected_crc32;
+    int has_patient_crc32;
+    unsigned long patient_crc32;
     int help;
 
     int parse_success;
@@ -0,0 +1,645 @@
+#include "overlay.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* a write starting or ending at a position in the output */
+struct overlay_event {
+    size_t position;
+    size_t write;
+};
+
+static int compare_events(const void* a, const void* b) {
+    const struct overlay_event* ea = a;
+    const struct overlay_event* eb = b;
+    if (ea->position != eb->position) {
+        return ea->position < eb->position ? -1 : 1;
+    }
+    return 0;
+}
+
+/* a binary max-heap of write indices; the latest write is on top */
+static void heap_push(size_t* heap, size_t* n, size_t value) {
+    size_t i = (*n)++;
+    while (i > 0 && heap[(i - 1) / 2] < value) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = value;
+}
+
+static void heap_pop(size_t* heap, size_t* n) {
+    size_t last = heap[--*n];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= *n) {
+            break;
+        }
+        if (child + 1 < *n && heap[child + 1] > heap[child]) {
+            child++;
+        }
+        if (heap[child] <= last) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (*n) {
+        heap[i] = last;
+    }
+}
+
+/* appends the part [start, end) of a write, merging it into the previous
+   extent when that came from the same write and is contiguous */
+static void overlay_append(
+    struct overlay* ov,
+    size_t* capacity,
+    const struct extent* w,
+    size_t start,
+    size_t end)
+{
+    struct extent* prev = ov->count ? &ov->extents[ov->count - 1] : NULL;
+    struct extent* ext = NULL;
+    const unsigned char* data = w->fill < 0
+        ? w->data + (start - w->offset) : NULL;
+
+    if (prev && prev->offset + prev->length == start && prev->fill == w->fill
+        && (w->fill >= 0 || prev->data + prev->length == data))
+    {
+        prev->length += end - start;
+        return;
+    }
+
+    if (ov->count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        ov->extents = xrealloc(ov->extents, *capacity * sizeof(*ov->extents));
+    }
+    ext = &ov->extents[ov->count++];
+    ext->offset = start;
+    ext->length = end - start;
+    ext->fill = w->fill;
+    ext->data = data;
+}
+
+void overlay_build(struct overlay* ov, const struct extent* writes, size_t count) {
+    struct overlay_event* events = NULL;
+    size_t* heap = NULL;
+    size_t heap_size = 0;
+    size_t event_count = 0;
+    size_t capacity = 0;
+    size_t i;
+
+    ov->extents = NULL;
+    ov->count = 0;
+    if (count == 0) {
+        return;
+    }
+
+    /* sweep over the start and end points of every write; at any point, the
+       latest write that covers it is the one that wins */
+    events = xmalloc(2 * count * sizeof(*events));
+    heap = xmalloc(count * sizeof(*heap));
+    for (i = 0; i < count; i++) {
+        if (writes[i].length == 0) {
+            continue;
+        }
+        events[event_count].position = writes[i].offset;
+        events[event_count++].write = i;
+        events[event_count].position = writes[i].offset + writes[i].length;
+        events[event_count++].write = i;
+    }
+    qsort(events, event_count, sizeof(*events), compare_events);
+
+    for (i = 0; i < event_count; ) {
+        size_t position = events[i].position;
+        size_t next = 0;
+
+        /* start every write beginning here; ends are handled lazily */
+        for (; i < event_count && events[i].position == position; i++) {
+            const struct extent* w = &writes[events[i].write];
+            if (w->offset == position) {
+                heap_push(heap, &heap_size, events[i].write);
+            }
+        }
+        while (heap_size
+            && writes[heap[0]].offset + writes[heap[0]].length <= position)
+        {
+            heap_pop(heap, &heap_size);
+        }
+        if (i == event_count || heap_size == 0) {
+            continue;
+        }
+
+        next = events[i].position;
+        overlay_append(ov, &capacity, &writes[heap[0]], position, next);
+    }
+
+    free(heap);
+    free(events);
+}
+
+/* adds the hunks of idx to writes, with anything at or past clip cut off */
+static size_t overlay_add_hunks(
+    struct extent* writes,
+    const struct patch_index* idx,
+    size_t clip)
+{
+    size_t n = 0;
+    size_t i;
+
+    for (i = 0; i < idx->hunk_count; i++) {
+        const struct patch_hunk* hunk = &idx->hunks[i];
+        size_t offset = (size_t)hunk->header.offset;
+        if (offset >= clip) {
+            continue;
+        }
+        writes[n].offset = offset;
+        writes[n].length = clip - offset < (size_t)hunk->header.length
+            ? clip - offset : (size_t)hunk->header.length;
+        if (hunk->header.type == HUNK_RLE) {
+            writes[n].fill = hunk->header.fill;
+            writes[n].data = NULL;
+        } else {
+            writes[n].fill = -1;
+            writes[n].data = idx->data + hunk->payload_offset;
+        }
+        n++;
+    }
+    return n;
+}
+
+void overlay_build_patch(struct overlay* ov, const struct patch_index* idx) {
+    struct extent* writes = xmalloc(
+        (idx->hunk_count ? idx->hunk_count : 1) * sizeof(*writes));
+    size_t count = overlay_add_hunks(writes, idx, (size_t)-1);
+    overlay_build(ov, writes, count);
+    free(writes);
+}
+
+void overlay_build_stack(
+    struct overlay* ov,
+    const struct patch_index* idxs,
+    size_t count,
+    size_t patient_size,
+    size_t* size,
+    size_t* kept)
+{
+    struct extent* writes = NULL;
+    size_t* clips = xmalloc((count ? count : 1) * sizeof(*clips));
+    size_t total = 0;
+    size_t n = 0;
+    size_t i;
+
+    /* the image size after each layer; nothing shrinks it but truncation */
+    *size = patient_size;
+    *kept = patient_size;
+    for (i = 0; i < count; i++) {
+        *size = patch_output_size(&idxs[i], *size);
+        if (*size < *kept) {
+            *kept = *size;
+        }
+        clips[i] = *size;
+        total += idxs[i].hunk_count;
+    }
+
+    /* a layer's writes survive up to the smallest size the image has from
+       that layer on, so clipping them first lets all layers be swept at once */
+    for (i = count; i-- > 1; ) {
+        if (clips[i] < clips[i - 1]) {
+            clips[i - 1] = clips[i];
+        }
+    }
+
+    writes = xmalloc((total ? total : 1) * sizeof(*writes));
+    for (i = 0; i < count; i++) {
+        n += overlay_add_hunks(writes + n, &idxs[i], clips[i]);
+    }
+    overlay_build(ov, writes, n);
+    free(writes);
+    free(clips);
+}
+
+void overlay_fill_under(
+    struct overlay* ov,
+    size_t offset,
+    size_t length,
+    int fill)
+{
+    struct overlay filled;
+    struct extent* writes = xmalloc((ov->count + 1) * sizeof(*writes));
+
+    /* the fill goes first, so every existing extent wins over it */
+    writes[0].offset = offset;
+    writes[0].length = length;
+    writes[0].fill = fill;
+    writes[0].data = NULL;
+    if (ov->count) {
+        memcpy(writes + 1, ov->extents, ov->count * sizeof(*writes));
+    }
+    overlay_build(&filled, writes, ov->count + 1);
+    free(writes);
+    overlay_free(ov);
+    *ov = filled;
+}
+
+void overlay_zero_cut(
+    struct overlay* ov,
+    size_t patient_size,
+    size_t kept,
+    size_t size)
+{
+    size_t end = patient_size < size ? patient_size : size;
+    if (kept < end) {
+        overlay_fill_under(ov, kept, end - kept, 0);
+    }
+}
+
+void overlay_clip(struct overlay* ov, size_t size) {
+    while (ov->count && ov->extents[ov->count - 1].offset >= size) {
+        ov->count--;
+    }
+    if (ov->count) {
+        struct extent* last = &ov->extents[ov->count - 1];
+        if (last->offset + last->length > size) {
+            last->length = size - last->offset;
+        }
+    }
+}
+
+void overlay_drop_unchanged(
+    struct overlay* ov,
+    const unsigned char* base,
+    size_t base_size)
+{
+    struct overlay kept;
+    size_t capacity = 0;
+    size_t i;
+
+    kept.extents = NULL;
+    kept.count = 0;
+
+    for (i = 0; i < ov->count; i++) {
+        const struct extent* ext = &ov->extents[i];
+        size_t j = 0;
+
+        while (j < ext->length) {
+            size_t start = 0;
+
+            /* skip unchanged bytes, then take the changed ones after them */
+            for (; j < ext->length; j++) {
+                size_t at = ext->offset + j;
+                unsigned char old = at < base_size ? base[at] : 0;
+                if ((ext->fill < 0 ? ext->data[j] : ext->fill) != old) {
+                    break;
+                }
+            }
+            start = j;
+            for (; j < ext->length; j++) {
+                size_t at = ext->offset + j;
+                unsigned char old = at < base_size ? base[at] : 0;
+                if ((ext->fill < 0 ? ext->data[j] : ext->fill) == old) {
+                    break;
+                }
+            }
+            if (j > start) {
+                overlay_append(&kept, &capacity, ext, ext->offset + start,
+                    ext->offset + j);
+            }
+        }
+    }
+
+    overlay_free(ov);
+    *ov = kept;
+}
+
+void overlay_build_undo(
+    struct overlay* undo,
+    const struct overlay* ov,
+    const unsigned char* patient,
+    size_t patient_size,
+    size_t kept,
+    size_t size)
+{
+    struct overlay changed;
+    struct extent whole;
+    size_t end = patient_size < size ? patient_size : size;
+    size_t capacity = 0;
+    size_t i;
+
+    undo->extents = NULL;
+    undo->count = 0;
+    whole.offset = 0;
+    whole.length = patient_size;
+    whole.fill = -1;
+    whole.data = patient;
+
+    /* within both, the image differs where ov changes the patient and where
+       a truncation cut off bytes that were grown back as zeros */
+    overlay_build(&changed, ov->extents, ov->count);
+    overlay_zero_cut(&changed, patient_size, kept, size);
+    overlay_clip(&changed, end);
+    overlay_drop_unchanged(&changed, patient, end);
+    for (i = 0; i < changed.count; i++) {
+        const struct extent* ext = &changed.extents[i];
+        overlay_append(undo, &capacity, &whole, ext->offset,
+            ext->offset + ext->length);
+    }
+    overlay_free(&changed);
+
+    /* past the end of a shorter image, the patient grows back with zeros, so
+       only its nonzero bytes and its last byte (which sets the size) are
+       written */
+    if (size < patient_size) {
+        const struct extent* last = NULL;
+        i = size;
+        while (i < patient_size) {
+            size_t start = 0;
+            while (i < patient_size && !patient[i]) {
+                i++;
+            }
+            start = i;
+            while (i < patient_size && patient[i]) {
+                i++;
+            }
+            if (i > start) {
+                overlay_append(undo, &capacity, &whole, start, i);
+            }
+        }
+        last = undo->count ? &undo->extents[undo->count - 1] : NULL;
+        if (!last || last->offset + last->length < patient_size) {
+            overlay_append(undo, &capacity, &whole, patient_size - 1,
+                patient_size);
+        }
+    }
+}
+
+void overlay_free(struct overlay* ov) {
+    free(ov->extents);
+    ov->extents = NULL;
+    ov->count = 0;
+}
+
+size_t overlay_find(const struct overlay* ov, size_t offset) {
+    size_t lo = 0;
+    size_t hi = ov->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct extent* ext = &ov->extents[mid];
+        if (ext->offset + ext->length <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void overlay_apply_range(
+    const struct overlay* ov,
+    size_t* cursor,
+    size_t offset,
+    unsigned char* buf,
+    size_t len)
+{
+    size_t end = offset + len;
+    size_t i = *cursor;
+
+    while (i < ov->count
+        && ov->extents[i].offset + ov->extents[i].length <= offset)
+    {
+        i++;
+    }
+    *cursor = i;
+
+    for (; i < ov->count && ov->extents[i].offset < end; i++) {
+        const struct extent* ext = &ov->extents[i];
+        size_t start = ext->offset > offset ? ext->offset : offset;
+        size_t stop = ext->offset + ext->length < end
+            ? ext->offset + ext->length : end;
+        if (ext->fill < 0) {
+            memcpy(buf + (start - offset), ext->data + (start - ext->offset),
+                stop - start);
+        } else {
+            memset(buf + (start - offset), ext->fill, stop - start);
+        }
+    }
+}
+
+/*******************************************************************************
+Patched views
+*******************************************************************************/
+void patched_view_init(
+    struct patched_view* view,
+    const struct patch_index* idx,
+    const unsigned char* patient,
+    size_t patient_size)
+{
+    patched_view_init_stack(view, idx, 1, patient, patient_size);
+}
+
+void patched_view_init_stack(
+    struct patched_view* view,
+    const struct patch_index* idxs,
+    size_t count,
+    const unsigned char* patient,
+    size_t patient_size)
+{
+    view->patient = patient;
+    overlay_build_stack(&view->overlay, idxs, count, patient_size,
+        &view->size, &view->patient_size);
+}
+
+/* copies the unpatched bytes [offset, offset + len) of the image */
+static void patched_view_read_base(
+    const struct patched_view* view,
+    size_t offset,
+    size_t len,
+    unsigned char* out)
+{
+    size_t from_patient = 0;
+    if (offset < view->patient_size) {
+        from_patient = view->patient_size - offset;
+        if (from_patient > len) {
+            from_patient = len;
+        }
+        memcpy(out, view->patient + offset, from_patient);
+    }
+    memset(out + from_patient, 0, len - from_patient);
+}
+
+size_t patched_view_read(
+    const struct patched_view* view,
+    size_t offset,
+    size_t len,
+    unsigned char* out)
+{
+    const struct overlay* ov = &view->overlay;
+    size_t end = 0;
+    size_t pos = offset;
+    size_t i;
+
+    if (offset >= view->size) {
+        return 0;
+    }
+    if (len > view->size - offset) {
+        len = view->size - offset;
+    }
+    end = offset + len;
+
+    for (i = overlay_find(ov, offset); pos < end; i++) {
+        const struct extent* ext = i < ov->count ? &ov->extents[i] : NULL;
+        size_t ext_start = 0;
+        size_t ext_end = 0;
+
+        /* the gap before the next extent (or the rest of the range) */
+        if (!ext || ext->offset >= end) {
+            patched_view_read_base(view, pos, end - pos, out + (pos - offset));
+            break;
+        } else if (ext->offset > pos) {
+            patched_view_read_base(view, pos, ext->offset - pos,
+                out + (pos - offset));
+            pos = ext->offset;
+        }
+
+        /* the part of the extent inside the range */
+        ext_start = pos - ext->offset;
+        ext_end = ext->offset + ext->length < end
+            ? ext->length : end - ext->offset;
+        if (ext->fill < 0) {
+            memcpy(out + (pos - offset), ext->data + ext_start,
+                ext_end - ext_start);
+        } else {
+            memset(out + (pos - offset), ext->fill, ext_end - ext_start);
+        }
+        pos = ext->offset + ext_end;
+    }
+
+    return len;
+}
+
+/* continues a CRC32 over len copies of the byte fill */
+static uint32_t crc32_fill(uint32_t crc, int fill, size_t len) {
+    unsigned char buf[4096];
+    memset(buf, fill, len < sizeof(buf) ? len : sizeof(buf));
+    while (len) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        crc = crc32_update(crc, buf, n);
+        len -= n;
+    }
+    return crc;
+}
+
+/* continues a CRC32 over the unpatched bytes [offset, offset + len) */
+static uint32_t patched_view_crc32_base(
+    const struct patched_view* view,
+    uint32_t crc,
+    size_t offset,
+    size_t len)
+{
+    if (offset < view->patient_size) {
+        size_t n = view->patient_size - offset;
+        if (n > len) {
+            n = len;
+        }
+        crc = crc32_update(crc, (void*)(view->patient + offset), n);
+        len -= n;
+    }
+    return crc32_fill(crc, 0, len);
+}
+
+void patched_view_apply(
+    const struct patched_view* view,
+    unsigned char* out,
+    uint32_t* crc)
+{
+    const struct overlay* ov = &view->overlay;
+    size_t pos = 0;
+    size_t i;
+
+    for (i = 0; i < ov->count; i++) {
+        const struct extent* ext = &ov->extents[i];
+        if (crc) {
+            *crc = patched_view_crc32_base(view, *crc, pos, ext->offset - pos);
+        }
+        if (ext->fill < 0) {
+            if (out) {
+                memcpy(out + ext->offset, ext->data, ext->length);
+            }
+            if (crc) {
+                *crc = crc32_update(*crc, (void*)ext->data, ext->length);
+            }
+        } else {
+            if (out) {
+                memset(out + ext->offset, ext->fill, ext->length);
+            }
+            if (crc) {
+                *crc = crc32_fill(*crc, ext->fill, ext->length);
+            }
+        }
+        pos = ext->offset + ext->length;
+    }
+    if (crc) {
+        *crc = patched_view_crc32_base(view, *crc, pos, view->size - pos);
+    }
+}
+
+uint32_t patched_view_crc32_delta(
+    const struct patched_view* view,
+    uint32_t patient_crc,
+    size_t patient_size)
+{
+    const struct overlay* ov = &view->overlay;
+    size_t kept = view->patient_size;
+    size_t cut = patient_size - kept;
+    uint32_t crc = patient_crc;
+    uint32_t delta = 0;
+    unsigned char buf[4096];
+    size_t i;
+
+    /* CRC of the part of the patient that is kept: either strip the cut
+       tail back off, or hash the kept part directly if that is shorter */
+    if (cut && cut < kept) {
+        uint32_t tail = crc32_update(0, (void*)(view->patient + kept), cut);
+        crc = crc32_unshift((crc ^ CRC32_BASE) ^ tail, cut) ^ CRC32_BASE;
+    } else if (cut) {
+        crc = crc32_quick((void*)view->patient, kept);
+    }
+
+    /* zero extension past the end of the patient */
+    if (view->size > kept) {
+        crc = crc32_shift(crc ^ CRC32_BASE, view->size - kept) ^ CRC32_BASE;
+    }
+
+    /* CRC(old) ^ CRC(new) is the CRC of old ^ new from a zero state, so each
+       extent contributes the CRC of its byte changes, shifted to the end */
+    for (i = 0; i < ov->count; i++) {
+        const struct extent* ext = &ov->extents[i];
+        uint32_t diff = 0;
+        size_t done = 0;
+
+        while (done < ext->length) {
+            size_t n = ext->length - done;
+            size_t j;
+            if (n > sizeof(buf)) {
+                n = sizeof(buf);
+            }
+            for (j = 0; j < n; j++) {
+                size_t at = ext->offset + done + j;
+                unsigned char old = at < kept ? view->patient[at] : 0;
+                unsigned char new = ext->fill < 0
+                    ? ext->data[done + j] : (unsigned char)ext->fill;
+                buf[j] = old ^ new;
+            }
+            diff = crc32_update(diff, buf, n);
+            done += n;
+        }
+        delta ^= crc32_shift(diff, view->size - ext->offset - ext->length);
+    }
+
+    return crc ^ delta;
+}
+
+void patched_view_free(struct patched_view* view) {
+    overlay_free(&view->overlay);
+}
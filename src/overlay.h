@@ -0,0 +1,205 @@
+#ifndef OVERLAY_H_INCLUDED
+#define OVERLAY_H_INCLUDED
+
+#include "patch.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A run of bytes written to the output: either literal bytes or a repeated
+ * fill byte.
+ */
+struct extent {
+    size_t offset;
+    size_t length;
+    int fill;                      /* fill byte, or -1 for literal data */
+    const unsigned char* data;     /* literal bytes (fill < 0 only) */
+};
+
+/**
+ * The bytes a patch writes, as extents sorted by offset that don't overlap.
+ */
+struct overlay {
+    struct extent* extents;
+    size_t count;
+};
+
+/**
+ * Builds an overlay from count writes, given in the order they would be
+ * applied. Where writes overlap, the later one wins. Empty writes are
+ * dropped.
+ */
+void overlay_build(struct overlay* ov, const struct extent* writes, size_t count);
+
+/**
+ * Builds the overlay of an indexed patch. Literal extents point into the
+ * patch buffer, which must outlive the overlay.
+ */
+void overlay_build_patch(struct overlay* ov, const struct patch_index* idx);
+
+/**
+ * Builds the overlay of count indexed patches applied one after another to a
+ * patient_size-byte patient, as if each were applied to the output of the one
+ * before it. Where layers overlap, the later one wins, and each layer's
+ * truncation drops whatever the layers up to it wrote past that point. *size
+ * receives the size of the final image, and *kept the number of leading
+ * patient bytes that survive every truncation (the rest of the image that
+ * isn't covered by the overlay is zeros).
+ */
+void overlay_build_stack(
+    struct overlay* ov,
+    const struct patch_index* idxs,
+    size_t count,
+    size_t patient_size,
+    size_t* size,
+    size_t* kept);
+
+/**
+ * Puts length bytes of fill at offset underneath the overlay: the parts of
+ * that range no extent covers yet are added as fill extents.
+ */
+void overlay_fill_under(
+    struct overlay* ov,
+    size_t offset,
+    size_t length,
+    int fill);
+
+/**
+ * Puts zeros underneath the overlay over the patient bytes that a stack cut
+ * off but grew the image back over: those from kept (see
+ * overlay_build_stack()) up to the end of the patient or of the size-byte
+ * image, whichever comes first. Laid over the patient, the overlay then makes
+ * the whole image, however the stack truncated it.
+ */
+void overlay_zero_cut(
+    struct overlay* ov,
+    size_t patient_size,
+    size_t kept,
+    size_t size);
+
+/**
+ * Drops everything at or past size from the overlay.
+ */
+void overlay_clip(struct overlay* ov, size_t size);
+
+/**
+ * Drops the bytes of the overlay that write what is already there: the byte
+ * at the same offset of base, or zero at or past base_size. Extents are split
+ * around the dropped bytes.
+ */
+void overlay_drop_unchanged(
+    struct overlay* ov,
+    const unsigned char* base,
+    size_t base_size);
+
+/**
+ * Builds the overlay that undoes an apply: it turns the size-byte image that
+ * ov (from overlay_build_stack(), with its *kept) makes of the patient_size
+ * bytes at patient back into the patient, and is applied with a truncation
+ * to patient_size if the image is longer. Its extents point into patient,
+ * and only cover bytes the image doesn't already share with the patient.
+ */
+void overlay_build_undo(
+    struct overlay* undo,
+    const struct overlay* ov,
+    const unsigned char* patient,
+    size_t patient_size,
+    size_t kept,
+    size_t size);
+
+void overlay_free(struct overlay* ov);
+
+/**
+ * Finds the first extent that ends after offset.
+ * @return its index, or ov->count if there is none
+ */
+size_t overlay_find(const struct overlay* ov, size_t offset);
+
+/**
+ * Lays the part of the overlay inside [offset, offset + len) over the len
+ * bytes at buf, which hold that range of the image underneath it. Windows
+ * can be applied in increasing order with the same *cursor (an extent index,
+ * starting at 0) so that extents already passed aren't searched again.
+ */
+void overlay_apply_range(
+    const struct overlay* ov,
+    size_t* cursor,
+    size_t offset,
+    unsigned char* buf,
+    size_t len);
+
+/*******************************************************************************
+Patched views
+*******************************************************************************/
+
+/**
+ * A read-only view of a patched image that is never materialized: reads are
+ * answered from the overlay where it covers them, and from the patient (or
+ * zeros past its end) elsewhere.
+ */
+struct patched_view {
+    struct overlay overlay;
+    const unsigned char* patient;
+    size_t patient_size;     /* patient bytes visible in the image */
+    size_t size;             /* size of the patched image */
+};
+
+/**
+ * Sets up a view of the patch in idx applied to the patient_size bytes at
+ * patient. Both the patch buffer and the patient must outlive the view.
+ */
+void patched_view_init(
+    struct patched_view* view,
+    const struct patch_index* idx,
+    const unsigned char* patient,
+    size_t patient_size);
+
+/**
+ * Like patched_view_init(), but for a stack of count patches applied in order
+ * (see overlay_build_stack()).
+ */
+void patched_view_init_stack(
+    struct patched_view* view,
+    const struct patch_index* idxs,
+    size_t count,
+    const unsigned char* patient,
+    size_t patient_size);
+
+/**
+ * Copies up to len bytes at offset of the patched image into out.
+ * @return the number of bytes copied, which is less than len only at the end
+ *         of the image
+ */
+size_t patched_view_read(
+    const struct patched_view* view,
+    size_t offset,
+    size_t len,
+    unsigned char* out);
+
+/**
+ * Writes the view's overlay into out, which must already hold the first
+ * view->size bytes of the patient (zero-extended), in one forward sweep. If
+ * crc is non-NULL, *crc is continued over the whole image in the same sweep,
+ * computed from the patient and patch bytes so that out is never read back.
+ * out may be NULL to compute only the CRC.
+ */
+void patched_view_apply(
+    const struct patched_view* view,
+    unsigned char* out,
+    uint32_t* crc);
+
+/**
+ * Computes the finalized CRC32 of the view's image from patient_crc, the
+ * finalized CRC32 of the whole patient_size-byte patient, without reading it
+ * all. Only the patient bytes under the overlay are read, plus either the
+ * kept or the cut part of the patient (whichever is shorter) when the image
+ * is shorter than the patient.
+ */
+uint32_t patched_view_crc32_delta(
+    const struct patched_view* view,
+    uint32_t patient_crc,
+    size_t patient_size);
+
+void patched_view_free(struct patched_view* view);
+
+#endif
@@ -0,0 +1,200 @@
+#include "patch.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+
+const char EOF_MARKER[] = "EOF";
+const char MAGIC_PATCH[] = "PATCH";
+
+const char* PATCH_CODE_STR[] = {
+    "ok",
+    "unexpected EOF while detecting magic PATCH",
+    "magic PATCH not found",
+    "unexpected EOF while reading hunks",
+    "unexpected EOF while reading hunk payload",
+    "unexpected EOF while reading truncation length",
+    "out of memory",
+    /* add new strings between these */
+    "PATCH_CODE_STR bounds error"
+};
+
+int decode_big_endian_3(const unsigned char bytes[3]) {
+    return (bytes[0] << 16) | (bytes[1] << 8) | bytes[2];
+}
+
+int decode_big_endian_2(const unsigned char bytes[2]) {
+    return (bytes[0] << 8) | bytes[1];
+}
+
+/**
+ * Decodes the hunk header at *pos in the len-byte patch buf. On success, *pos
+ * is advanced past the header (but not the payload).
+ * @return nonzero if the header runs past the end of the patch
+ */
+static int decode_hunk_header(
+    const unsigned char* buf,
+    size_t len,
+    size_t* pos,
+    struct hunk_header* h)
+{
+    size_t p = *pos;
+
+    /* get offset or EOF marker */
+    if (len - p < HUNK_OFFSET_WIDTH) {
+        return -1;
+    } else if (MEMEQ(buf + p, EOF_MARKER, HUNK_OFFSET_WIDTH)) {
+        h->type = HUNK_EOF;
+        *pos = p + HUNK_OFFSET_WIDTH;
+        return 0;
+    }
+    h->offset = decode_big_endian_3(buf + p);
+    p += HUNK_OFFSET_WIDTH;
+
+    /* get regular length */
+    if (len - p < HUNK_LENGTH_WIDTH) {
+        return -1;
+    }
+    h->length = decode_big_endian_2(buf + p);
+    p += HUNK_LENGTH_WIDTH;
+    if (h->length != 0) {
+        h->type = HUNK_REGULAR;
+        *pos = p;
+        return 0;
+    }
+
+    /* at this point, this is an RLE hunk: read the length and fill byte */
+    if (len - p < HUNK_LENGTH_WIDTH + 1) {
+        return -1;
+    }
+    h->type = HUNK_RLE;
+    h->length = decode_big_endian_2(buf + p);
+    h->fill = buf[p + HUNK_LENGTH_WIDTH];
+    *pos = p + HUNK_LENGTH_WIDTH + 1;
+    return 0;
+}
+
+int patch_index_build(
+    struct patch_index* idx,
+    const unsigned char* data,
+    size_t len,
+    int read_trunc)
+{
+    size_t capacity = 64;
+    size_t pos = MAGIC_PATCH_WIDTH;
+    int code = PATCH_CODE_OK;
+
+    idx->data = data;
+    idx->size = len;
+    idx->hunks = NULL;
+    idx->hunk_count = 0;
+    idx->eof_offset = 0;
+    idx->trunc_length = -1;
+    idx->trailing_data = 0;
+    idx->max_end = 0;
+
+    if (len < MAGIC_PATCH_WIDTH) {
+        return PATCH_CODE_MAGIC_EOF;
+    } else if (!MEMEQ(data, MAGIC_PATCH, MAGIC_PATCH_WIDTH)) {
+        return PATCH_CODE_NO_MAGIC;
+    }
+
+    if (!(idx->hunks = malloc(capacity * sizeof(*idx->hunks)))) {
+        return PATCH_CODE_NO_MEMORY;
+    }
+    for (;;) {
+        struct patch_hunk* hunk = NULL;
+        size_t record_offset = pos;
+        struct hunk_header header;
+
+        if (decode_hunk_header(data, len, &pos, &header)) {
+            code = PATCH_CODE_HUNK_EOF;
+            goto ERROR;
+        } else if (header.type == HUNK_EOF) {
+            idx->eof_offset = record_offset;
+            break;
+        }
+
+        if (idx->hunk_count == capacity) {
+            struct patch_hunk* grown = realloc(idx->hunks,
+                2 * capacity * sizeof(*idx->hunks));
+            if (!grown) {
+                code = PATCH_CODE_NO_MEMORY;
+                goto ERROR;
+            }
+            idx->hunks = grown;
+            capacity *= 2;
+        }
+        hunk = &idx->hunks[idx->hunk_count++];
+        hunk->header = header;
+        hunk->record_offset = record_offset;
+        hunk->payload_offset = pos;
+
+        if (header.type == HUNK_REGULAR) {
+            if (len - pos < (size_t)header.length) {
+                code = PATCH_CODE_PAYLOAD_EOF;
+                goto ERROR;
+            }
+            pos += header.length;
+        }
+        if ((size_t)header.offset + header.length > idx->max_end) {
+            idx->max_end = (size_t)header.offset + header.length;
+        }
+    }
+
+    /* optional truncation length; nothing at all past EOF is fine too */
+    if (read_trunc) {
+        if (len - pos >= TRUNC_LENGTH_WIDTH) {
+            idx->trunc_length = decode_big_endian_3(data + pos);
+            pos += TRUNC_LENGTH_WIDTH;
+        } else if (len != pos) {
+            code = PATCH_CODE_TRUNC_EOF;
+            goto ERROR;
+        }
+        idx->trailing_data = pos != len;
+    }
+
+    return PATCH_CODE_OK;
+
+ERROR:
+    patch_index_free(idx);
+    return code;
+}
+
+void patch_index_free(struct patch_index* idx) {
+    free(idx->hunks);
+    idx->hunks = NULL;
+    idx->hunk_count = 0;
+}
+
+size_t patch_output_size(const struct patch_index* idx, size_t patient_size) {
+    if (idx->trunc_length >= 0) {
+        return (size_t)idx->trunc_length;
+    }
+    return patient_size > idx->max_end ? patient_size : idx->max_end;
+}
+
+void patch_apply_buffer(
+    const struct patch_index* idx,
+    unsigned char* out,
+    size_t out_size)
+{
+    size_t i;
+    for (i = 0; i < idx->hunk_count; i++) {
+        const struct hunk_header* hunk = &idx->hunks[i].header;
+        size_t n = 0;
+
+        /* hunks past a truncation point are clipped */
+        if ((size_t)hunk->offset >= out_size) {
+            continue;
+        }
+        n = out_size - hunk->offset;
+        if (n > (size_t)hunk->length) {
+            n = hunk->length;
+        }
+        if (hunk->type == HUNK_REGULAR) {
+            memcpy(out + hunk->offset, idx->data + idx->hunks[i].payload_offset, n);
+        } else {
+            memset(out + hunk->offset, hunk->fill, n);
+        }
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef PATCH_H_INCLUDED
+#define PATCH_H_INCLUDED
+
+#include <stddef.h>
+
+#define HUNK_OFFSET_WIDTH 3
+#define HUNK_LENGTH_WIDTH 2
+#define TRUNC_LENGTH_WIDTH 3
+
+/* largest payload a single hunk can carry */
+#define HUNK_LENGTH_MAX ((1 << (8 * HUNK_LENGTH_WIDTH)) - 1)
+
+extern const char EOF_MARKER[];
+extern const char MAGIC_PATCH[];
+
+#define MAGIC_PATCH_WIDTH 5
+
+enum hunk_header_type {
+    HUNK_REGULAR,
+    HUNK_RLE,
+    HUNK_EOF
+};
+
+struct hunk_header {
+    enum hunk_header_type type;
+
+    int offset;
+    int length;
+    unsigned char fill;   /* RLE only */
+};
+
+int decode_big_endian_3(const unsigned char bytes[3]);
+int decode_big_endian_2(const unsigned char bytes[2]);
+
+/*******************************************************************************
+Patch index
+*******************************************************************************/
+
+/* a decoded hunk, along with where its record lives in the patch */
+struct patch_hunk {
+    struct hunk_header header;
+    size_t record_offset;    /* offset of the hunk header in the patch */
+    size_t payload_offset;   /* offset of the payload (REGULAR only) */
+};
+
+/**
+ * A whole patch decoded into a flat array of hunks, in patch order. The
+ * payloads are not copied; they are referenced by offset into the patch
+ * buffer the index was built from.
+ */
+struct patch_index {
+    const unsigned char* data;
+    size_t size;
+
+    struct patch_hunk* hunks;
+    size_t hunk_count;
+
+    size_t eof_offset;      /* offset of the EOF marker */
+    int trunc_length;       /* -1 if there is none (or it wasn't requested) */
+    int trailing_data;      /* nonzero if unexpected bytes follow the patch */
+    size_t max_end;         /* one past the last byte written by any hunk */
+};
+
+#define PATCH_CODE_OK 0
+#define PATCH_CODE_MAGIC_EOF 1
+#define PATCH_CODE_NO_MAGIC 2
+#define PATCH_CODE_HUNK_EOF 3
+#define PATCH_CODE_PAYLOAD_EOF 4
+#define PATCH_CODE_TRUNC_EOF 5
+#define PATCH_CODE_NO_MEMORY 6
+
+extern const char* PATCH_CODE_STR[];
+
+/**
+ * Decodes the len-byte patch at data into idx. If read_trunc is nonzero, a
+ * truncation length following the EOF marker is decoded too. data must
+ * outlive idx. Returns PATCH_CODE_OK on success or another PATCH_CODE_*
+ * value on error (including running out of memory, which doesn't abort), in
+ * which case idx holds nothing that needs freeing.
+ */
+int patch_index_build(
+    struct patch_index* idx,
+    const unsigned char* data,
+    size_t len,
+    int read_trunc);
+
+void patch_index_free(struct patch_index* idx);
+
+/**
+ * Returns the size of the result of applying the patch to a patient of
+ * patient_size bytes.
+ */
+size_t patch_output_size(const struct patch_index* idx, size_t patient_size);
+
+/**
+ * Applies an indexed patch to the out_size bytes at out, which must already
+ * hold the patient resized to out_size. Hunks are applied in patch order and
+ * clipped to out_size.
+ */
+void patch_apply_buffer(
+    const struct patch_index* idx,
+    unsigned char* out,
+    size_t out_size);
+
+#endif
@@ -0,0 +1,439 @@
+#if defined(__linux__)
+    #define _POSIX_C_SOURCE 200809L
+    #include <pthread.h>
+#endif
+
+#include "pipeline.h"
+#include "patch.h"
+#include "util.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char* PIPELINE_CODE_STR[] = {
+    "ok",
+    "unable to read patch",
+    "malformed patch",
+    "unable to write output",
+    /* add new strings between these */
+    "PIPELINE_CODE_STR bounds error"
+};
+
+/* slabs in the ring; the decoder can run this far ahead of the writer */
+#define PIPELINE_SLABS 8
+
+/* a slab holds at least one hunk of any length */
+#define SLAB_PAYLOAD ((size_t)1 << 18)
+#define SLAB_RECORDS 4096
+
+/* record kinds other than an RLE fill byte */
+#define RECORD_LITERAL (-1)
+#define RECORD_TRUNCATE (-2)
+
+struct pipeline_record {
+    size_t offset;       /* the truncation length for RECORD_TRUNCATE */
+    size_t length;
+    int fill;            /* RLE fill byte, or RECORD_LITERAL/RECORD_TRUNCATE */
+    size_t data;         /* payload offset in the slab (RECORD_LITERAL only) */
+};
+
+struct pipeline_slab {
+    struct pipeline_record records[SLAB_RECORDS];
+    size_t count;
+    unsigned char payload[SLAB_PAYLOAD];
+    size_t used;
+};
+
+struct pipeline_decoder {
+    FILE* const* patches;
+    size_t count;
+    size_t current;          /* the patch being read */
+    int in_patch;            /* its magic has been read */
+    int read_trunc;
+    struct hunk_header pending;   /* a REGULAR header awaiting its payload */
+    int has_pending;
+    int code;
+    int patch_code;
+};
+
+/*
+ * The ring is lock-free: the decoder only advances tail and the writer only
+ * advances head, each publishing with a release store that the other side
+ * reads with an acquire load. The lock and condition variable are only
+ * touched by a side that has run out of work and goes to sleep, and by the
+ * other side when it sees the sleeping flag after publishing.
+ */
+struct pipeline {
+    struct pipeline_slab* slabs;
+    struct pipeline_decoder decoder;
+    unsigned head;           /* next slab to write */
+    unsigned tail;           /* next slab to fill */
+    int done;                /* the decoder has published its last slab */
+    int stop;                /* the writer failed; the decoder should quit */
+    size_t hunks;
+    size_t decoder_stalls;
+#if defined(__linux__)
+    int writer_sleeping;
+    int decoder_sleeping;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+#endif
+};
+
+/* records why decoding stopped; a short read is an I/O error or a bad patch */
+static int decoder_fail(struct pipeline_decoder* d, FILE* f, int patch_code) {
+    if (ferror(f)) {
+        d->code = PIPELINE_CODE_READ;
+    } else {
+        d->code = PIPELINE_CODE_PATCH;
+        d->patch_code = patch_code;
+    }
+    return -1;
+}
+
+/**
+ * Decodes the next step of the patch streams into s: a hunk, a truncation,
+ * or just a magic or EOF marker.
+ * @return 0 if it fit (whether or not it added a record), 1 if s is too
+ *         full to take it, or -1 once every patch is read or on error
+ */
+static int decoder_step(
+    struct pipeline_decoder* d,
+    struct pipeline_slab* s,
+    size_t* hunks)
+{
+    unsigned char buf[MAGIC_PATCH_WIDTH];
+    struct pipeline_record* r = NULL;
+    FILE* f = NULL;
+
+    if (d->code != PIPELINE_CODE_OK || d->current == d->count) {
+        return -1;
+    }
+    if (s->count == SLAB_RECORDS) {
+        return 1;
+    }
+    f = d->patches[d->current];
+    r = &s->records[s->count];
+
+    if (!d->in_patch) {
+        if (fread(buf, 1, MAGIC_PATCH_WIDTH, f) < MAGIC_PATCH_WIDTH) {
+            return decoder_fail(d, f, PATCH_CODE_MAGIC_EOF);
+        } else if (!MEMEQ(buf, MAGIC_PATCH, MAGIC_PATCH_WIDTH)) {
+            return decoder_fail(d, f, PATCH_CODE_NO_MAGIC);
+        }
+        d->in_patch = 1;
+        return 0;
+    }
+
+    if (!d->has_pending) {
+        size_t n = 0;
+        if (fread(buf, 1, HUNK_OFFSET_WIDTH, f) < HUNK_OFFSET_WIDTH) {
+            return decoder_fail(d, f, PATCH_CODE_HUNK_EOF);
+        }
+        if (MEMEQ(buf, EOF_MARKER, HUNK_OFFSET_WIDTH)) {
+            /* the truncation length is optional, so a clean EOF is fine */
+            if (d->read_trunc && (n = fread(buf, 1, TRUNC_LENGTH_WIDTH, f))) {
+                if (n < TRUNC_LENGTH_WIDTH) {
+                    return decoder_fail(d, f, PATCH_CODE_TRUNC_EOF);
+                }
+                r->offset = (size_t)decode_big_endian_3(buf);
+                r->length = 0;
+                r->fill = RECORD_TRUNCATE;
+                s->count++;
+            } else if (d->read_trunc && ferror(f)) {
+                return decoder_fail(d, f, PATCH_CODE_TRUNC_EOF);
+            }
+            d->in_patch = 0;
+            d->current++;
+            return 0;
+        }
+
+        d->pending.offset = decode_big_endian_3(buf);
+        if (fread(buf, 1, HUNK_LENGTH_WIDTH, f) < HUNK_LENGTH_WIDTH) {
+            return decoder_fail(d, f, PATCH_CODE_HUNK_EOF);
+        }
+        d->pending.length = decode_big_endian_2(buf);
+        if (d->pending.length == 0) {
+            if (fread(buf, 1, HUNK_LENGTH_WIDTH + 1, f)
+                < HUNK_LENGTH_WIDTH + 1)
+            {
+                return decoder_fail(d, f, PATCH_CODE_HUNK_EOF);
+            }
+            r->offset = (size_t)d->pending.offset;
+            r->length = (size_t)decode_big_endian_2(buf);
+            r->fill = buf[HUNK_LENGTH_WIDTH];
+            s->count++;
+            ++*hunks;
+            return 0;
+        }
+        d->has_pending = 1;
+    }
+
+    if (SLAB_PAYLOAD - s->used < (size_t)d->pending.length) {
+        return 1;
+    }
+    if (fread(s->payload + s->used, 1, d->pending.length, f)
+        < (size_t)d->pending.length)
+    {
+        return decoder_fail(d, f, PATCH_CODE_PAYLOAD_EOF);
+    }
+    r->offset = (size_t)d->pending.offset;
+    r->length = (size_t)d->pending.length;
+    r->fill = RECORD_LITERAL;
+    r->data = s->used;
+    s->used += r->length;
+    s->count++;
+    d->has_pending = 0;
+    ++*hunks;
+    return 0;
+}
+
+struct pipeline_writer {
+    FILE* output;
+    unsigned char* fill_bufs[256];
+    struct write_span spans[SLAB_RECORDS];
+    size_t calls;
+};
+
+/**
+ * Writes every record of a slab in order. Runs of back-to-back hunks are
+ * gathered into one write_spans_at() call.
+ * @return 0 on success or nonzero on error
+ */
+static int writer_drain(
+    struct pipeline_writer* w,
+    const struct pipeline_slab* s)
+{
+    size_t i = 0;
+
+    while (i < s->count) {
+        const struct pipeline_record* r = &s->records[i];
+        size_t offset = r->offset;
+        size_t end = r->offset;
+        size_t n = 0;
+
+        if (r->fill == RECORD_TRUNCATE) {
+            if (truncate_file(w->output, r->offset)) {
+                return -1;
+            }
+            i++;
+            continue;
+        }
+
+        for (; i < s->count && s->records[i].fill != RECORD_TRUNCATE
+            && s->records[i].offset == end; i++, n++)
+        {
+            r = &s->records[i];
+            if (r->fill == RECORD_LITERAL) {
+                w->spans[n].data = s->payload + r->data;
+            } else {
+                if (!w->fill_bufs[r->fill]) {
+                    w->fill_bufs[r->fill] = xmalloc(HUNK_LENGTH_MAX);
+                    memset(w->fill_bufs[r->fill], r->fill, HUNK_LENGTH_MAX);
+                }
+                w->spans[n].data = w->fill_bufs[r->fill];
+            }
+            w->spans[n].length = r->length;
+            end += r->length;
+        }
+        if (write_spans_at(w->output, offset, w->spans, n, &w->calls)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Fills s with as much as the patch streams have left. If p is non-NULL, the
+ * slab is handed over early whenever the writer is idle.
+ * @return nonzero once every patch is read or on error
+ */
+static int pipeline_fill(struct pipeline* p, struct pipeline_slab* s) {
+    int step = 0;
+
+    s->count = 0;
+    s->used = 0;
+    while (!(step = decoder_step(&p->decoder, s, &p->hunks))) {
+#if defined(__linux__)
+        if (s->count
+            && __atomic_load_n(&p->writer_sleeping, __ATOMIC_SEQ_CST))
+        {
+            break;
+        }
+#endif
+    }
+    return step < 0;
+}
+
+#if defined(__linux__)
+
+/* wakes the other side if it is asleep; sleeping is its flag */
+static void pipeline_wake(struct pipeline* p, int* sleeping) {
+    if (__atomic_load_n(sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_broadcast(&p->wake);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+static int ring_full(struct pipeline* p) {
+    return __atomic_load_n(&p->tail, __ATOMIC_RELAXED)
+        - __atomic_load_n(&p->head, __ATOMIC_ACQUIRE) == PIPELINE_SLABS
+        && !__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE);
+}
+
+static int ring_empty(struct pipeline* p) {
+    return __atomic_load_n(&p->head, __ATOMIC_RELAXED)
+        == __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE)
+        && !__atomic_load_n(&p->done, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Sleeps until ready(p) is false. The sleeping flag is raised before the
+ * last check, so a publish that the check misses sees the flag and wakes us.
+ */
+static void pipeline_sleep(
+    struct pipeline* p,
+    int* sleeping,
+    int (*waiting)(struct pipeline*))
+{
+    pthread_mutex_lock(&p->lock);
+    __atomic_store_n(sleeping, 1, __ATOMIC_SEQ_CST);
+    while (waiting(p)) {
+        pthread_cond_wait(&p->wake, &p->lock);
+    }
+    __atomic_store_n(sleeping, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void* pipeline_decoder_run(void* arg) {
+    struct pipeline* p = arg;
+    int finished = 0;
+
+    while (!finished) {
+        unsigned tail = __atomic_load_n(&p->tail, __ATOMIC_RELAXED);
+        if (ring_full(p)) {
+            p->decoder_stalls++;
+            pipeline_sleep(p, &p->decoder_sleeping, ring_full);
+        }
+        if (__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        finished = pipeline_fill(p, &p->slabs[tail % PIPELINE_SLABS]);
+        __atomic_store_n(&p->tail, tail + 1, __ATOMIC_SEQ_CST);
+        pipeline_wake(p, &p->writer_sleeping);
+    }
+    /* done is raised after the last tail, so a writer that sees it sees the
+       last slab too */
+    __atomic_store_n(&p->done, 1, __ATOMIC_SEQ_CST);
+    pipeline_wake(p, &p->writer_sleeping);
+    return NULL;
+}
+
+/**
+ * Writes slabs as the decoder thread publishes them, until it is done.
+ * @return 0 on success or nonzero on a write error
+ */
+static int pipeline_write(
+    struct pipeline* p,
+    struct pipeline_writer* w,
+    struct pipeline_report* report)
+{
+    for (;;) {
+        unsigned head = __atomic_load_n(&p->head, __ATOMIC_RELAXED);
+        if (ring_empty(p)) {
+            report->writer_stalls++;
+            pipeline_sleep(p, &p->writer_sleeping, ring_empty);
+        }
+        if (head == __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE)) {
+            return 0;   /* done, and nothing left */
+        }
+        if (writer_drain(w, &p->slabs[head % PIPELINE_SLABS])) {
+            __atomic_store_n(&p->stop, 1, __ATOMIC_SEQ_CST);
+            pipeline_wake(p, &p->decoder_sleeping);
+            return -1;
+        }
+        report->slabs++;
+        __atomic_store_n(&p->head, head + 1, __ATOMIC_SEQ_CST);
+        pipeline_wake(p, &p->decoder_sleeping);
+    }
+}
+
+#endif
+
+/* decodes and writes one slab at a time on the calling thread */
+static int pipeline_run_serial(
+    struct pipeline* p,
+    struct pipeline_writer* w,
+    struct pipeline_report* report)
+{
+    int finished = 0;
+    while (!finished) {
+        finished = pipeline_fill(p, &p->slabs[0]);
+        if (writer_drain(w, &p->slabs[0])) {
+            return -1;
+        }
+        report->slabs++;
+    }
+    return 0;
+}
+
+int pipeline_apply(
+    FILE* const* patches,
+    size_t count,
+    FILE* output,
+    int read_trunc,
+    struct pipeline_report* report)
+{
+    struct pipeline p;
+    struct pipeline_writer* w = xmalloc(sizeof(*w));
+    int failed = 0;
+    int i;
+
+    memset(report, 0, sizeof(*report));
+    memset(&p, 0, sizeof(p));
+    p.decoder.patches = patches;
+    p.decoder.count = count;
+    p.decoder.read_trunc = read_trunc;
+    p.decoder.code = PIPELINE_CODE_OK;
+    memset(w, 0, sizeof(*w));
+    w->output = output;
+
+#if defined(__linux__)
+    {
+        pthread_t decoder;
+        p.slabs = xmalloc(PIPELINE_SLABS * sizeof(*p.slabs));
+        pthread_mutex_init(&p.lock, NULL);
+        pthread_cond_init(&p.wake, NULL);
+        if (!pthread_create(&decoder, NULL, pipeline_decoder_run, &p)) {
+            failed = pipeline_write(&p, w, report);
+            pthread_join(decoder, NULL);
+        } else {
+            failed = pipeline_run_serial(&p, w, report);
+        }
+        pthread_cond_destroy(&p.wake);
+        pthread_mutex_destroy(&p.lock);
+    }
+#else
+    p.slabs = xmalloc(sizeof(*p.slabs));
+    failed = pipeline_run_serial(&p, w, report);
+#endif
+
+    report->hunks = p.hunks;
+    report->decoder_stalls = p.decoder_stalls;
+    report->calls = w->calls;
+    report->patch = p.decoder.current;
+    report->patch_code = p.decoder.patch_code;
+
+    for (i = 0; i < 256; i++) {
+        free(w->fill_bufs[i]);
+    }
+    free(w);
+    free(p.slabs);
+
+    if (failed) {
+        return PIPELINE_CODE_WRITE;
+    }
+    return p.decoder.code;
+}
@@ -0,0 +1,51 @@
+#ifndef PIPELINE_H_INCLUDED
+#define PIPELINE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*******************************************************************************
+Pipelined apply
+Patches are decoded and applied at the same time: a decoder thread reads hunks
+from the patch streams into a ring of slabs, and the calling thread writes each
+slab to the output as soon as it is handed over. A patch that trickles in
+through a pipe or stdin is being written while the rest of it is still in
+flight, and no patch is ever held in memory whole. Without threads (anywhere but
+Linux), slabs are decoded and written in turn on the calling thread.
+*******************************************************************************/
+
+#define PIPELINE_CODE_OK 0
+#define PIPELINE_CODE_READ 1     /* a patch stream couldn't be read */
+#define PIPELINE_CODE_PATCH 2    /* a patch is malformed; see patch_code */
+#define PIPELINE_CODE_WRITE 3    /* the output couldn't be written */
+
+extern const char* PIPELINE_CODE_STR[];
+
+struct pipeline_report {
+    int patch_code;          /* PATCH_CODE_* value for PIPELINE_CODE_PATCH */
+    size_t patch;            /* which patch failed to read or decode */
+
+    size_t hunks;            /* hunks applied */
+    size_t slabs;            /* slabs handed to the writer */
+    size_t calls;            /* write calls made */
+    size_t writer_stalls;    /* times the writer waited for the decoder */
+    size_t decoder_stalls;   /* times the decoder waited for the writer */
+};
+
+/**
+ * Applies count patches, read from the streams in patches, one after the
+ * other to output, which must already hold the patient. Hunks are written in
+ * patch order, and each patch's truncation (if read_trunc is nonzero) is
+ * applied before the next patch, so the result is the same as applying the
+ * patches one at a time. Reading a stream stops at its EOF marker (or its
+ * truncation length); anything after that is left unread.
+ * @return a PIPELINE_CODE_* value; report is filled in either way
+ */
+int pipeline_apply(
+    FILE* const* patches,
+    size_t count,
+    FILE* output,
+    int read_trunc,
+    struct pipeline_report* report);
+
+#endif
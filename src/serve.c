@@ -0,0 +1,500 @@
+#if defined(__linux__)
+    #define _GNU_SOURCE
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <getopt.h>
+    #include <signal.h>
+    #include <stdio_ext.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+#endif
+
+#include "serve.h"
+#include "util.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+
+#define SERVE_LENGTH_WIDTH 4
+#define SERVE_STREAMS 3
+#define SERVE_REQUEST_MAX (1 << 20)
+
+/* files each worker keeps mapped between requests */
+#define SERVE_CACHED_MAPS 32
+
+static volatile sig_atomic_t serve_stopping = 0;
+
+static void serve_stop(int sig) {
+    (void)sig;
+    serve_stopping = 1;
+}
+
+/* reads or writes all len bytes, retrying short transfers */
+static int read_all(int fd, void* buf, size_t len) {
+    unsigned char* p = buf;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void* buf, size_t len) {
+    const unsigned char* p = buf;
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int serve_address(const char* path, struct sockaddr_un* addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static int serve_connect(const char* path) {
+    struct sockaddr_un addr;
+    int fd = -1;
+
+    if (serve_address(path, &addr)
+        || (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int serve_listen(const char* path) {
+    struct sockaddr_un addr;
+    int fd = -1;
+    int probe = -1;
+
+    if (serve_address(path, &addr)) {
+        fprintf(stderr, "error: socket path is too long: %s\n", path);
+        return -1;
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        goto _ERROR;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        if (errno != EADDRINUSE) {
+            goto _ERROR;
+        }
+        /* a socket file nobody answers on was left by a server that died */
+        if ((probe = serve_connect(path)) >= 0) {
+            close(probe);
+            fprintf(stderr, "error: a server is already listening on %s\n",
+                path);
+            close(fd);
+            return -1;
+        }
+        if (unlink(path) || bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+            goto _ERROR;
+        }
+    }
+    if (listen(fd, SOMAXCONN)) {
+        unlink(path);
+        goto _ERROR;
+    }
+    return fd;
+
+_ERROR:
+    fprintf(stderr, "error: can't listen on %s: %s\n", path, strerror(errno));
+    if (fd >= 0) {
+        close(fd);
+    }
+    return -1;
+}
+
+/**
+ * Receives a request on conn: the client's streams into fds and its body,
+ * which the caller must free(), into *body.
+ * @return the length of the body, or -1 if the request is malformed
+ */
+static long serve_receive(int conn, int* fds, char** body) {
+    unsigned char header[SERVE_LENGTH_WIDTH];
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(SERVE_STREAMS * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg = NULL;
+    size_t received = 0;
+    size_t length = 0;
+    ssize_t n;
+    int i;
+
+    for (i = 0; i < SERVE_STREAMS; i++) {
+        fds[i] = -1;
+    }
+    *body = NULL;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    while ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    received = (size_t)n;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+            && cmsg->cmsg_len == CMSG_LEN(SERVE_STREAMS * sizeof(int)))
+        {
+            memcpy(fds, CMSG_DATA(cmsg), SERVE_STREAMS * sizeof(int));
+        }
+    }
+    if (fds[0] < 0 || (msg.msg_flags & MSG_CTRUNC)
+        || read_all(conn, header + received, sizeof(header) - received))
+    {
+        return -1;
+    }
+
+    length = (size_t)decode_big_endian_n(header, SERVE_LENGTH_WIDTH);
+    if (length == 0 || length > SERVE_REQUEST_MAX) {
+        return -1;
+    }
+    *body = xmalloc(length);
+    if (read_all(conn, *body, length) || (*body)[length - 1] != '\0') {
+        return -1;
+    }
+    return (long)length;
+}
+
+/**
+ * Runs argv in the client's working directory with the client's streams as
+ * stdin, stdout and stderr, then puts back the worker's own.
+ */
+static int serve_dispatch(
+    const char* cwd,
+    int argc,
+    char** argv,
+    const int* fds,
+    serve_command_fn run)
+{
+    int saved[SERVE_STREAMS];
+    int saved_cwd = -1;
+    int status = EXIT_FAILURE;
+    int i;
+
+    if ((saved_cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return EXIT_FAILURE;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < SERVE_STREAMS; i++) {
+        saved[i] = dup(i);
+        dup2(fds[i], i);
+    }
+
+    /* the streams start out as fresh as the client's own would: whatever an
+       earlier request left buffered (e.g. patch bytes after its EOF marker)
+       belongs to that request's client, and is dropped with its flags */
+    __fpurge(stdin);
+    clearerr(stdin);
+    clearerr(stdout);
+    clearerr(stderr);
+
+    if (chdir(cwd)) {
+        fprintf(stderr, "error: can't change to directory %s\n", cwd);
+    } else {
+        optind = 0;
+        status = run(argc, argv);
+    }
+
+    /* the client must get everything the command wrote */
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < SERVE_STREAMS; i++) {
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+    if (fchdir(saved_cwd)) {
+        status = EXIT_FAILURE;
+    }
+    close(saved_cwd);
+    return status;
+}
+
+static void serve_connection(int conn, serve_command_fn run) {
+    unsigned char reply[SERVE_LENGTH_WIDTH];
+    int fds[SERVE_STREAMS];
+    char* body = NULL;
+    char** argv = NULL;
+    long length = serve_receive(conn, fds, &body);
+    int argc = 0;
+    int status;
+    long i;
+
+    if (length < 0) {
+        goto DONE;
+    }
+
+    /* the working directory, then argv[1] onwards */
+    for (i = 0; i < length; i++) {
+        argc += body[i] == '\0';
+    }
+    argv = xmalloc((argc + 1) * sizeof(*argv));
+    argv[0] = "ipsa";
+    argc = 1;
+    for (i = strlen(body) + 1; i < length; i += strlen(body + i) + 1) {
+        argv[argc++] = body + i;
+    }
+    argv[argc] = NULL;
+
+    status = serve_dispatch(body, argc, argv, fds, run);
+    encode_big_endian_n(reply, (uint64_t)status, SERVE_LENGTH_WIDTH);
+    write_all(conn, reply, sizeof(reply));
+
+DONE:
+    for (i = 0; i < SERVE_STREAMS; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    free(argv);
+    free(body);
+}
+
+static void serve_worker(int listener, serve_command_fn run) {
+    /* a client that goes away must not take the worker with it */
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    map_cache_enable(SERVE_CACHED_MAPS);
+
+    for (;;) {
+        int conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            _exit(EXIT_FAILURE);
+        }
+        serve_connection(conn, run);
+        close(conn);
+    }
+}
+
+static pid_t serve_spawn(int listener, serve_command_fn run) {
+    pid_t pid;
+
+    fflush(stdout);
+    fflush(stderr);
+    if ((pid = fork()) == 0) {
+        serve_worker(listener, run);
+    }
+    return pid;
+}
+
+int serve_run(const struct exec_options* eo, serve_command_fn run) {
+    struct sigaction sa;
+    pid_t* workers = NULL;
+    int listener = -1;
+    int ret = EXIT_SUCCESS;
+    int i;
+
+    if (!eo->socket_path) {
+        fprintf(stderr, "error: serve needs --socket PATH\n");
+        return EXIT_FAILURE;
+    }
+    crc32_init();
+    if ((listener = serve_listen(eo->socket_path)) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    /* no SA_RESTART, so that waiting on the workers is interrupted */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    workers = xmalloc(eo->jobs * sizeof(*workers));
+    for (i = 0; i < eo->jobs; i++) {
+        if ((workers[i] = serve_spawn(listener, run)) < 0) {
+            fprintf(stderr, "error: can't start worker: %s\n",
+                strerror(errno));
+            serve_stopping = 1;
+            ret = EXIT_FAILURE;
+            break;
+        }
+    }
+    if (eo->verbose && !serve_stopping) {
+        fprintf(stderr, "info: serving on %s with %d workers\n",
+            eo->socket_path, eo->jobs);
+    }
+
+    /* replace workers that die until told to stop */
+    while (!serve_stopping) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (i = 0; i < eo->jobs; i++) {
+            if (workers[i] != pid) {
+                continue;
+            }
+            fprintf(stderr, "warning: worker %ld exited; restarting it\n",
+                (long)pid);
+            if ((workers[i] = serve_spawn(listener, run)) < 0) {
+                fprintf(stderr, "error: can't start worker: %s\n",
+                    strerror(errno));
+                serve_stopping = 1;
+                ret = EXIT_FAILURE;
+            }
+            break;
+        }
+    }
+
+    for (i = 0; i < eo->jobs; i++) {
+        if (workers[i] > 0) {
+            kill(workers[i], SIGTERM);
+        }
+    }
+    while (wait(NULL) > 0 || errno == EINTR) {
+    }
+    close(listener);
+    unlink(eo->socket_path);
+    free(workers);
+    return ret;
+}
+
+int serve_request(const char* socket_path, int argc, char** argv) {
+    unsigned char header[SERVE_LENGTH_WIDTH];
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(SERVE_STREAMS * sizeof(int))];
+    } control;
+    int fds[SERVE_STREAMS] = { 0, 1, 2 };
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg = NULL;
+    size_t capacity = 256;
+    size_t length = 0;
+    char* body = NULL;
+    int conn = -1;
+    int i;
+
+    if ((conn = serve_connect(socket_path)) < 0) {
+        return -1;
+    }
+
+    body = xmalloc(capacity);
+    while (!getcwd(body, capacity)) {
+        if (errno != ERANGE) {
+            fprintf(stderr, "error: can't get working directory\n");
+            goto _ERROR;
+        }
+        capacity *= 2;
+        body = xrealloc(body, capacity);
+    }
+    length = strlen(body) + 1;
+    for (i = 1; i < argc; i++) {
+        size_t arg_length = strlen(argv[i]) + 1;
+        if (length + arg_length > capacity) {
+            capacity = 2 * (length + arg_length);
+            body = xrealloc(body, capacity);
+        }
+        memcpy(body + length, argv[i], arg_length);
+        length += arg_length;
+    }
+    if (length > SERVE_REQUEST_MAX) {
+        fprintf(stderr, "error: command line is too long to send\n");
+        goto _ERROR;
+    }
+
+    encode_big_endian_n(header, length, SERVE_LENGTH_WIDTH);
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(SERVE_STREAMS * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, SERVE_STREAMS * sizeof(int));
+
+    /* anything this process buffered must come out before the server's */
+    fflush(stdout);
+    fflush(stderr);
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(header)
+        || write_all(conn, body, length)
+        || read_all(conn, header, sizeof(header)))
+    {
+        fprintf(stderr, "error: the server at %s dropped the request\n",
+            socket_path);
+        goto _ERROR;
+    }
+
+    close(conn);
+    free(body);
+    return (int)decode_big_endian_n(header, SERVE_LENGTH_WIDTH);
+
+_ERROR:
+    close(conn);
+    free(body);
+    return EXIT_FAILURE;
+}
+
+#else
+
+int serve_run(const struct exec_options* eo, serve_command_fn run) {
+    (void)eo;
+    (void)run;
+    fprintf(stderr, "error: serve is only supported on Linux\n");
+    return EXIT_FAILURE;
+}
+
+int serve_request(const char* socket_path, int argc, char** argv) {
+    (void)socket_path;
+    (void)argc;
+    (void)argv;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef SERVE_H_INCLUDED
+#define SERVE_H_INCLUDED
+
+#include "options.h"
+
+/*******************************************************************************
+Apply server
+`ipsa serve --socket PATH` runs a pool of worker processes that take commands
+over a Unix domain socket, so that many short invocations (e.g. a build farm
+applying patches to the same few ROMs) share warm state instead of paying for
+process startup, CRC32 table setup and mapping the same patients and compiled
+patches over and over. Each worker keeps its recently used files mapped (see
+map_cache_enable()).
+
+Any other subcommand given --socket becomes a thin client: it sends its command
+line, working directory and standard streams to a worker, which runs the
+command exactly as the client would have and sends back its exit status.
+
+A request is one message carrying the client's stdin, stdout and stderr
+(SCM_RIGHTS) and a 4-byte big-endian length N, followed by N bytes: the
+client's working directory and each of its arguments after the program name,
+all NUL-terminated. The reply is the exit status as a 4-byte big-endian
+integer. Only Linux is supported.
+*******************************************************************************/
+
+/* runs one command line as main() would and returns its exit status */
+typedef int (*serve_command_fn)(int argc, char** argv);
+
+/**
+ * Listens on eo->socket_path with eo->jobs worker processes, each running
+ * requests with run, until SIGINT or SIGTERM. A stale socket file left by a
+ * server that is gone is replaced; a live one is an error.
+ * @return EXIT_SUCCESS once stopped, or EXIT_FAILURE if it couldn't start
+ */
+int serve_run(const struct exec_options* eo, serve_command_fn run);
+
+/**
+ * Has the server listening at socket_path run argv[1] to argv[argc - 1] for
+ * the calling process, and waits for it to finish.
+ * @return the command's exit status, or -1 if no server is listening there
+ */
+int serve_request(const char* socket_path, int argc, char** argv);
+
+#endif
@@ -0,0 +1,442 @@
+#include "config_ipsapply.h"
+
+#if defined(__linux__) && IPSAPPLY_HAVE_URING
+    #define URING_ENABLED
+    #define _GNU_SOURCE
+    #include <errno.h>
+    #include <linux/io_uring.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/syscall.h>
+    #include <sys/types.h>
+    #include <sys/uio.h>
+    #include <unistd.h>
+#endif
+
+#include "uring.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(URING_ENABLED)
+/* the size of each copy buffer; a copy keeps depth / 2 of them in flight */
+#define URING_COPY_CHUNK ((size_t)1 << 18)
+#define URING_COPY_ALIGN 4096
+
+/* spans per vectored write, well under IOV_MAX */
+#define URING_IOV_MAX 256
+
+int uring_init(struct uring* ring, unsigned depth) {
+    struct io_uring_params p;
+    int single_mmap = 0;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    /* a copy queues reads and writes in pairs, so two entries at least */
+    ring->fd = (int)syscall(__NR_io_uring_setup, depth < 2 ? 2 : depth, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    ring->depth = depth;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes
+        + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* since 5.4 both rings live in one mapping */
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        single_mmap = 1;
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        goto _ERROR;
+    }
+    if (single_mmap) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto _ERROR;
+        }
+    }
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto _ERROR;
+    }
+
+    ring->sq_head = (unsigned*)((char*)ring->sq_ring + p.sq_off.head);
+    ring->sq_tail = (unsigned*)((char*)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)((char*)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)((char*)ring->sq_ring + p.sq_off.array);
+    ring->cq_head = (unsigned*)((char*)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned*)((char*)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)((char*)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (char*)ring->cq_ring + p.cq_off.cqes;
+    return 0;
+
+_ERROR:
+    uring_free(ring);
+    return -1;
+}
+
+void uring_free(struct uring* ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/* returns a cleared entry at the tail of the submission queue */
+static struct io_uring_sqe* uring_get_sqe(struct uring* ring) {
+    unsigned index = *ring->sq_tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*)ring->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    return sqe;
+}
+
+/* publishes the entry from uring_get_sqe() to the kernel */
+static void uring_push(struct uring* ring) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+    ring->ops++;
+}
+
+/* submits everything queued and waits until wait completions are posted */
+static int uring_enter(struct uring* ring, unsigned wait) {
+    for (;;) {
+        unsigned submit = *ring->sq_tail
+            - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        long ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+            IORING_ENTER_GETEVENTS, NULL, 0);
+        ring->submits++;
+        if (ret >= 0) {
+            return 0;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/* takes the next completion, waiting for it if there is none yet */
+static int uring_pop(struct uring* ring, uint64_t* user_data, int* res) {
+    unsigned head = *ring->cq_head;
+    const struct io_uring_cqe* cqe = NULL;
+
+    while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (uring_enter(ring, 1)) {
+            return -1;
+        }
+    }
+    cqe = (const struct io_uring_cqe*)ring->cqes + (head & *ring->cq_mask);
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* finishes a write the kernel cut short, skip bytes into spans */
+static int uring_pwrite_rest(
+    int fd,
+    uint64_t offset,
+    const struct write_span* spans,
+    size_t count,
+    size_t skip)
+{
+    size_t i;
+    for (i = 0; i < count; i++) {
+        const unsigned char* data = spans[i].data;
+        size_t length = spans[i].length;
+        if (skip >= length) {
+            skip -= length;
+            offset += length;
+            continue;
+        }
+        data += skip;
+        offset += skip;
+        length -= skip;
+        skip = 0;
+        while (length > 0) {
+            ssize_t n = pwrite(fd, data, length, (off_t)offset);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            data += n;
+            offset += (uint64_t)n;
+            length -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+int uring_copy_file(struct uring* ring, FILE* src_file, FILE* dest_file) {
+    struct stat st;
+    int src = fileno(src_file);
+    int dest = fileno(dest_file);
+    unsigned slots = ring->depth / 2 ? ring->depth / 2 : 1;
+    unsigned char* bufs = NULL;
+    off_t* slot_off = NULL;
+    int* got = NULL;
+    int* put = NULL;
+    off_t off = 0;
+    off_t size = 0;
+
+    if (src < 0 || dest < 0 || fflush(dest_file) || fstat(src, &st)
+        || !S_ISREG(st.st_mode))
+    {
+        return -1;
+    }
+    size = st.st_size;
+
+    bufs = xmalloc_aligned(URING_COPY_ALIGN, slots * URING_COPY_CHUNK);
+    slot_off = xmalloc(slots * sizeof(*slot_off));
+    got = xmalloc(slots * sizeof(*got));
+    put = xmalloc(slots * sizeof(*put));
+
+    while (off < size) {
+        off_t redo = 0;
+        unsigned n = 0;
+        unsigned k;
+
+        /* each read is linked to the write of the same buffer */
+        while (n < slots && off < size) {
+            size_t len = size - off < (off_t)URING_COPY_CHUNK
+                ? (size_t)(size - off) : URING_COPY_CHUNK;
+            struct io_uring_sqe* sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_READ;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->fd = src;
+            sqe->addr = (uint64_t)(size_t)(bufs + n * URING_COPY_CHUNK);
+            sqe->len = (unsigned)len;
+            sqe->off = (uint64_t)off;
+            sqe->user_data = 2 * n;
+            uring_push(ring);
+
+            sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = dest;
+            sqe->addr = (uint64_t)(size_t)(bufs + n * URING_COPY_CHUNK);
+            sqe->len = (unsigned)len;
+            sqe->off = (uint64_t)off;
+            sqe->user_data = 2 * n + 1;
+            uring_push(ring);
+
+            slot_off[n++] = off;
+            off += len;
+        }
+
+        if (uring_enter(ring, 2 * n)) {
+            goto _ERROR;
+        }
+        for (k = 0; k < 2 * n; k++) {
+            uint64_t user_data = 0;
+            int res = 0;
+            if (uring_pop(ring, &user_data, &res)) {
+                goto _ERROR;
+            }
+            if (user_data & 1) {
+                put[user_data / 2] = res;
+            } else {
+                got[user_data / 2] = res;
+            }
+        }
+
+        /* a short read cancels its write; what it did read is written here,
+           and the next batch starts over from where it stopped */
+        redo = off;
+        for (k = 0; k < n; k++) {
+            size_t len = (k + 1 < n ? slot_off[k + 1] : off) - slot_off[k];
+            struct write_span span;
+            span.data = bufs + k * URING_COPY_CHUNK;
+            span.length = len;
+            if (got[k] < 0) {
+                errno = -got[k];
+                goto _ERROR;
+            } else if ((size_t)got[k] < len) {
+                span.length = (size_t)got[k];
+                if (uring_pwrite_rest(dest, slot_off[k], &span, 1, 0)) {
+                    goto _ERROR;
+                }
+                if (slot_off[k] + got[k] < redo) {
+                    redo = slot_off[k] + got[k];
+                }
+                if (got[k] == 0) {
+                    /* the file shrank since it was measured */
+                    size = slot_off[k];
+                }
+            } else if (put[k] < 0) {
+                errno = -put[k];
+                goto _ERROR;
+            } else if ((size_t)put[k] < len
+                && uring_pwrite_rest(dest, slot_off[k], &span, 1,
+                    (size_t)put[k]))
+            {
+                goto _ERROR;
+            }
+        }
+        off = redo;
+    }
+
+    free(put);
+    free(got);
+    free(slot_off);
+    free_aligned(bufs);
+    return 0;
+
+_ERROR:
+    free(put);
+    free(got);
+    free(slot_off);
+    free_aligned(bufs);
+    return -1;
+}
+
+/* one queued vectored write */
+struct uring_op {
+    uint64_t offset;
+    size_t length;
+    const struct write_span* spans;
+    size_t count;
+};
+
+int uring_write_runs(
+    struct uring* ring,
+    FILE* f,
+    const struct uring_write* runs,
+    size_t count)
+{
+    int fd = fileno(f);
+    struct iovec* iovs = xmalloc(ring->depth * URING_IOV_MAX * sizeof(*iovs));
+    struct uring_op* ops = xmalloc(ring->depth * sizeof(*ops));
+    uint64_t offset = count ? runs[0].offset : 0;
+    size_t r = 0;
+    size_t s = 0;   /* spans of runs[r] already queued */
+
+    if (fd < 0 || fflush(f)) {
+        free(ops);
+        free(iovs);
+        return -1;
+    }
+
+    while (r < count) {
+        unsigned n = 0;
+        unsigned k;
+
+        while (n < ring->depth && r < count) {
+            struct iovec* iov = iovs + n * URING_IOV_MAX;
+            struct uring_op* op = &ops[n];
+            struct io_uring_sqe* sqe = NULL;
+
+            op->offset = offset;
+            op->length = 0;
+            op->spans = runs[r].spans + s;
+            op->count = 0;
+            while (s < runs[r].count && op->count < URING_IOV_MAX) {
+                iov[op->count].iov_base = (void*)runs[r].spans[s].data;
+                iov[op->count].iov_len = runs[r].spans[s].length;
+                op->length += runs[r].spans[s].length;
+                op->count++;
+                s++;
+            }
+            offset += op->length;
+            if (s == runs[r].count && ++r < count) {
+                s = 0;
+                offset = runs[r].offset;
+            }
+
+            sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t)(size_t)iov;
+            sqe->len = (unsigned)op->count;
+            sqe->off = op->offset;
+            sqe->user_data = n++;
+            uring_push(ring);
+        }
+
+        if (uring_enter(ring, n)) {
+            goto _ERROR;
+        }
+        for (k = 0; k < n; k++) {
+            uint64_t user_data = 0;
+            int res = 0;
+            const struct uring_op* op = NULL;
+            if (uring_pop(ring, &user_data, &res)) {
+                goto _ERROR;
+            }
+            op = &ops[user_data];
+            if (res < 0) {
+                errno = -res;
+                goto _ERROR;
+            } else if ((size_t)res < op->length && uring_pwrite_rest(fd,
+                op->offset, op->spans, op->count, (size_t)res))
+            {
+                goto _ERROR;
+            }
+        }
+    }
+
+    free(ops);
+    free(iovs);
+    return 0;
+
+_ERROR:
+    free(ops);
+    free(iovs);
+    return -1;
+}
+#else
+int uring_init(struct uring* ring, unsigned depth) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    (void)depth;
+    return -1;
+}
+
+void uring_free(struct uring* ring) {
+    (void)ring;
+}
+
+int uring_copy_file(struct uring* ring, FILE* src, FILE* dest) {
+    (void)ring;
+    (void)src;
+    (void)dest;
+    return -1;
+}
+
+int uring_write_runs(
+    struct uring* ring,
+    FILE* f,
+    const struct uring_write* runs,
+    size_t count)
+{
+    (void)ring;
+    (void)f;
+    (void)runs;
+    (void)count;
+    return -1;
+}
+#endif
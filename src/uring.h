@@ -0,0 +1,72 @@
+#ifndef URING_H_INCLUDED
+#define URING_H_INCLUDED
+
+#include "util.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*******************************************************************************
+io_uring
+An I/O backend that queues the patient copy and the hunk writes on an io_uring
+and hands them to the kernel in batches, one io_uring_enter() call per batch
+instead of one system call per read or write. It is only built on Linux when
+meson finds <linux/io_uring.h> (the io_uring feature option); elsewhere, and on
+kernels that refuse to set up a ring, uring_init() fails and callers use stdio.
+*******************************************************************************/
+
+struct uring {
+    int fd;
+    unsigned depth;          /* operations in flight at most */
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;           /* may be sq_ring */
+    size_t cq_ring_size;
+    void* sqes;
+    size_t sqes_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    void* cqes;
+    size_t submits;          /* io_uring_enter() calls */
+    size_t ops;              /* reads and writes queued */
+};
+
+/**
+ * Sets up a ring with room for depth operations at once.
+ * @return 0 on success, or nonzero if io_uring isn't available here
+ */
+int uring_init(struct uring* ring, unsigned depth);
+void uring_free(struct uring* ring);
+
+/**
+ * Copies the whole regular file src to the start of dest as batches of
+ * linked read and write operations, through buffers of the ring's own. Their
+ * file offsets aren't used or moved.
+ * @return 0 on success or nonzero on error
+ */
+int uring_copy_file(struct uring* ring, FILE* src, FILE* dest);
+
+/* a run of spans to be written back to back at offset */
+struct uring_write {
+    uint64_t offset;
+    const struct write_span* spans;
+    size_t count;
+};
+
+/**
+ * Writes count runs to f, each as one or more vectored write operations,
+ * queued up to the ring's depth at a time. f is flushed first.
+ * @return 0 on success or nonzero on error
+ */
+int uring_write_runs(
+    struct uring* ring,
+    FILE* f,
+    const struct uring_write* runs,
+    size_t count);
+
+#endif
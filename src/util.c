@@ -1,11 +1,25 @@
 #if defined(__linux__)
-    #define _POSIX_C_SOURCE 200809L
+    #define _GNU_SOURCE
+    #include <errno.h>
+    #include <fcntl.h>
     #include <unistd.h>
+    #include <linux/fs.h>
+    #include <pthread.h>
+    #include <sys/ioctl.h>
+    #include <sys/mman.h>
+    #include <sys/sendfile.h>
+    #include <sys/stat.h>
     #include <sys/types.h>
+    #include <sys/uio.h>
+    #include <time.h>
+    #ifndef FICLONE
+        #define FICLONE _IOW(0x94, 9, int)
+    #endif
 #elif defined(_WIN32)
     #define WIN32_LEAN_AND_MEAN
     #include <windows.h>
     #include <io.h>
+    #include <malloc.h>
 #else
     #error "Must be compiled on/for Linux or Windows"
 #endif
@@ -23,8 +37,57 @@ void* xmalloc(size_t size) {
     return ret;
 }
 
-int truncate_file(FILE* f, int bytes) {
-    if (bytes < 0) {
+void* xrealloc(void* p, size_t size) {
+    void* ret = realloc(p, size);
+    if (!ret && size) {
+        fprintf(stderr, "memory exhausted allocating %lu bytes\n", (unsigned long)size);
+        abort();
+    }
+    return ret;
+}
+
+void encode_big_endian_n(unsigned char* out, uint64_t value, int width) {
+    while (width--) {
+        out[width] = (unsigned char)(value & 0xFF);
+        value >>= 8;
+    }
+}
+
+uint64_t decode_big_endian_n(const unsigned char* in, int width) {
+    uint64_t value = 0;
+    int i;
+    for (i = 0; i < width; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+void* xmalloc_aligned(size_t alignment, size_t size) {
+    void* ret = NULL;
+#if defined(__linux__)
+    if (posix_memalign(&ret, alignment, size)) {
+        ret = NULL;
+    }
+#elif defined(_WIN32)
+    ret = _aligned_malloc(size, alignment);
+#endif
+    if (!ret) {
+        fprintf(stderr, "memory exhausted allocating %lu bytes\n", (unsigned long)size);
+        abort();
+    }
+    return ret;
+}
+
+void free_aligned(void* p) {
+#if defined(__linux__)
+    free(p);
+#elif defined(_WIN32)
+    _aligned_free(p);
+#endif
+}
+
+int truncate_file(FILE* f, uint64_t bytes) {
+    if (fflush(f)) {
         return -1;
     }
 #if defined(__linux__)
@@ -51,7 +114,7 @@ int truncate_file(FILE* f, int bytes) {
         }
         /* may need to use SetFilePointer on the HANDLE if this doesn't work. */
         /* may also need to add or subtract 1 from bytes? */
-        fseek(f, bytes, SEEK_SET);
+        _fseeki64(f, (__int64)bytes, SEEK_SET);
         SetEndOfFile(h);
         /* we already fseek()ed to the new end of the file. */
         /* no need to close the fd or HANDLE per the _get_osfhandle() docs */
@@ -60,17 +123,303 @@ int truncate_file(FILE* f, int bytes) {
     return 0;
 }
 
-int copy_file(FILE* src, FILE* dest) {
-    /* there are OS-specific functions for this,
-       but a read/write loop works for now */
+int punch_hole(FILE* f, uint64_t offset, uint64_t length) {
+    if (fflush(f)) {
+        return -1;
+    }
+#if defined(__linux__)
+    {
+        struct stat st;
+        uint64_t end = offset + length;
+        int fd = fileno(f);
+        if (fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+            return -1;
+        }
+        if (offset < (uint64_t)st.st_size && fallocate(fd,
+            FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset,
+            (off_t)((uint64_t)st.st_size < end ? (uint64_t)st.st_size : end)
+                - (off_t)offset))
+        {
+            return -1;
+        }
+        if (end > (uint64_t)st.st_size && ftruncate(fd, (off_t)end)) {
+            return -1;
+        }
+        return 0;
+    }
+#elif defined(_WIN32)
+    /* files aren't sparse unless marked with FSCTL_SET_SPARSE first */
+    (void)f;
+    (void)offset;
+    (void)length;
+    return -1;
+#endif
+}
+
+int sync_file(FILE* f) {
+    if (fflush(f)) {
+        return -1;
+    }
+#if defined(__linux__)
+    return fsync(fileno(f));
+#elif defined(_WIN32)
+    return _commit(_fileno(f));
+#endif
+}
 
-    const size_t buflen = 4096;
-    unsigned char* buf = xmalloc(buflen);
+int sync_parent_dir(const char* path) {
+#if defined(__linux__)
+    const char* slash = strrchr(path, '/');
+    char* dir = NULL;
+    int fd = -1;
+    int ret = 0;
+
+    if (!slash) {
+        dir = xmalloc(2);
+        strcpy(dir, ".");
+    } else {
+        size_t len = slash == path ? 1 : (size_t)(slash - path);
+        dir = xmalloc(len + 1);
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+    }
+    if ((fd = open(dir, O_RDONLY)) < 0) {
+        free(dir);
+        return -1;
+    }
+    ret = fsync(fd);
+    close(fd);
+    free(dir);
+    return ret;
+#elif defined(_WIN32)
+    /* NTFS journals directory entries itself */
+    (void)path;
+    return 0;
+#endif
+}
+
+int make_dir(const char* path) {
+#if defined(__linux__)
+    if (mkdir(path, 0777) && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+#elif defined(_WIN32)
+    if (!CreateDirectoryA(path, NULL)
+        && GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+int replace_file(const char* from, const char* to) {
+#if defined(__linux__)
+    return rename(from, to);
+#elif defined(_WIN32)
+    return !MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING);
+#endif
+}
+
+unsigned long process_id(void) {
+#if defined(__linux__)
+    return (unsigned long)getpid();
+#elif defined(_WIN32)
+    return (unsigned long)GetCurrentProcessId();
+#endif
+}
+
+const char* COPY_STRATEGY_STR[] = {
+    "none",
+    "reflink",
+    "copy_file_range",
+    "sendfile",
+    "read/write",
+    "SEEK_DATA/SEEK_HOLE",
+    /* add new strings between these */
+    "COPY_STRATEGY_STR bounds error"
+};
+
+#define COPY_BUFLEN ((size_t)1 << 20)
+#define COPY_BUFALIGN 4096
+
+#if defined(__linux__)
+/*
+ * Copies from src to the current offset of dest. If src_off is non-NULL, src
+ * is a regular file read from *src_off (which is advanced) without using its
+ * file offset; otherwise src is read sequentially until EOF.
+ */
+static int copy_fd_range(int src, off_t* src_off, int dest, int* strategy) {
+    struct stat src_st;
+    struct stat dest_st;
+    off_t remaining = 0;
+    unsigned char* buf = NULL;
+
+    if (strategy) {
+        *strategy = COPY_STRATEGY_NONE;
+    }
+    if (fstat(src, &src_st) || fstat(dest, &dest_st)) {
+        return -1;
+    }
+
+    if (src_off) {
+        remaining = src_st.st_size - *src_off;
+
+        /* a whole-file copy into an empty file can share extents outright */
+        if (*src_off == 0 && remaining > 0 && S_ISREG(dest_st.st_mode)
+            && dest_st.st_size == 0 && lseek(dest, 0, SEEK_CUR) == 0
+            && ioctl(dest, FICLONE, src) == 0)
+        {
+            if (strategy) {
+                *strategy = COPY_STRATEGY_REFLINK;
+            }
+            *src_off += remaining;
+            return lseek(dest, remaining, SEEK_SET) < 0 ? -1 : 0;
+        }
+
+        /* in-kernel copies; each one may fail before or part way through the
+           copy, in which case the next strategy picks up where it stopped */
+        while (remaining > 0) {
+            ssize_t n = copy_file_range(src, src_off, dest, NULL, remaining, 0);
+            if (n <= 0) {
+                break;
+            }
+            remaining -= n;
+            if (strategy) {
+                *strategy = COPY_STRATEGY_COPY_FILE_RANGE;
+            }
+        }
+        while (remaining > 0) {
+            ssize_t n = sendfile(dest, src, src_off, remaining);
+            if (n <= 0) {
+                break;
+            }
+            remaining -= n;
+            if (strategy) {
+                *strategy = COPY_STRATEGY_SENDFILE;
+            }
+        }
+        if (remaining == 0) {
+            return 0;
+        }
+    }
+
+    /* read/write loop; also handles pipes and files that grew meanwhile */
+    buf = xmalloc_aligned(COPY_BUFALIGN, COPY_BUFLEN);
+    for (;;) {
+        ssize_t chars_read = src_off
+            ? pread(src, buf, COPY_BUFLEN, *src_off)
+            : read(src, buf, COPY_BUFLEN);
+        ssize_t written = 0;
+        if (chars_read == 0) {
+            break;
+        } else if (chars_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            goto _ERROR;
+        }
+        while (written < chars_read) {
+            ssize_t n = write(dest, buf + written, chars_read - written);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                goto _ERROR;
+            }
+            written += n;
+        }
+        if (src_off) {
+            *src_off += chars_read;
+        }
+        if (strategy) {
+            *strategy = COPY_STRATEGY_READ_WRITE;
+        }
+    }
+
+    free_aligned(buf);
+    return 0;
+
+_ERROR:
+    free_aligned(buf);
+    return -1;
+}
+
+int copy_fd(int src, int dest, int* strategy) {
+    struct stat st;
+    off_t src_off = 0;
+
+    if (fstat(src, &st)) {
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode) || (src_off = lseek(src, 0, SEEK_CUR)) < 0) {
+        return copy_fd_range(src, NULL, dest, strategy);
+    }
+    if (copy_fd_range(src, &src_off, dest, strategy)) {
+        return -1;
+    }
+    return lseek(src, src_off, SEEK_SET) < 0 ? -1 : 0;
+}
+
+int copy_fd_at(int src, uint64_t src_offset, int dest, int* strategy) {
+    off_t src_off = (off_t)src_offset;
+    return copy_fd_range(src, &src_off, dest, strategy);
+}
+#elif defined(_WIN32)
+int copy_fd(int src, int dest, int* strategy) {
+    (void)src;
+    (void)dest;
+    if (strategy) {
+        *strategy = COPY_STRATEGY_NONE;
+    }
+    return -1;
+}
 
+int copy_fd_at(int src, uint64_t src_offset, int dest, int* strategy) {
+    (void)src_offset;
+    return copy_fd(src, dest, strategy);
+}
+#endif
+
+int copy_file(FILE* src, FILE* dest, int* strategy) {
+    unsigned char* buf = NULL;
     int done = 0;
+
+    if (strategy) {
+        *strategy = COPY_STRATEGY_NONE;
+    }
+
+#if defined(__linux__)
+    /* hand seekable files over to copy_fd() at the equivalent fd offsets */
+    {
+        int src_fd = fileno(src);
+        int dest_fd = fileno(dest);
+        long src_off = ftell(src);
+        long dest_off = 0;
+        if (src_fd >= 0 && dest_fd >= 0 && src_off >= 0 && !fflush(dest)
+            && (dest_off = ftell(dest)) >= 0
+            && lseek(src_fd, src_off, SEEK_SET) >= 0
+            && lseek(dest_fd, dest_off, SEEK_SET) >= 0)
+        {
+            off_t end = 0;
+            if (copy_fd(src_fd, dest_fd, strategy)
+                || (end = lseek(dest_fd, 0, SEEK_CUR)) < 0
+                || fseek(src, 0, SEEK_END)
+                || fseek(dest, (long)end, SEEK_SET))
+            {
+                return -1;
+            }
+            return 0;
+        }
+        clearerr(src);
+    }
+#endif
+
+    buf = xmalloc_aligned(COPY_BUFALIGN, COPY_BUFLEN);
     while (!done) {
-        size_t chars_read = fread(buf, 1, buflen, src);
-        if (chars_read < buflen) {
+        size_t chars_read = fread(buf, 1, COPY_BUFLEN, src);
+        if (chars_read < COPY_BUFLEN) {
             if (feof(src)) {
                 /* write the last (partial) block, then end the loop */
                 done = 1;
@@ -81,28 +430,824 @@ int copy_file(FILE* src, FILE* dest) {
         if (fwrite(buf, 1, chars_read, dest) < chars_read) {
             goto _ERROR;
         }
+        if (strategy) {
+            *strategy = COPY_STRATEGY_READ_WRITE;
+        }
     }
 
-    free(buf);
+    free_aligned(buf);
     return 0;
 
 _ERROR:
-    free(buf);
+    free_aligned(buf);
+    return -1;
+}
+
+#if defined(__linux__)
+/* copies length bytes from src at src_off to dest at dest_off */
+static int copy_fd_span(
+    int src,
+    off_t src_off,
+    int dest,
+    off_t dest_off,
+    off_t length)
+{
+    unsigned char* buf = NULL;
+
+    while (length > 0) {
+        ssize_t n = copy_file_range(src, &src_off, dest, &dest_off,
+            (size_t)length, 0);
+        if (n <= 0) {
+            break;
+        }
+        length -= n;
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    buf = xmalloc_aligned(COPY_BUFALIGN, COPY_BUFLEN);
+    while (length > 0) {
+        size_t want = (off_t)COPY_BUFLEN < length ? COPY_BUFLEN : (size_t)length;
+        ssize_t chars_read = pread(src, buf, want, src_off);
+        ssize_t written = 0;
+        if (chars_read <= 0) {
+            if (chars_read < 0 && errno == EINTR) {
+                continue;
+            }
+            goto _ERROR;
+        }
+        while (written < chars_read) {
+            ssize_t n = pwrite(dest, buf + written, chars_read - written,
+                dest_off + written);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                goto _ERROR;
+            }
+            written += n;
+        }
+        src_off += chars_read;
+        dest_off += chars_read;
+        length -= chars_read;
+    }
+
+    free_aligned(buf);
+    return 0;
+
+_ERROR:
+    free_aligned(buf);
     return -1;
 }
 
+int copy_file_sparse(FILE* src, FILE* dest, int* strategy) {
+    struct stat src_st;
+    struct stat dest_st;
+    int src_fd = fileno(src);
+    int dest_fd = fileno(dest);
+    off_t start = 0;
+    off_t data = 0;
+
+    if (src_fd < 0 || dest_fd < 0 || fflush(dest)
+        || fstat(src_fd, &src_st) || fstat(dest_fd, &dest_st)
+        || !S_ISREG(src_st.st_mode) || !S_ISREG(dest_st.st_mode)
+        || dest_st.st_size != 0 || (start = ftell(src)) < 0)
+    {
+        return copy_file(src, dest, strategy);
+    }
+    /* ENXIO just means there is no data past start */
+    if (lseek(src_fd, start, SEEK_DATA) < 0 && errno != ENXIO) {
+        return copy_file(src, dest, strategy);
+    }
+
+    /* a reflink shares the holes along with everything else */
+    if (start == 0 && src_st.st_size > 0
+        && ioctl(dest_fd, FICLONE, src_fd) == 0)
+    {
+        if (strategy) {
+            *strategy = COPY_STRATEGY_REFLINK;
+        }
+    } else {
+        if (strategy) {
+            *strategy = COPY_STRATEGY_SPARSE;
+        }
+        for (data = start; data < src_st.st_size;) {
+            off_t hole = 0;
+            if ((data = lseek(src_fd, data, SEEK_DATA)) < 0) {
+                if (errno == ENXIO) {
+                    break;
+                }
+                return -1;
+            }
+            if ((hole = lseek(src_fd, data, SEEK_HOLE)) < 0
+                || copy_fd_span(src_fd, data, dest_fd, data - start,
+                    hole - data))
+            {
+                return -1;
+            }
+            data = hole;
+        }
+        if (ftruncate(dest_fd, src_st.st_size - start)) {
+            return -1;
+        }
+    }
+
+    if (fseek(src, 0, SEEK_END) || fseek(dest, 0, SEEK_END)) {
+        return -1;
+    }
+    return 0;
+}
+#elif defined(_WIN32)
+int copy_file_sparse(FILE* src, FILE* dest, int* strategy) {
+    return copy_file(src, dest, strategy);
+}
+#endif
+
+#define SPAN_BATCH 256
+
+#if defined(__linux__)
+int write_spans_at(
+    FILE* f,
+    uint64_t offset,
+    const struct write_span* spans,
+    size_t count,
+    size_t* calls)
+{
+    struct iovec iov[SPAN_BATCH];
+    size_t i = 0;
+    size_t skip = 0;   /* bytes of spans[i] already written */
+    int fd = fileno(f);
+
+    if (fd < 0 || fflush(f)) {
+        return -1;
+    }
+
+    for (;;) {
+        size_t n = 0;
+        ssize_t written = 0;
+
+        while (i < count && spans[i].length == skip) {
+            i++;
+            skip = 0;
+        }
+        if (i == count) {
+            break;
+        }
+
+        for (n = 0; i + n < count && n < SPAN_BATCH; n++) {
+            size_t from = n == 0 ? skip : 0;
+            iov[n].iov_base = (unsigned char*)spans[i + n].data + from;
+            iov[n].iov_len = spans[i + n].length - from;
+        }
+        written = pwritev(fd, iov, (int)n, (off_t)offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (calls) {
+            ++*calls;
+        }
+        offset += (uint64_t)written;
+
+        /* advance past whatever was written, which may end mid-span */
+        while (written > 0) {
+            size_t left = spans[i].length - skip;
+            if ((size_t)written >= left) {
+                written -= left;
+                i++;
+                skip = 0;
+            } else {
+                skip += written;
+                written = 0;
+            }
+        }
+    }
+    return 0;
+}
+#elif defined(_WIN32)
+int write_spans_at(
+    FILE* f,
+    uint64_t offset,
+    const struct write_span* spans,
+    size_t count,
+    size_t* calls)
+{
+    size_t i;
+    if (fseek(f, (long)offset, SEEK_SET)) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (fwrite(spans[i].data, 1, spans[i].length, f) < spans[i].length) {
+            return -1;
+        }
+        if (calls) {
+            ++*calls;
+        }
+    }
+    return 0;
+}
+#endif
+
+/*******************************************************************************
+Memory-mapped files
+*******************************************************************************/
+#if defined(__linux__)
+static void map_file_reset(struct file_map* m) {
+    m->data = NULL;
+    m->size = 0;
+    m->fd = -1;
+    m->heap = 0;
+    m->cached = 0;
+}
+
+/* a mapping kept by the map cache, shared by every map handed out for it */
+struct map_cache_entry {
+    char* path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct file_map map;
+    size_t refs;      /* maps handed out and not unmapped yet */
+    uint64_t used;    /* when a map was last handed out */
+    int stale;        /* the file changed; released once refs reaches 0 */
+};
+
+static struct map_cache_entry* map_cache = NULL;
+static size_t map_cache_capacity = 0;
+static size_t map_cache_count = 0;
+static uint64_t map_cache_clock = 0;
+static pthread_mutex_t map_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int map_file_read_direct(const char* path, struct file_map* m);
+
+void map_cache_enable(size_t capacity) {
+    if (map_cache || capacity == 0) {
+        return;
+    }
+    map_cache = xmalloc(capacity * sizeof(*map_cache));
+    map_cache_capacity = capacity;
+}
+
+/* unmaps the entry at i and moves the last entry into its place */
+static void map_cache_release(size_t i) {
+    struct map_cache_entry* entry = &map_cache[i];
+    entry->map.cached = 0;
+    unmap_file(&entry->map);
+    free(entry->path);
+    map_cache[i] = map_cache[--map_cache_count];
+}
+
+static int map_cache_matches(
+    const struct map_cache_entry* entry,
+    const struct stat* st)
+{
+    return entry->dev == st->st_dev && entry->ino == st->st_ino
+        && entry->size == st->st_size
+        && entry->mtime.tv_sec == st->st_mtim.tv_sec
+        && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static int map_cache_read(const char* path, struct file_map* m) {
+    struct map_cache_entry* entry = NULL;
+    struct stat st;
+    size_t victim = (size_t)-1;
+    size_t i;
+
+    if (stat(path, &st)) {
+        map_file_reset(m);
+        return -1;
+    }
+
+    pthread_mutex_lock(&map_cache_lock);
+    for (i = 0; i < map_cache_count; i++) {
+        entry = &map_cache[i];
+        if (entry->stale || !STREQ(entry->path, path)) {
+            continue;
+        }
+        if (map_cache_matches(entry, &st)) {
+            entry->refs++;
+            entry->used = ++map_cache_clock;
+            *m = entry->map;
+            m->cached = 1;
+            pthread_mutex_unlock(&map_cache_lock);
+            return 0;
+        }
+        entry->stale = 1;
+        if (entry->refs == 0) {
+            map_cache_release(i);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&map_cache_lock);
+
+    /* the identity is taken from the file that was actually mapped */
+    if (map_file_read_direct(path, m)) {
+        return -1;
+    }
+    if (fstat(m->fd, &st)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&map_cache_lock);
+    if (map_cache_count == map_cache_capacity) {
+        /* evict the least recently used entry that is not in use */
+        for (i = 0; i < map_cache_count; i++) {
+            if (map_cache[i].refs == 0 && (victim == (size_t)-1
+                || map_cache[i].used < map_cache[victim].used))
+            {
+                victim = i;
+            }
+        }
+        if (victim == (size_t)-1) {
+            pthread_mutex_unlock(&map_cache_lock);
+            return 0;
+        }
+        map_cache_release(victim);
+    }
+    entry = &map_cache[map_cache_count++];
+    entry->path = xmalloc(strlen(path) + 1);
+    strcpy(entry->path, path);
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtim;
+    entry->map = *m;
+    entry->refs = 1;
+    entry->used = ++map_cache_clock;
+    entry->stale = 0;
+    m->cached = 1;
+    pthread_mutex_unlock(&map_cache_lock);
+    return 0;
+}
+
+/* drops a reference to the cache entry m was handed out from */
+static void map_cache_unref(const struct file_map* m) {
+    size_t i;
+
+    pthread_mutex_lock(&map_cache_lock);
+    for (i = 0; i < map_cache_count; i++) {
+        struct map_cache_entry* entry = &map_cache[i];
+        if (entry->map.fd == m->fd) {
+            if (--entry->refs == 0 && entry->stale) {
+                map_cache_release(i);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&map_cache_lock);
+}
+
+int map_file_read(const char* path, struct file_map* m) {
+    if (map_cache) {
+        return map_cache_read(path, m);
+    }
+    return map_file_read_direct(path, m);
+}
+
+static int map_file_read_direct(const char* path, struct file_map* m) {
+    struct stat st;
+    void* data = NULL;
+
+    map_file_reset(m);
+    if ((m->fd = open(path, O_RDONLY)) < 0) {
+        return -1;
+    }
+    if (fstat(m->fd, &st) || !S_ISREG(st.st_mode)
+        || (uintmax_t)st.st_size > (size_t)-1)
+    {
+        goto _ERROR;
+    }
+    m->size = (size_t)st.st_size;
+    if (m->size == 0) {
+        return 0;
+    }
+    data = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, m->fd, 0);
+    if (data == MAP_FAILED) {
+        goto _ERROR;
+    }
+    m->data = data;
+    return 0;
+
+_ERROR:
+    close(m->fd);
+    map_file_reset(m);
+    return -1;
+}
+
+int map_file_write(const char* path, size_t size, struct file_map* m) {
+    return map_file_write_from(path, -1, size, m, NULL);
+}
+
+int map_file_write_from(
+    const char* path,
+    int src_fd,
+    size_t size,
+    struct file_map* m,
+    int* strategy)
+{
+    struct stat st;
+    void* data = NULL;
+    int regular = 0;
+    int error;
+
+    map_file_reset(m);
+    if (strategy) {
+        *strategy = COPY_STRATEGY_NONE;
+    }
+    if ((m->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0) {
+        return -1;
+    }
+    if (fstat(m->fd, &st) || !S_ISREG(st.st_mode) || (off_t)size < 0) {
+        goto _ERROR;
+    }
+    regular = 1;
+    if (src_fd >= 0 && copy_fd_at(src_fd, 0, m->fd, strategy)) {
+        goto _ERROR;
+    }
+    if (ftruncate(m->fd, (off_t)size)) {
+        goto _ERROR;
+    }
+    m->size = size;
+    if (m->size == 0) {
+        return 0;
+    }
+    /* a store into a page the filesystem has no room for raises SIGBUS, so
+       every block is reserved up front while running out is still an error */
+    if ((error = posix_fallocate(m->fd, 0, (off_t)size)) != 0) {
+        errno = error;
+        goto _ERROR;
+    }
+    data = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+    if (data == MAP_FAILED) {
+        goto _ERROR;
+    }
+    m->data = data;
+    return 0;
+
+_ERROR:
+    error = errno;
+    close(m->fd);
+    if (regular) {
+        unlink(path);
+    }
+    map_file_reset(m);
+    errno = error;
+    return -1;
+}
+
+int unmap_file(struct file_map* m) {
+    int ret = 0;
+    if (m->cached) {
+        map_cache_unref(m);
+        map_file_reset(m);
+        return 0;
+    }
+    if (m->heap) {
+        free(m->data);
+    } else if (m->data && munmap(m->data, m->size)) {
+        ret = -1;
+    }
+    if (m->fd >= 0 && close(m->fd)) {
+        ret = -1;
+    }
+    map_file_reset(m);
+    return ret;
+}
+#elif defined(_WIN32)
+/* mapping is not implemented here yet; callers fall back to stdio */
+static void map_file_reset(struct file_map* m) {
+    m->data = NULL;
+    m->size = 0;
+    m->fd = -1;
+    m->heap = 0;
+    m->cached = 0;
+}
+
+void map_cache_enable(size_t capacity) {
+    (void)capacity;
+}
+
+int map_file_read(const char* path, struct file_map* m) {
+    (void)path;
+    map_file_reset(m);
+    return -1;
+}
+
+int map_file_write(const char* path, size_t size, struct file_map* m) {
+    (void)size;
+    return map_file_read(path, m);
+}
+
+int map_file_write_from(
+    const char* path,
+    int src_fd,
+    size_t size,
+    struct file_map* m,
+    int* strategy)
+{
+    (void)src_fd;
+    if (strategy) {
+        *strategy = COPY_STRATEGY_NONE;
+    }
+    return map_file_write(path, size, m);
+}
+
+int unmap_file(struct file_map* m) {
+    if (m->heap) {
+        free(m->data);
+    }
+    map_file_reset(m);
+    return 0;
+}
+#endif
+
+int load_file(FILE* f, struct file_map* m) {
+    size_t capacity = 1 << 16;
+
+    map_file_reset(m);
+    m->heap = 1;
+    m->data = xmalloc(capacity);
+    for (;;) {
+        size_t chars_read = fread(m->data + m->size, 1, capacity - m->size, f);
+        m->size += chars_read;
+        if (m->size < capacity) {
+            if (feof(f)) {
+                break;
+            }
+            unmap_file(m);
+            return -1;
+        }
+        capacity *= 2;
+        m->data = xrealloc(m->data, capacity);
+    }
+    return 0;
+}
+
 /*******************************************************************************
 CRC32 functions
 This implementation is based on the algorithm from Annex D of the Portable
 Network Graphics (PNG) Specification (Second Edition)
 <https://www.w3.org/TR/PNG>
+
+The byte-at-a-time table is extended to 16 tables so that 8 or 16 bytes can be
+folded per step ("slicing-by-N"). Where the CPU supports carry-less
+multiplication, 64-byte blocks are folded with PCLMULQDQ as described in Intel's
+"Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction". On
+ARMv8 the CRC32 instructions compute this polynomial directly.
 *******************************************************************************/
-static uint32_t crc32_memo[0x100];
+#if defined(__GNUC__) && defined(__x86_64__)
+    #define CRC32_HAVE_PCLMUL
+    #include <cpuid.h>
+    #include <emmintrin.h>
+    #include <wmmintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+    #define CRC32_HAVE_ARMV8
+    #include <arm_acle.h>
+    #include <sys/auxv.h>
+    #ifndef HWCAP_CRC32
+        #define HWCAP_CRC32 (1 << 7)
+    #endif
+#endif
+
+typedef uint32_t (*crc32_kernel_fn)(uint32_t, const unsigned char*, size_t);
+
+struct crc32_kernel {
+    const char* name;
+    crc32_kernel_fn fn;
+    int (*supported)(void);
+};
+
+#define CRC32_POLY (0xedb88320u)
+
+static uint32_t crc32_memo[16][0x100];
+static const struct crc32_kernel* crc32_active = NULL;
+
+/* x^(2^k) and x^-(2^k) modulo the CRC polynomial, for k = 0..31 */
+static uint32_t crc32_x2n[32];
+static uint32_t crc32_x2n_inv[32];
+
+static int crc32_always_supported(void) {
+    return 1;
+}
+
+static uint32_t crc32_kernel_bytewise(
+    uint32_t crc,
+    const unsigned char* buf,
+    size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; i++) {
+        crc = crc32_memo[0][(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+/* the first four bytes of a slice, xored into the running CRC */
+#define CRC32_SLICE_LO(C, P) ((C) ^ ((uint32_t)(P)[0] \
+    | ((uint32_t)(P)[1] << 8) | ((uint32_t)(P)[2] << 16) \
+    | ((uint32_t)(P)[3] << 24)))
+
+static uint32_t crc32_kernel_slice8(
+    uint32_t crc,
+    const unsigned char* buf,
+    size_t len)
+{
+    while (len >= 8) {
+        uint32_t lo = CRC32_SLICE_LO(crc, buf);
+        crc = crc32_memo[7][lo & 0xff] ^ crc32_memo[6][(lo >> 8) & 0xff]
+            ^ crc32_memo[5][(lo >> 16) & 0xff] ^ crc32_memo[4][lo >> 24]
+            ^ crc32_memo[3][buf[4]] ^ crc32_memo[2][buf[5]]
+            ^ crc32_memo[1][buf[6]] ^ crc32_memo[0][buf[7]];
+        buf += 8;
+        len -= 8;
+    }
+    return crc32_kernel_bytewise(crc, buf, len);
+}
+
+static uint32_t crc32_kernel_slice16(
+    uint32_t crc,
+    const unsigned char* buf,
+    size_t len)
+{
+    while (len >= 16) {
+        uint32_t lo = CRC32_SLICE_LO(crc, buf);
+        crc = crc32_memo[15][lo & 0xff] ^ crc32_memo[14][(lo >> 8) & 0xff]
+            ^ crc32_memo[13][(lo >> 16) & 0xff] ^ crc32_memo[12][lo >> 24]
+            ^ crc32_memo[11][buf[4]] ^ crc32_memo[10][buf[5]]
+            ^ crc32_memo[9][buf[6]] ^ crc32_memo[8][buf[7]]
+            ^ crc32_memo[7][buf[8]] ^ crc32_memo[6][buf[9]]
+            ^ crc32_memo[5][buf[10]] ^ crc32_memo[4][buf[11]]
+            ^ crc32_memo[3][buf[12]] ^ crc32_memo[2][buf[13]]
+            ^ crc32_memo[1][buf[14]] ^ crc32_memo[0][buf[15]];
+        buf += 16;
+        len -= 16;
+    }
+    return crc32_kernel_bytewise(crc, buf, len);
+}
+
+#if defined(CRC32_HAVE_PCLMUL)
+static int crc32_pclmul_supported(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return (ecx & bit_PCLMUL) && (edx & bit_SSE2);
+}
+
+/* fold 128 bits of X forward with the constant pair K, then xor in Y */
+#define CRC32_FOLD(X, K, Y) _mm_xor_si128( \
+    _mm_xor_si128(_mm_clmulepi64_si128((X), (K), 0x00), \
+        _mm_clmulepi64_si128((X), (K), 0x11)), (Y))
+
+__attribute__((target("pclmul,sse2")))
+static uint32_t crc32_kernel_pclmul(
+    uint32_t crc,
+    const unsigned char* buf,
+    size_t len)
+{
+    __m128i x0, x1, x2, x3, x4, mask;
+
+    if (len < 64) {
+        return crc32_kernel_slice16(crc, buf, len);
+    }
+
+    /* x^(4*128+64) and x^(4*128) mod P, etc. (bit-reflected, times x) */
+    x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = _mm_set_epi32(0x00000001, (int)0xc6e41596u, 0x00000001, 0x54442bd4);
+    buf += 64;
+    len -= 64;
+
+    /* fold four 128-bit lanes over each 64-byte block */
+    while (len >= 64) {
+        x1 = CRC32_FOLD(x1, x0, _mm_loadu_si128((const __m128i*)(buf + 0x00)));
+        x2 = CRC32_FOLD(x2, x0, _mm_loadu_si128((const __m128i*)(buf + 0x10)));
+        x3 = CRC32_FOLD(x3, x0, _mm_loadu_si128((const __m128i*)(buf + 0x20)));
+        x4 = CRC32_FOLD(x4, x0, _mm_loadu_si128((const __m128i*)(buf + 0x30)));
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the lanes into one, then any remaining 16-byte blocks */
+    x0 = _mm_set_epi32(0x00000000, (int)0xccaa009eu, 0x00000001, 0x751997d0);
+    x1 = CRC32_FOLD(x1, x0, x2);
+    x1 = CRC32_FOLD(x1, x0, x3);
+    x1 = CRC32_FOLD(x1, x0, x4);
+    while (len >= 16) {
+        x1 = CRC32_FOLD(x1, x0, _mm_loadu_si128((const __m128i*)buf));
+        buf += 16;
+        len -= 16;
+    }
+
+    /* fold 128 bits to 64 */
+    mask = _mm_set_epi32(0, ~0, 0, ~0);
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_set_epi32(0x00000000, 0x00000000, 0x00000001, 0x63cd6124);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, x0, 0x00), x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_set_epi32(0x00000001, (int)0xf7011641u, 0x00000001, (int)0xdb710641u);
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    crc = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+
+    return crc32_kernel_slice16(crc, buf, len);
+}
+#endif
+
+#if defined(CRC32_HAVE_ARMV8)
+static int crc32_armv8_supported(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+__attribute__((target("+crc")))
+static uint32_t crc32_kernel_armv8(
+    uint32_t crc,
+    const unsigned char* buf,
+    size_t len)
+{
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, buf, sizeof(word));
+        crc = __crc32d(crc, word);
+        buf += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = __crc32b(crc, *buf++);
+    }
+    return crc;
+}
+#endif
+
+/* in order of preference */
+static const struct crc32_kernel crc32_kernels[] = {
+#if defined(CRC32_HAVE_PCLMUL)
+    { "pclmul", crc32_kernel_pclmul, crc32_pclmul_supported },
+#endif
+#if defined(CRC32_HAVE_ARMV8)
+    { "armv8", crc32_kernel_armv8, crc32_armv8_supported },
+#endif
+    { "slice16", crc32_kernel_slice16, crc32_always_supported },
+    { "slice8", crc32_kernel_slice8, crc32_always_supported },
+    { "bytewise", crc32_kernel_bytewise, crc32_always_supported }
+};
+
+#define CRC32_KERNEL_COUNT (sizeof(crc32_kernels) / sizeof(crc32_kernels[0]))
+
+/*
+ * Multiplies a and b modulo the CRC polynomial, where both are bit-reflected
+ * polynomials (the x^0 term is the most significant bit). This is the same
+ * approach as zlib's crc32_combine().
+ */
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31;
+    uint32_t p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+    return p;
+}
+
+/* x^(n * 2^k) modulo the CRC polynomial, given a table of x^(2^k) (or the
+   inverses, for x^-(n * 2^k)) */
+static uint32_t crc32_x2nmodp(const uint32_t* table, uint64_t n, unsigned k) {
+    uint32_t p = (uint32_t)1 << 31;
+    while (n) {
+        if (n & 1) {
+            p = crc32_multmodp(table[k & 31], p);
+        }
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
 
 void crc32_init() {
-    const uint32_t poly = 0xedb88320u;
+    const uint32_t poly = CRC32_POLY;
     uint32_t pre;
     uint32_t i;
+    size_t k;
     for (i = 0; i < 0x100; i++) {
         int j;
         pre = i;
@@ -113,17 +1258,56 @@ void crc32_init() {
                 pre >>= 1;
             }
         }
-        crc32_memo[i] = pre;
+        crc32_memo[0][i] = pre;
+    }
+    for (i = 0; i < 0x100; i++) {
+        for (k = 1; k < 16; k++) {
+            pre = crc32_memo[k - 1][i];
+            crc32_memo[k][i] = (pre >> 8) ^ crc32_memo[0][pre & 0xff];
+        }
+    }
+
+    pre = (uint32_t)1 << 30;
+    crc32_x2n[0] = pre;
+    for (k = 1; k < 32; k++) {
+        crc32_x2n[k] = pre = crc32_multmodp(pre, pre);
+    }
+    /* P has a constant term, so x^-1 is (P - 1) / x, or P shifted up by one
+       bit in this reflected representation */
+    pre = (CRC32_POLY << 1) | 1;
+    crc32_x2n_inv[0] = pre;
+    for (k = 1; k < 32; k++) {
+        crc32_x2n_inv[k] = pre = crc32_multmodp(pre, pre);
+    }
+
+    for (k = 0; k < CRC32_KERNEL_COUNT; k++) {
+        if (crc32_kernels[k].supported()) {
+            crc32_active = &crc32_kernels[k];
+            break;
+        }
     }
 }
 
-uint32_t crc32_update(uint32_t crc_prev, void* buf, size_t len) {
-    uint32_t crc_next = crc_prev;
-    size_t i;
-    for (i = 0; i < len; i++) {
-        crc_next = crc32_memo[(crc_next ^ ((unsigned char*)buf)[i]) & 0xff] ^ (crc_next >> 8);
+int crc32_select_kernel(const char* name) {
+    size_t k;
+    for (k = 0; k < CRC32_KERNEL_COUNT; k++) {
+        if (STREQ(crc32_kernels[k].name, name)) {
+            if (!crc32_kernels[k].supported()) {
+                return -1;
+            }
+            crc32_active = &crc32_kernels[k];
+            return 0;
+        }
     }
-    return crc_next;
+    return -1;
+}
+
+const char* crc32_kernel_name(void) {
+    return crc32_active->name;
+}
+
+uint32_t crc32_update(uint32_t crc_prev, void* buf, size_t len) {
+    return crc32_active->fn(crc_prev, buf, len);
 }
 
 uint32_t crc32_finalize(uint32_t crc_prev) {
@@ -133,3 +1317,203 @@ uint32_t crc32_finalize(uint32_t crc_prev) {
 uint32_t crc32_quick(void* buf, size_t len) {
     return crc32_finalize(crc32_update(CRC32_BASE, buf, len));
 }
+
+int crc32_file(FILE* f, uint32_t* crc) {
+    const size_t buflen = (size_t)1 << 20;
+    unsigned char* buf = xmalloc(buflen);
+    uint32_t crc_next = CRC32_BASE;
+    int done = 0;
+
+    while (!done) {
+        size_t chars_read = fread(buf, 1, buflen, f);
+        if (chars_read < buflen) {
+            if (feof(f)) {
+                done = 1;
+            } else {
+                free(buf);
+                return -1;
+            }
+        }
+        crc_next = crc32_update(crc_next, buf, chars_read);
+    }
+
+    free(buf);
+    *crc = crc32_finalize(crc_next);
+    return 0;
+}
+
+int crc32_fwrite(FILE* f, uint32_t* crc, const void* data, size_t len) {
+    *crc = crc32_update(*crc, (void*)data, len);
+    return fwrite(data, 1, len, f) < len;
+}
+
+uint32_t crc32_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b) {
+    /* shift A past len_b zero bytes (8 * len_b bits), then add B */
+    return crc32_multmodp(crc32_x2nmodp(crc32_x2n, len_b, 3), crc_a) ^ crc_b;
+}
+
+uint32_t crc32_shift(uint32_t crc, uint64_t len) {
+    return crc32_multmodp(crc32_x2nmodp(crc32_x2n, len, 3), crc);
+}
+
+uint32_t crc32_unshift(uint32_t crc, uint64_t len) {
+    return crc32_multmodp(crc32_x2nmodp(crc32_x2n_inv, len, 3), crc);
+}
+
+#if defined(__linux__)
+struct crc32_job {
+    int fd;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t crc;
+    int failed;
+};
+
+static void* crc32_job_run(void* arg) {
+    struct crc32_job* job = arg;
+    const size_t buflen = (size_t)1 << 20;
+    unsigned char* buf = xmalloc(buflen);
+    uint64_t done = 0;
+    uint32_t crc = CRC32_BASE;
+
+    while (done < job->length) {
+        size_t want = job->length - done < buflen
+            ? (size_t)(job->length - done) : buflen;
+        ssize_t n = pread(job->fd, buf, want, (off_t)(job->offset + done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            job->failed = 1;
+            break;
+        }
+        crc = crc32_update(crc, buf, (size_t)n);
+        done += (uint64_t)n;
+    }
+
+    job->crc = crc32_finalize(crc);
+    free(buf);
+    return NULL;
+}
+
+int crc32_fd_parallel(int fd, uint64_t length, int jobs, uint32_t* crc) {
+    const uint64_t min_chunk = (uint64_t)1 << 20;
+    struct crc32_job* job = NULL;
+    uint64_t chunk = 0;
+    int failed = 0;
+    int i;
+
+    if (jobs < 1) {
+        return -1;
+    }
+    /* don't bother splitting small inputs */
+    if (length / min_chunk < (uint64_t)jobs) {
+        jobs = (int)(length / min_chunk) + 1;
+    }
+    chunk = length / jobs;
+
+    job = xmalloc(jobs * sizeof(*job));
+    for (i = 0; i < jobs; i++) {
+        job[i].fd = fd;
+        job[i].offset = chunk * i;
+        job[i].length = i == jobs - 1 ? length - chunk * i : chunk;
+        job[i].crc = 0;
+        job[i].failed = 0;
+    }
+
+    run_parallel(job, (size_t)jobs, sizeof(*job), crc32_job_run);
+
+    *crc = job[0].crc;
+    failed = job[0].failed;
+    for (i = 1; i < jobs; i++) {
+        *crc = crc32_combine(*crc, job[i].crc, job[i].length);
+        failed |= job[i].failed;
+    }
+
+    free(job);
+    return failed ? -1 : 0;
+}
+
+int crc32_file_parallel(FILE* f, int jobs, uint32_t* crc) {
+    struct stat st;
+    int fd = fileno(f);
+    if (fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        return 1;
+    }
+    return crc32_fd_parallel(fd, (uint64_t)st.st_size, jobs, crc) ? -1 : 0;
+}
+
+void run_parallel(void* jobs, size_t count, size_t size, void* (*run)(void*)) {
+    unsigned char* job = jobs;
+    pthread_t* threads = NULL;
+    size_t started = 0;
+    size_t i;
+
+    if (count == 0) {
+        return;
+    }
+    threads = xmalloc(count * sizeof(*threads));
+    for (i = 1; i < count; i++) {
+        if (pthread_create(&threads[i], NULL, run, job + i * size)) {
+            break;
+        }
+        started = i;
+    }
+    run(job);
+    for (i = 1; i <= started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = started + 1; i < count; i++) {
+        run(job + i * size);
+    }
+    free(threads);
+}
+
+int cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : (int)n;
+}
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+#elif defined(_WIN32)
+int crc32_fd_parallel(int fd, uint64_t length, int jobs, uint32_t* crc) {
+    (void)fd;
+    (void)length;
+    (void)jobs;
+    (void)crc;
+    return -1;
+}
+
+int crc32_file_parallel(FILE* f, int jobs, uint32_t* crc) {
+    (void)f;
+    (void)jobs;
+    (void)crc;
+    return 1;
+}
+
+void run_parallel(void* jobs, size_t count, size_t size, void* (*run)(void*)) {
+    size_t i;
+    for (i = 0; i < count; i++) {
+        run((unsigned char*)jobs + i * size);
+    }
+}
+
+int cpu_count(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors < 1 ? 1 : (int)info.dwNumberOfProcessors;
+}
+
+uint64_t monotonic_ns(void) {
+    LARGE_INTEGER count;
+    LARGE_INTEGER freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000u
+        + (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000u
+            / (uint64_t)freq.QuadPart;
+}
+#endif
@@ -11,31 +11,283 @@
  */
 void* xmalloc(size_t size);
 
+/**
+ * Like realloc(), but abort()s with a message on stderr if allocation fails.
+ */
+void* xrealloc(void* p, size_t size);
+
+/**
+ * Returns the number of online CPUs, or 1 if it can't be determined.
+ */
+int cpu_count(void);
+
+/**
+ * Calls run on each of the count elements, size bytes apart, of the array
+ * jobs, each on its own thread. The calling thread runs the first element
+ * itself, and any element whose thread couldn't be started once the others
+ * have finished; run_parallel() returns when every call has. Outside Linux,
+ * the calls are made one after another.
+ */
+void run_parallel(void* jobs, size_t count, size_t size, void* (*run)(void*));
+
+/**
+ * Returns a monotonic clock reading in nanoseconds, for timing.
+ */
+uint64_t monotonic_ns(void);
+
 /* Truthy if two string compare equal */
 #define STREQ(A, B) (!strcmp((A), (B)))
 
 #define MEMEQ(A, B, L) (!memcmp((A), (B), (L)))
 
+/**
+ * Stores value at out as a width-byte big-endian integer.
+ */
+void encode_big_endian_n(unsigned char* out, uint64_t value, int width);
+
+/**
+ * Loads a width-byte big-endian integer from in.
+ */
+uint64_t decode_big_endian_n(const unsigned char* in, int width);
+
+/**
+ * Like xmalloc(), but the returned memory is aligned to alignment bytes (a
+ * power of two). Must be released with free_aligned().
+ */
+void* xmalloc_aligned(size_t alignment, size_t size);
+void free_aligned(void* p);
+
 /**
  * Truncates a file to a certain number of bytes in length, then seeks to the
  * end of the file. Returns 0 on success or nonzero on error.
  */
-int truncate_file(FILE* f, int bytes);
+int truncate_file(FILE* f, uint64_t bytes);
 
 /**
- * Copies all data from src to dest. Data is read from src and written to dest
- * starting at the current file offset. Returns 0 on success or nonzero on
+ * Makes length bytes of f at offset read as zeros without writing them: the
+ * part inside the file is deallocated (FALLOC_FL_PUNCH_HOLE), and the file is
+ * extended with a hole if it ends before offset + length. f is flushed first.
+ * Returns 0 on success, or nonzero if the file or filesystem can't do this,
+ * in which case the caller should write the zeros itself.
+ */
+int punch_hole(FILE* f, uint64_t offset, uint64_t length);
+
+/**
+ * Flushes f and waits for its data to reach the disk. Returns 0 on success or
+ * nonzero on error.
+ */
+int sync_file(FILE* f);
+
+/**
+ * Waits for the entry of path in its directory (e.g. a file that was just
+ * created or removed) to reach the disk. Returns 0 on success or nonzero on
  * error.
  */
-int copy_file(FILE* src, FILE* dest);
+int sync_parent_dir(const char* path);
+
+/**
+ * Creates the directory at path if it doesn't exist yet. Returns 0 on success
+ * (or if it already exists) or nonzero on error.
+ */
+int make_dir(const char* path);
+
+/**
+ * Renames the file at from to to in one step, replacing any file already at
+ * to. Returns 0 on success or nonzero on error.
+ */
+int replace_file(const char* from, const char* to);
+
+/**
+ * Returns the ID of the calling process, e.g. to keep temporary file names
+ * of concurrent processes apart.
+ */
+unsigned long process_id(void);
+
+/* ways in which copy_fd() and copy_file() can move data */
+#define COPY_STRATEGY_NONE 0
+#define COPY_STRATEGY_REFLINK 1
+#define COPY_STRATEGY_COPY_FILE_RANGE 2
+#define COPY_STRATEGY_SENDFILE 3
+#define COPY_STRATEGY_READ_WRITE 4
+#define COPY_STRATEGY_SPARSE 5
+
+extern const char* COPY_STRATEGY_STR[];
+
+/**
+ * Copies all data from the file descriptor src to dest, starting at their
+ * current offsets. The cheapest available mechanism is used: a reflink
+ * (FICLONE) for whole-file copies into an empty file, then copy_file_range,
+ * then sendfile, and finally a read/write loop. If strategy is non-NULL it
+ * receives the COPY_STRATEGY_* value that finished the copy. Returns 0 on
+ * success or nonzero on error.
+ */
+int copy_fd(int src, int dest, int* strategy);
+
+/**
+ * Like copy_fd(), but src must be a regular file, which is copied from
+ * src_offset without using or moving its file offset. This makes it safe for
+ * several threads to copy from the same src at once.
+ */
+int copy_fd_at(int src, uint64_t src_offset, int dest, int* strategy);
+
+/**
+ * Copies all data from src to dest. Data is read from src and written to dest
+ * starting at the current file offset. Seekable files are copied with
+ * copy_fd(). If strategy is non-NULL it receives the COPY_STRATEGY_* value
+ * used. Returns 0 on success or nonzero on error.
+ */
+int copy_file(FILE* src, FILE* dest, int* strategy);
+
+/**
+ * Like copy_file(), but holes in src stay holes in dest: only the data
+ * regions src reports with SEEK_DATA/SEEK_HOLE are copied, and dest is then
+ * extended over a trailing hole. dest must be empty. Falls back to
+ * copy_file() where src or dest isn't a regular file or holes can't be found.
+ */
+int copy_file_sparse(FILE* src, FILE* dest, int* strategy);
+
+/* a piece of a gathered write */
+struct write_span {
+    const void* data;
+    size_t length;
+};
+
+/**
+ * Writes the contents of count spans back to back, starting at offset in f,
+ * with as few system calls as possible (pwritev() on Linux). f is flushed
+ * first. If calls is non-NULL, it is incremented once per write call made.
+ * Returns 0 on success or nonzero on error.
+ */
+int write_spans_at(
+    FILE* f,
+    uint64_t offset,
+    const struct write_span* spans,
+    size_t count,
+    size_t* calls);
+
+/*******************************************************************************
+Memory-mapped files
+*******************************************************************************/
+struct file_map {
+    unsigned char* data;
+    size_t size;
+    int fd;
+    int heap;   /* data was read into a heap buffer by load_file() */
+    int cached; /* data is shared with the map cache */
+};
+
+/**
+ * Maps the whole regular file at path into memory, read-only. An empty file
+ * yields a NULL data pointer and a size of 0. Returns 0 on success or nonzero
+ * on error, including when the file cannot be mapped (e.g. it is a pipe).
+ */
+int map_file_read(const char* path, struct file_map* m);
+
+/**
+ * Makes map_file_read() keep up to capacity files mapped after they are
+ * unmapped, for a long-lived process that reads the same files again and
+ * again. A file is looked up by path and mapped again once its device, inode,
+ * size or modification time changes; the least recently used file that is not
+ * mapped anywhere is evicted to make room. Maps handed out by the cache share
+ * one mapping and descriptor, which must not be seeked. Thread-safe, but must
+ * be called once, before any file is mapped. Does nothing outside Linux.
+ */
+void map_cache_enable(size_t capacity);
+
+/**
+ * Creates or truncates the file at path, resizes it to size bytes (which reads
+ * back as zeros), allocates all of its blocks and maps it read-write. Returns 0
+ * on success, or nonzero with errno set on error (ENOSPC if the filesystem is
+ * too full), in which case a regular file left at path is removed.
+ */
+int map_file_write(const char* path, size_t size, struct file_map* m);
+
+/**
+ * Like map_file_write(), but the file's contents are first copied from the
+ * start of the regular file open as src_fd with copy_fd_at(), then resized. If
+ * strategy is non-NULL it receives the COPY_STRATEGY_* value used.
+ */
+int map_file_write_from(
+    const char* path,
+    int src_fd,
+    size_t size,
+    struct file_map* m,
+    int* strategy);
+
+/**
+ * Reads all remaining data from f into a heap buffer described by m, for
+ * streams that can't be mapped. Returns 0 on success or nonzero on error.
+ */
+int load_file(FILE* f, struct file_map* m);
+
+/**
+ * Unmaps and closes a file mapped with map_file_read() or map_file_write(),
+ * or frees the buffer of one loaded with load_file().
+ * Returns 0 on success or nonzero on error.
+ */
+int unmap_file(struct file_map* m);
 
 /*******************************************************************************
 CRC32 functions
 *******************************************************************************/
 #define CRC32_BASE (0xffffffffu)
 void crc32_init();
+
+/**
+ * crc32_init() selects the fastest CRC32 kernel this CPU supports. These
+ * report the selected kernel's name and select one explicitly (after
+ * crc32_init()) by name: "pclmul", "armv8", "slice16", "slice8" or
+ * "bytewise". crc32_select_kernel() returns 0 on success or nonzero if the
+ * kernel is unknown or unsupported here.
+ */
+const char* crc32_kernel_name(void);
+int crc32_select_kernel(const char* name);
+
 uint32_t crc32_update(uint32_t crc_prev, void* buf, size_t len);
 uint32_t crc32_finalize(uint32_t crc_prev);
 uint32_t crc32_quick(void* buf, size_t len);
 
+/**
+ * Computes the finalized CRC32 of everything from the current position of f
+ * to its end. Returns 0 on success or nonzero on error.
+ */
+int crc32_file(FILE* f, uint32_t* crc);
+
+/**
+ * Writes len bytes from data to f and continues the unfinalized CRC32 *crc
+ * over them, for files that end in a checksum of their contents. Returns 0 on
+ * success or nonzero on error.
+ */
+int crc32_fwrite(FILE* f, uint32_t* crc, const void* data, size_t len);
+
+/**
+ * Given the finalized CRC32s of two byte strings A and B, and the length of B
+ * in bytes, returns the finalized CRC32 of A followed by B.
+ */
+uint32_t crc32_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b);
+
+/**
+ * Advances an unfinalized CRC32 state (as returned by crc32_update()) over
+ * len zero bytes, or undoes that. Since the CRC is linear, these also shift
+ * the CRC of a byte-wise difference (computed from a state of 0) to where it
+ * sits in a longer string.
+ */
+uint32_t crc32_shift(uint32_t crc, uint64_t len);
+uint32_t crc32_unshift(uint32_t crc, uint64_t len);
+
+/**
+ * Computes the finalized CRC32 of the first length bytes of the file
+ * descriptor fd (which must support pread) by splitting it into up to jobs
+ * chunks that are hashed on separate threads and joined with crc32_combine().
+ * Returns 0 on success or nonzero on error.
+ */
+int crc32_fd_parallel(int fd, uint64_t length, int jobs, uint32_t* crc);
+
+/**
+ * Like crc32_fd_parallel(), for the whole of the file f. Returns 0 on success,
+ * a positive value if f is not a regular file (nothing has been read, so the
+ * caller can hash it serially) or a negative value on error.
+ */
+int crc32_file_parallel(FILE* f, int jobs, uint32_t* crc);
+
 #endif